@@ -0,0 +1,508 @@
+#ifndef BUDDY_HEAP_H
+#define BUDDY_HEAP_H
+
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// The buddy engine as a template, for services that want a heap of their own
+// tuned to their sizes:
+//
+//   BuddyHeap<MinBlockLog2, MaxOrder, ChunkSize, StatsPolicy, LockPolicy>
+//
+// Blocks are 2^MinBlockLog2 << order bytes, header included, for orders 0 to
+// MaxOrder. Memory is mapped ChunkSize bytes at a time, aligned to the largest
+// block so buddies are found by address; anything larger than the largest
+// block is mapped on its own. Every size and order computation is constexpr
+// over the parameters, so a configuration costs nothing at run time.
+//
+// Unlike malloc_3 the free lists are unordered and doubly linked, so taking a
+// block off one is O(1). Each block also carries the highest order it may
+// merge up to, which is how a chunk gives up its first bytes to bookkeeping:
+// what is left is carved into the largest aligned blocks that fit, and those
+// never merge past their own size. A heap can also run over a region the
+// caller owns, whose edges need not be aligned at all.
+//
+// Free-list links are offsets from the heap object rather than pointers. A
+// heap placed at the start of a shared mapping, with BuddySharedMutexLock,
+// therefore works wherever each process maps it.
+//
+// malloc_3.cpp stays the global engine; this is for instances.
+
+constexpr size_t BUDDY_MAX_ALLOCATION = 100000000;
+constexpr size_t BUDDY_PAGE_SIZE = 4096;
+
+// Stats policies. BuddyCountStats keeps the counters my_stdlib.h reports, in
+// usable bytes; BuddyNoStats compiles them away.
+struct BuddyCountStats {
+    size_t free_blocks = 0;
+    size_t free_bytes = 0;
+    size_t allocated_blocks = 0;   // free and used, mapped blocks included
+    size_t allocated_bytes = 0;
+    size_t mapped_blocks = 0;      // blocks above the largest order
+    size_t chunks = 0;
+
+    void add_block(size_t usable) {
+        allocated_blocks++;
+        allocated_bytes += usable;
+    }
+    void remove_block(size_t usable) {
+        allocated_blocks--;
+        allocated_bytes -= usable;
+    }
+    void mark_free(size_t usable) {
+        free_blocks++;
+        free_bytes += usable;
+    }
+    void mark_used(size_t usable) {
+        free_blocks--;
+        free_bytes -= usable;
+    }
+    void add_mapped(size_t usable) {
+        add_block(usable);
+        mapped_blocks++;
+    }
+    void remove_mapped(size_t usable) {
+        remove_block(usable);
+        mapped_blocks--;
+    }
+    void add_chunk() { chunks++; }
+};
+
+struct BuddyNoStats {
+    void add_block(size_t) {}
+    void remove_block(size_t) {}
+    void mark_free(size_t) {}
+    void mark_used(size_t) {}
+    void add_mapped(size_t) {}
+    void remove_mapped(size_t) {}
+    void add_chunk() {}
+};
+
+// Lock policies. lock() returns whether the lock was taken; a heap whose lock
+// cannot be taken refuses every call.
+struct BuddyNoLock {
+    bool lock() { return true; }
+    void unlock() {}
+};
+
+class BuddyMutexLock {
+public:
+    bool lock() {
+        pthread_mutex_lock(&mutex_);
+        return true;
+    }
+    void unlock() { pthread_mutex_unlock(&mutex_); }
+
+private:
+    pthread_mutex_t mutex_ = PTHREAD_MUTEX_INITIALIZER;
+};
+
+// Takes turns between processes too, for a heap in shared memory. The mutex
+// is robust: a process that dies holding it may have left the free lists half
+// linked, so the next lock() leaves it unrecoverable rather than trust them,
+// and from then on lock() fails in every process instead of waiting forever.
+class BuddySharedMutexLock {
+public:
+    BuddySharedMutexLock() {
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&mutex_, &attr);
+        pthread_mutexattr_destroy(&attr);
+    }
+    ~BuddySharedMutexLock() { pthread_mutex_destroy(&mutex_); }
+    BuddySharedMutexLock(const BuddySharedMutexLock &) = delete;
+    BuddySharedMutexLock &operator=(const BuddySharedMutexLock &) = delete;
+
+    bool lock() {
+        int error = pthread_mutex_lock(&mutex_);
+        if (error == EOWNERDEAD) pthread_mutex_unlock(&mutex_);
+        return error == 0;
+    }
+    void unlock() { pthread_mutex_unlock(&mutex_); }
+
+private:
+    pthread_mutex_t mutex_;
+};
+
+template <int MinBlockLog2, int MaxOrder, size_t ChunkSize, class StatsPolicy = BuddyCountStats,
+          class LockPolicy = BuddyNoLock>
+class BuddyHeap {
+    struct Block {
+        uint8_t order;
+        uint8_t limit;       // highest order this block may merge up to
+        bool is_free;
+        bool is_mapped;      // above the largest order, mapped on its own
+        size_t length;       // mapped length, for mapped blocks only
+        // Only meaningful while the block is free, in its payload.
+        intptr_t next_free;
+        intptr_t prev_free;
+    };
+
+    // Links every mapped block in front of its header, so that the heap can
+    // let go of them all at once.
+    struct MappedLinks {
+        MappedLinks *next;
+        MappedLinks *prev;
+    };
+
+    struct ChunkHeader {
+        ChunkHeader *next;
+        size_t length;
+    };
+
+public:
+    static constexpr int NUM_ORDERS = MaxOrder + 1;
+    static constexpr size_t MIN_BLOCK = size_t(1) << MinBlockLog2;
+    static constexpr size_t MAX_BLOCK = MIN_BLOCK << MaxOrder;
+    static constexpr size_t HEADER_SIZE = offsetof(Block, next_free);
+
+    static_assert(MinBlockLog2 >= 5 && MIN_BLOCK >= sizeof(Block), "a free block must hold its links");
+    static_assert(MaxOrder >= 0 && MinBlockLog2 + MaxOrder < 48, "orders out of range");
+    static_assert(ChunkSize % MAX_BLOCK == 0 && ChunkSize >= 2 * MAX_BLOCK,
+                  "a chunk holds at least two of the largest blocks");
+    static_assert(HEADER_SIZE % 16 == 0, "payloads stay 16-byte aligned");
+
+    static constexpr size_t block_size(int order) { return MIN_BLOCK << order; }
+    static constexpr size_t usable_size(int order) { return block_size(order) - HEADER_SIZE; }
+
+    // The smallest order whose usable size holds size bytes, or above
+    // MaxOrder when the request must be mapped.
+    static constexpr int order_for(size_t size) {
+        size_t blocks = (size + HEADER_SIZE + MIN_BLOCK - 1) >> MinBlockLog2;
+        return blocks <= 1 ? 0 : 64 - __builtin_clzll(blocks - 1);
+    }
+
+    // Usable bytes per order, for callers that size their objects to fit.
+    struct OrderTable {
+        size_t usable[NUM_ORDERS];
+    };
+    static constexpr OrderTable ORDERS = [] {
+        OrderTable table{};
+        for (int order = 0; order < NUM_ORDERS; order++) table.usable[order] = usable_size(order);
+        return table;
+    }();
+
+    BuddyHeap() = default;
+
+    // A heap over [base, base + length), which stays the caller's. It never
+    // maps memory: requests that the region cannot hold fail.
+    BuddyHeap(void *base, size_t length) : fixed_(true) { add_region(base, length); }
+    ~BuddyHeap() { release_all(); }
+    BuddyHeap(const BuddyHeap &) = delete;
+    BuddyHeap &operator=(const BuddyHeap &) = delete;
+
+    void *allocate(size_t size) {
+        if (size == 0 || size > BUDDY_MAX_ALLOCATION) return nullptr;
+        int order = order_for(size);
+        Guard guard(lock_);
+        if (!guard) return nullptr;
+        Block *block = order > MaxOrder ? map_block(size) : take_block(order);
+        return block == nullptr ? nullptr : payload(block);
+    }
+
+    void *allocate_zeroed(size_t num, size_t size) {
+        if (size != 0 && num > BUDDY_MAX_ALLOCATION / size) return nullptr;
+        void *p = allocate(num * size);
+        if (p != nullptr) memset(p, 0, num * size);
+        return p;
+    }
+
+    void free(void *p) {
+        if (p == nullptr) return;
+        Block *block = header_of(p);
+        Guard guard(lock_);
+        if (!guard || block->is_free) return;
+        if (block->is_mapped) {
+            unmap_block(block);
+        } else {
+            release_block(block);
+        }
+    }
+
+    void *reallocate(void *p, size_t size) {
+        if (size == 0 || size > BUDDY_MAX_ALLOCATION) return nullptr;
+        if (p == nullptr) return allocate(size);
+
+        Block *block = header_of(p);
+        size_t usable;
+        {
+            Guard guard(lock_);
+            if (!guard) return nullptr;
+            usable = usable_of(block);
+            if (size <= usable) return p;
+            if (!block->is_mapped && grow_in_place(block, order_for(size))) return p;
+        }
+
+        void *moved = allocate(size);
+        if (moved != nullptr) {
+            memcpy(moved, p, usable);
+            free(p);
+        }
+        return moved;
+    }
+
+    // Usable bytes of an allocated block.
+    size_t usable_of(const void *p) const { return usable_of(header_of(const_cast<void *>(p))); }
+
+    // Hands [base, base + length) to the heap, carved into the largest
+    // aligned blocks that fit between its edges. Returns the bytes carved.
+    size_t add_region(void *base, size_t length) {
+        auto begin = reinterpret_cast<uintptr_t>(base);
+        uintptr_t first = (begin + MIN_BLOCK - 1) & ~(MIN_BLOCK - 1);
+        uintptr_t last = (begin + length) & ~(MIN_BLOCK - 1);
+        if (length < MIN_BLOCK || first >= last) return 0;
+        Guard guard(lock_);
+        if (!guard) return 0;
+        carve(reinterpret_cast<char *>(first), reinterpret_cast<char *>(last));
+        return last - first;
+    }
+
+    // Unmaps every chunk and mapped block, leaving an empty heap. Regions
+    // are left to their owners and no longer used.
+    void release_all() {
+        Guard guard(lock_);
+        if (!guard) return;
+        while (mapped_ != nullptr) {
+            MappedLinks *links = mapped_;
+            mapped_ = links->next;
+            Block *block = reinterpret_cast<Block *>(links + 1);
+            stats_.remove_mapped(block->length - sizeof(MappedLinks) - HEADER_SIZE);
+            munmap(links, block->length);
+        }
+        while (chunks_ != nullptr) {
+            ChunkHeader *chunk = chunks_;
+            chunks_ = chunk->next;
+            munmap(chunk, chunk->length);
+        }
+        for (intptr_t &head : free_lists_) head = 0;
+        stats_ = StatsPolicy{};
+    }
+
+    const StatsPolicy &stats() const { return stats_; }
+
+    // Runs fn with the heap locked, for state kept next to the heap. Returns
+    // false, without running fn, if the lock cannot be taken.
+    template <class Fn>
+    bool run_locked(Fn fn) {
+        Guard guard(lock_);
+        if (!guard) return false;
+        fn();
+        return true;
+    }
+
+private:
+    class Guard {
+    public:
+        explicit Guard(LockPolicy &lock) : lock_(lock), held_(lock.lock()) {}
+        ~Guard() {
+            if (held_) lock_.unlock();
+        }
+        Guard(const Guard &) = delete;
+        Guard &operator=(const Guard &) = delete;
+
+        explicit operator bool() const { return held_; }
+
+    private:
+        LockPolicy &lock_;
+        bool held_;
+    };
+
+    static void *payload(Block *block) { return reinterpret_cast<char *>(block) + HEADER_SIZE; }
+
+    static Block *header_of(void *p) { return reinterpret_cast<Block *>(static_cast<char *>(p) - HEADER_SIZE); }
+
+    static size_t usable_of(const Block *block) {
+        return block->is_mapped ? block->length - sizeof(MappedLinks) - HEADER_SIZE : usable_size(block->order);
+    }
+
+    static Block *buddy_of(Block *block) {
+        return reinterpret_cast<Block *>(reinterpret_cast<uintptr_t>(block) ^ block_size(block->order));
+    }
+
+    // Links are offsets from the heap object, which is never a block, so 0
+    // stands for none.
+    Block *block_at(intptr_t link) {
+        return reinterpret_cast<Block *>(reinterpret_cast<uintptr_t>(this) + link);
+    }
+
+    intptr_t link_to(Block *block) const {
+        return static_cast<intptr_t>(reinterpret_cast<uintptr_t>(block) - reinterpret_cast<uintptr_t>(this));
+    }
+
+    void push_free(Block *block) {
+        intptr_t &head = free_lists_[block->order];
+        block->is_free = true;
+        block->prev_free = 0;
+        block->next_free = head;
+        if (head != 0) block_at(head)->prev_free = link_to(block);
+        head = link_to(block);
+        stats_.mark_free(usable_size(block->order));
+    }
+
+    void unlink_free(Block *block) {
+        if (block->prev_free == 0) {
+            free_lists_[block->order] = block->next_free;
+        } else {
+            block_at(block->prev_free)->next_free = block->next_free;
+        }
+        if (block->next_free != 0) block_at(block->next_free)->prev_free = block->prev_free;
+        block->is_free = false;
+        stats_.mark_used(usable_size(block->order));
+    }
+
+    // Lays [begin, end) out as the largest aligned blocks that fit, each one
+    // free and unable to merge past its own order. Both ends are multiples of
+    // MIN_BLOCK.
+    void carve(char *begin, char *end) {
+        while (begin < end) {
+            int order = MaxOrder;
+            while (order > 0 && (reinterpret_cast<uintptr_t>(begin) % block_size(order) != 0 ||
+                                 static_cast<size_t>(end - begin) < block_size(order))) {
+                order--;
+            }
+            auto *block = reinterpret_cast<Block *>(begin);
+            block->order = static_cast<uint8_t>(order);
+            block->limit = static_cast<uint8_t>(order);
+            block->is_mapped = false;
+            stats_.add_block(usable_size(order));
+            push_free(block);
+            begin += block_size(order);
+        }
+    }
+
+    bool add_chunk() {
+        constexpr size_t reserved = (sizeof(ChunkHeader) + MIN_BLOCK - 1) / MIN_BLOCK * MIN_BLOCK;
+        // Pages are aligned already; larger blocks need the mapping trimmed.
+        constexpr size_t slack = MAX_BLOCK > BUDDY_PAGE_SIZE ? MAX_BLOCK : 0;
+        void *raw = mmap(nullptr, ChunkSize + slack, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw == MAP_FAILED) return false;
+        char *start = static_cast<char *>(raw);
+        char *base = reinterpret_cast<char *>((reinterpret_cast<uintptr_t>(start) + MAX_BLOCK - 1) & ~(MAX_BLOCK - 1));
+        if (base != start) munmap(start, base - start);
+        if (base != start + slack) munmap(base + ChunkSize, start + slack - base);
+
+        auto *chunk = reinterpret_cast<ChunkHeader *>(base);
+        chunk->next = chunks_;
+        chunk->length = ChunkSize;
+        chunks_ = chunk;
+        stats_.add_chunk();
+        carve(base + reserved, base + ChunkSize);
+        return true;
+    }
+
+    // A used block of exactly order, split off a larger free one if need be.
+    Block *take_block(int order) {
+        int found = order;
+        while (found <= MaxOrder && free_lists_[found] == 0) found++;
+        if (found > MaxOrder) {
+            if (fixed_) return nullptr;
+            // A fresh chunk always holds a block of the largest order.
+            if (!add_chunk()) return nullptr;
+            found = order;
+            while (free_lists_[found] == 0) found++;
+        }
+
+        Block *block = block_at(free_lists_[found]);
+        unlink_free(block);
+        while (block->order > order) {
+            stats_.remove_block(usable_size(block->order));
+            block->order--;
+            stats_.add_block(usable_size(block->order));
+            Block *buddy = buddy_of(block);
+            buddy->order = block->order;
+            buddy->limit = block->limit;
+            buddy->is_mapped = false;
+            stats_.add_block(usable_size(buddy->order));
+            push_free(buddy);
+        }
+        return block;
+    }
+
+    // Frees a used block, merging it with its free buddies.
+    void release_block(Block *block) {
+        while (block->order < block->limit) {
+            Block *buddy = buddy_of(block);
+            if (!buddy->is_free || buddy->order != block->order) break;
+            unlink_free(buddy);
+            stats_.remove_block(usable_size(buddy->order));
+            stats_.remove_block(usable_size(block->order));
+            if (buddy < block) block = buddy;
+            block->order++;
+            stats_.add_block(usable_size(block->order));
+        }
+        push_free(block);
+    }
+
+    // Grows a used block to order by absorbing free upper buddies, when the
+    // block is the lower half all the way up.
+    bool grow_in_place(Block *block, int order) {
+        if (order > block->limit) return false;
+        for (int current = block->order; current < order; current++) {
+            auto *buddy = reinterpret_cast<Block *>(reinterpret_cast<char *>(block) + block_size(current));
+            if (reinterpret_cast<uintptr_t>(block) % block_size(current + 1) != 0 || !buddy->is_free ||
+                buddy->order != current) {
+                return false;
+            }
+        }
+        while (block->order < order) {
+            Block *buddy = buddy_of(block);
+            unlink_free(buddy);
+            stats_.remove_block(usable_size(buddy->order));
+            stats_.remove_block(usable_size(block->order));
+            block->order++;
+            stats_.add_block(usable_size(block->order));
+        }
+        return true;
+    }
+
+    Block *map_block(size_t size) {
+        if (fixed_) return nullptr;
+        size_t length = sizeof(MappedLinks) + HEADER_SIZE + size;
+        void *raw = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw == MAP_FAILED) return nullptr;
+
+        auto *links = static_cast<MappedLinks *>(raw);
+        links->prev = nullptr;
+        links->next = mapped_;
+        if (mapped_ != nullptr) mapped_->prev = links;
+        mapped_ = links;
+
+        auto *block = reinterpret_cast<Block *>(links + 1);
+        block->order = static_cast<uint8_t>(MaxOrder + 1);
+        block->limit = 0;
+        block->is_free = false;
+        block->is_mapped = true;
+        block->length = length;
+        stats_.add_mapped(size);
+        return block;
+    }
+
+    void unmap_block(Block *block) {
+        auto *links = reinterpret_cast<MappedLinks *>(block) - 1;
+        if (links->prev == nullptr) {
+            mapped_ = links->next;
+        } else {
+            links->prev->next = links->next;
+        }
+        if (links->next != nullptr) links->next->prev = links->prev;
+        stats_.remove_mapped(usable_of(block));
+        munmap(links, block->length);
+    }
+
+    static_assert(sizeof(MappedLinks) % 16 == 0, "payloads stay 16-byte aligned");
+
+    intptr_t free_lists_[NUM_ORDERS] = {0};
+    ChunkHeader *chunks_ = nullptr;
+    MappedLinks *mapped_ = nullptr;
+    bool fixed_ = false;
+    StatsPolicy stats_;
+    LockPolicy lock_;
+};
+
+#endif /* BUDDY_HEAP_H */
@@ -0,0 +1,99 @@
+#ifndef HEAP_CHUNK_H
+#define HEAP_CHUNK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+
+// Hands out heap memory for the sbrk engines (malloc_1.cpp, malloc_2.cpp).
+//
+// By default every request moves the break by exactly its size, so sbrk(0)
+// stays at the end of the last block; the spec tests check this through
+// verify_size. Building with MALLOC_SBRK_CHUNK=<bytes> grows the break in
+// chunks instead, starting at that size and doubling up to SBRK_CHUNK_MAX,
+// and requests are bump-allocated from the slack without a syscall.
+
+#ifndef MALLOC_SBRK_CHUNK
+#define MALLOC_SBRK_CHUNK 0
+#endif
+
+constexpr size_t SBRK_CHUNK_MIN = MALLOC_SBRK_CHUNK;
+constexpr size_t SBRK_CHUNK_MAX = size_t(64) << 20;
+
+struct HeapChunk {
+    char* top = nullptr;    // end of the memory handed out so far
+    char* end = nullptr;    // break as we last left it
+    size_t next_chunk = SBRK_CHUNK_MIN;
+
+    // Returns size contiguous bytes, or nullptr if the break cannot move.
+    void* alloc(size_t size) {
+        if (top == nullptr || static_cast<size_t>(end - top) < size) {
+            if (!grow(size)) {
+                return nullptr;
+            }
+        }
+        void* ptr = top;
+        top += size;
+        return ptr;
+    }
+
+    // Extends the most recent allocation, which ends at block_end, by size
+    // bytes. Fails if anything was allocated after it.
+    bool extend(void* block_end, size_t size) {
+        if (block_end != top) {
+            return false;
+        }
+        if (static_cast<size_t>(end - top) < size && !grow(size)) {
+            return false;
+        }
+        // Someone else moved the break, so the new memory is not contiguous.
+        if (block_end != top) {
+            return false;
+        }
+        top += size;
+        return true;
+    }
+
+    // Takes back the last size bytes handed out, which end at block_end, and
+    // lowers the break over them and any chunk slack. Returns the bytes the
+    // break moved down, or 0 if anything else moved the break.
+    size_t release(void* block_end, size_t size) {
+        if (block_end != top || sbrk(0) != end) {
+            return 0;
+        }
+        size_t length = size + (end - top);
+        if (sbrk(-static_cast<intptr_t>(length)) == reinterpret_cast<void*>(-1)) {
+            return 0;
+        }
+        top -= size;
+        end = top;
+        next_chunk = SBRK_CHUNK_MIN;
+        return length;
+    }
+
+private:
+    bool grow(size_t size) {
+        char* brk = static_cast<char*>(sbrk(0));
+        bool contiguous = top != nullptr && brk == end;
+        size_t need = contiguous ? size - (end - top) : size;
+        size_t amount = need < next_chunk ? next_chunk : need;
+
+        if (sbrk(amount) == reinterpret_cast<void*>(-1)) {
+            // Near the limit a chunk may not fit where the request still does.
+            if (amount == need || sbrk(need) == reinterpret_cast<void*>(-1)) {
+                return false;
+            }
+            amount = need;
+        } else if (next_chunk != 0 && next_chunk < SBRK_CHUNK_MAX) {
+            next_chunk *= 2;
+        }
+
+        if (!contiguous) {
+            top = brk;
+        }
+        end = brk + amount;
+        return true;
+    }
+};
+
+#endif /* HEAP_CHUNK_H */
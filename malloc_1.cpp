@@ -2,7 +2,13 @@
 // Created by student on 8/14/24.
 //
 #include "unistd.h"
+#include "malloc_trace.h"
+#include "heap_chunk.h"
+
+HeapChunk heap;
+
 void* smalloc(size_t size) {
+    TRACE_SCOPE();
 
     if (size == 0) {
         return nullptr;
@@ -11,9 +17,10 @@ void* smalloc(size_t size) {
         return nullptr;
     }
 
-    void * ret = sbrk(size);
-    if (ret == (void*)-1){
+    void * ret = heap.alloc(size);
+    if (ret == nullptr){
         return nullptr;
     }
+    TRACE_EVENT(TRACE_MALLOC, size, nullptr, ret);
     return ret;
 }
\ No newline at end of file
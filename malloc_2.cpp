@@ -1,72 +1,562 @@
 #include <unistd.h>
+#include <cstdint>
 #include <cstring>
+#include <sys/mman.h>
+
+#include "heap_chunk.h"
+#include "malloc_engine.h"
+#include "malloc_trace.h"
+#include "smalloc_ext.h"
+
+MALLOC_ENGINE_BEGIN
 
 constexpr size_t MAX_ALLOCATION_SIZE = 100000000;
 
+struct MallocMetadata;
+
+struct BinLinks {
+    MallocMetadata* next_free;
+    MallocMetadata* prev_free;
+};
+
+struct TreeLinks {
+    MallocMetadata* left;
+    MallocMetadata* right;
+    MallocMetadata* parent;
+};
+
 struct MallocMetadata {
     size_t size;
     bool is_free = false;
+    bool is_red = false;
+    bool is_purged = false;    // free, and smalloc_trim gave its pages back
     MallocMetadata* next = nullptr;
     MallocMetadata* prev = nullptr;
+    // Only meaningful while the block is free: small blocks are linked into
+    // their bin, larger ones are nodes of the size tree.
+    union {
+        BinLinks bin;
+        TreeLinks tree;
+    };
 };
 
 constexpr size_t METADATA_SIZE = sizeof(MallocMetadata);
 
+// Free blocks are indexed by (size, address), so a search returns the best
+// fit and equal sizes are reused lowest address first.
+//
+// Small sizes get one exact bin per byte, each an address-ordered list, with a
+// bitmap of non-empty bins so the search skips straight to a candidate.
+// Everything larger lives in an intrusive red-black tree, where the best fit
+// is a lower-bound lookup.
+constexpr size_t NUM_SMALL_BINS = 512;
+constexpr size_t BIN_MAP_WORDS = NUM_SMALL_BINS / 64;
+
+struct MemoryStats {
+    size_t num_free_bytes = 0;
+    size_t num_free_blocks = 0;
+    size_t num_allocated_blocks = 0;
+    size_t num_allocated_bytes = 0;
+};
+
 MallocMetadata* memory_blocks = nullptr;
+MallocMetadata* last_block = nullptr;
+MemoryStats memory_stats;
+HeapChunk heap;
+MallocMetadata* bins[NUM_SMALL_BINS] = {nullptr};
+MallocMetadata* bin_tails[NUM_SMALL_BINS] = {nullptr};
+uint64_t bin_map[BIN_MAP_WORDS] = {0};
+MallocMetadata* size_tree = nullptr;
+
+bool free_before(const MallocMetadata* a, const MallocMetadata* b) {
+    return a->size < b->size || (a->size == b->size && a < b);
+}
 
+// Returns the first non-empty bin at or after index, or NUM_SMALL_BINS.
+size_t next_bin(size_t index) {
+    size_t word = index / 64;
+    if (word >= BIN_MAP_WORDS) {
+        return NUM_SMALL_BINS;
+    }
+    uint64_t bits = bin_map[word] & (~uint64_t(0) << (index % 64));
+    while (bits == 0) {
+        if (++word == BIN_MAP_WORDS) {
+            return NUM_SMALL_BINS;
+        }
+        bits = bin_map[word];
+    }
+    return word * 64 + __builtin_ctzll(bits);
+}
+
+void bin_insert(MallocMetadata* block) {
+    size_t index = block->size;
+    MallocMetadata* prev = nullptr;
+    MallocMetadata* curr = bins[index];
+    // Blocks are often freed in the order they were allocated; append those
+    // without walking the bin.
+    if (bin_tails[index] != nullptr && bin_tails[index] < block) {
+        prev = bin_tails[index];
+        curr = nullptr;
+    }
+    while (curr != nullptr && curr < block) {
+        prev = curr;
+        curr = curr->bin.next_free;
+    }
+
+    block->bin.prev_free = prev;
+    block->bin.next_free = curr;
+    if (prev == nullptr) {
+        bins[index] = block;
+    } else {
+        prev->bin.next_free = block;
+    }
+    if (curr != nullptr) {
+        curr->bin.prev_free = block;
+    } else {
+        bin_tails[index] = block;
+    }
+    bin_map[index / 64] |= uint64_t(1) << (index % 64);
+}
+
+void bin_remove(MallocMetadata* block) {
+    size_t index = block->size;
+    if (block->bin.prev_free == nullptr) {
+        bins[index] = block->bin.next_free;
+    } else {
+        block->bin.prev_free->bin.next_free = block->bin.next_free;
+    }
+    if (block->bin.next_free != nullptr) {
+        block->bin.next_free->bin.prev_free = block->bin.prev_free;
+    } else {
+        bin_tails[index] = block->bin.prev_free;
+    }
+    if (bins[index] == nullptr) {
+        bin_map[index / 64] &= ~(uint64_t(1) << (index % 64));
+    }
+}
+
+void tree_replace_child(MallocMetadata* parent, MallocMetadata* old_child, MallocMetadata* new_child) {
+    if (parent == nullptr) {
+        size_tree = new_child;
+    } else if (parent->tree.left == old_child) {
+        parent->tree.left = new_child;
+    } else {
+        parent->tree.right = new_child;
+    }
+    if (new_child != nullptr) {
+        new_child->tree.parent = parent;
+    }
+}
+
+void tree_rotate_left(MallocMetadata* node) {
+    MallocMetadata* pivot = node->tree.right;
+    node->tree.right = pivot->tree.left;
+    if (pivot->tree.left != nullptr) {
+        pivot->tree.left->tree.parent = node;
+    }
+    tree_replace_child(node->tree.parent, node, pivot);
+    pivot->tree.left = node;
+    node->tree.parent = pivot;
+}
+
+void tree_rotate_right(MallocMetadata* node) {
+    MallocMetadata* pivot = node->tree.left;
+    node->tree.left = pivot->tree.right;
+    if (pivot->tree.right != nullptr) {
+        pivot->tree.right->tree.parent = node;
+    }
+    tree_replace_child(node->tree.parent, node, pivot);
+    pivot->tree.right = node;
+    node->tree.parent = pivot;
+}
+
+bool is_red(const MallocMetadata* node) {
+    return node != nullptr && node->is_red;
+}
+
+void tree_insert(MallocMetadata* block) {
+    MallocMetadata* parent = nullptr;
+    for (MallocMetadata* curr = size_tree; curr != nullptr;) {
+        parent = curr;
+        curr = free_before(block, curr) ? curr->tree.left : curr->tree.right;
+    }
+    block->tree.left = nullptr;
+    block->tree.right = nullptr;
+    block->tree.parent = parent;
+    block->is_red = true;
+    if (parent == nullptr) {
+        size_tree = block;
+    } else if (free_before(block, parent)) {
+        parent->tree.left = block;
+    } else {
+        parent->tree.right = block;
+    }
+
+    MallocMetadata* node = block;
+    while (is_red(node->tree.parent)) {
+        MallocMetadata* parent_node = node->tree.parent;
+        MallocMetadata* grandparent = parent_node->tree.parent;
+        bool parent_is_left = parent_node == grandparent->tree.left;
+        MallocMetadata* uncle = parent_is_left ? grandparent->tree.right : grandparent->tree.left;
+
+        if (is_red(uncle)) {
+            parent_node->is_red = false;
+            uncle->is_red = false;
+            grandparent->is_red = true;
+            node = grandparent;
+            continue;
+        }
+        if (parent_is_left) {
+            if (node == parent_node->tree.right) {
+                node = parent_node;
+                tree_rotate_left(node);
+            }
+            node->tree.parent->is_red = false;
+            grandparent->is_red = true;
+            tree_rotate_right(grandparent);
+        } else {
+            if (node == parent_node->tree.left) {
+                node = parent_node;
+                tree_rotate_right(node);
+            }
+            node->tree.parent->is_red = false;
+            grandparent->is_red = true;
+            tree_rotate_left(grandparent);
+        }
+    }
+    size_tree->is_red = false;
+}
+
+void tree_remove_fixup(MallocMetadata* node, MallocMetadata* parent) {
+    while (node != size_tree && !is_red(node)) {
+        if (node == parent->tree.left) {
+            MallocMetadata* sibling = parent->tree.right;
+            if (is_red(sibling)) {
+                sibling->is_red = false;
+                parent->is_red = true;
+                tree_rotate_left(parent);
+                sibling = parent->tree.right;
+            }
+            if (!is_red(sibling->tree.left) && !is_red(sibling->tree.right)) {
+                sibling->is_red = true;
+                node = parent;
+                parent = node->tree.parent;
+                continue;
+            }
+            if (!is_red(sibling->tree.right)) {
+                sibling->tree.left->is_red = false;
+                sibling->is_red = true;
+                tree_rotate_right(sibling);
+                sibling = parent->tree.right;
+            }
+            sibling->is_red = parent->is_red;
+            parent->is_red = false;
+            sibling->tree.right->is_red = false;
+            tree_rotate_left(parent);
+        } else {
+            MallocMetadata* sibling = parent->tree.left;
+            if (is_red(sibling)) {
+                sibling->is_red = false;
+                parent->is_red = true;
+                tree_rotate_right(parent);
+                sibling = parent->tree.left;
+            }
+            if (!is_red(sibling->tree.left) && !is_red(sibling->tree.right)) {
+                sibling->is_red = true;
+                node = parent;
+                parent = node->tree.parent;
+                continue;
+            }
+            if (!is_red(sibling->tree.left)) {
+                sibling->tree.right->is_red = false;
+                sibling->is_red = true;
+                tree_rotate_left(sibling);
+                sibling = parent->tree.left;
+            }
+            sibling->is_red = parent->is_red;
+            parent->is_red = false;
+            sibling->tree.left->is_red = false;
+            tree_rotate_right(parent);
+        }
+        node = size_tree;
+    }
+    if (node != nullptr) {
+        node->is_red = false;
+    }
+}
+
+void tree_remove(MallocMetadata* block) {
+    MallocMetadata* child;
+    MallocMetadata* child_parent;
+    bool removed_red = block->is_red;
+
+    if (block->tree.left == nullptr || block->tree.right == nullptr) {
+        child = block->tree.left != nullptr ? block->tree.left : block->tree.right;
+        child_parent = block->tree.parent;
+        tree_replace_child(block->tree.parent, block, child);
+    } else {
+        // Put the in-order successor in the removed block's place.
+        MallocMetadata* successor = block->tree.right;
+        while (successor->tree.left != nullptr) {
+            successor = successor->tree.left;
+        }
+        removed_red = successor->is_red;
+        child = successor->tree.right;
+        if (successor->tree.parent == block) {
+            child_parent = successor;
+        } else {
+            child_parent = successor->tree.parent;
+            tree_replace_child(successor->tree.parent, successor, child);
+            successor->tree.right = block->tree.right;
+            successor->tree.right->tree.parent = successor;
+        }
+        tree_replace_child(block->tree.parent, block, successor);
+        successor->tree.left = block->tree.left;
+        successor->tree.left->tree.parent = successor;
+        successor->is_red = block->is_red;
+    }
+
+    if (!removed_red) {
+        tree_remove_fixup(child, child_parent);
+    }
+}
+
+// Smallest free block in the tree with at least size bytes.
+MallocMetadata* tree_lower_bound(size_t size) {
+    MallocMetadata* best = nullptr;
+    for (MallocMetadata* curr = size_tree; curr != nullptr;) {
+        if (curr->size >= size) {
+            best = curr;
+            curr = curr->tree.left;
+        } else {
+            curr = curr->tree.right;
+        }
+    }
+    return best;
+}
+
+void free_insert(MallocMetadata* block) {
+    if (block->size < NUM_SMALL_BINS) {
+        bin_insert(block);
+    } else {
+        tree_insert(block);
+    }
+}
+
+void free_remove(MallocMetadata* block) {
+    if (block->size < NUM_SMALL_BINS) {
+        bin_remove(block);
+    } else {
+        tree_remove(block);
+    }
+}
+
+// Finds the free block to reuse for size, or nullptr. The default is best
+// fit; MALLOC2_FIRST_FIT restores the original address-order scan, kept as a
+// baseline for the benchmarks.
 MallocMetadata* allocate(const size_t size)
 {
-    if(memory_blocks == nullptr || size <= 0)
-    {
-        return nullptr;
-    }
-    MallocMetadata* curr = memory_blocks;
-    while(curr->next != nullptr)
-    {
-        if(curr->is_free && size <= curr->size)
-        {
+#ifdef MALLOC2_FIRST_FIT
+    for (MallocMetadata* curr = memory_blocks; curr != nullptr; curr = curr->next) {
+        if (curr->is_free && size <= curr->size) {
             return curr;
         }
-        curr = curr->next;
     }
-    return curr;
+    return nullptr;
+#else
+    if (size < NUM_SMALL_BINS) {
+        size_t index = next_bin(size);
+        if (index != NUM_SMALL_BINS) {
+            return bins[index];
+        }
+    }
+    return tree_lower_bound(size);
+#endif
+}
+
+#if defined(MALLOC2_COALESCE) || defined(MALLOC2_GROW_IN_PLACE)
+// A reused block is split when the tail left over could hold a header plus
+// this many bytes; smaller tails stay with the allocation.
+constexpr size_t MIN_SPLIT_SIZE = 64;
+
+// Splits block after size bytes (rounded up so the new header stays aligned)
+// and frees the tail. The tail is a new block with its own header.
+void split_block(MallocMetadata* block, size_t size) {
+    size = (size + alignof(MallocMetadata) - 1) & ~(alignof(MallocMetadata) - 1);
+    if (block->size < size + METADATA_SIZE + MIN_SPLIT_SIZE) {
+        return;
+    }
+
+    auto* tail = reinterpret_cast<MallocMetadata*>(reinterpret_cast<char*>(block) + METADATA_SIZE + size);
+    tail->size = block->size - size - METADATA_SIZE;
+    tail->is_free = true;
+    tail->is_purged = false;
+    tail->prev = block;
+    tail->next = block->next;
+    if (block->next != nullptr) {
+        block->next->prev = tail;
+    } else {
+        last_block = tail;
+    }
+    block->next = tail;
+    block->size = size;
+    block->is_purged = false;
+    free_insert(tail);
+
+    memory_stats.num_allocated_blocks++;
+    memory_stats.num_allocated_bytes -= METADATA_SIZE;
+    memory_stats.num_free_blocks++;
+    memory_stats.num_free_bytes += tail->size;
+}
+
+// Absorbs the free block physically after block into it. The caller has
+// already taken both blocks out of the free index.
+void merge_with_next(MallocMetadata* block) {
+    MallocMetadata* next = block->next;
+    block->size += METADATA_SIZE + next->size;
+    block->is_purged = false;
+    block->next = next->next;
+    if (next->next != nullptr) {
+        next->next->prev = block;
+    } else {
+        last_block = block;
+    }
+
+    memory_stats.num_allocated_blocks--;
+    memory_stats.num_allocated_bytes += METADATA_SIZE;
+}
+#endif
+
+#ifdef MALLOC2_COALESCE
+// Merges a block that is being freed with its free neighbours and returns the
+// resulting block, still outside the free index.
+MallocMetadata* coalesce(MallocMetadata* block) {
+    if (block->next != nullptr && block->next->is_free) {
+        free_remove(block->next);
+        memory_stats.num_free_blocks--;
+        memory_stats.num_free_bytes -= block->next->size;
+        merge_with_next(block);
+    }
+    if (block->prev != nullptr && block->prev->is_free) {
+        MallocMetadata* prev = block->prev;
+        free_remove(prev);
+        memory_stats.num_free_blocks--;
+        memory_stats.num_free_bytes -= prev->size;
+        merge_with_next(prev);
+        block = prev;
+    }
+    return block;
+}
+#endif
+
+#ifdef MALLOC2_GROW_IN_PLACE
+// Grows the block at the top of the heap to size bytes by taking only the
+// missing bytes from the heap.
+bool extend_top(MallocMetadata* block, size_t size) {
+    char* end = reinterpret_cast<char*>(block) + METADATA_SIZE + block->size;
+    if (block != last_block || !heap.extend(end, size - block->size)) {
+        return false;
+    }
+    memory_stats.num_allocated_bytes += size - block->size;
+    block->size = size;
+    return true;
+}
+
+// Extends a free block at the top of the heap that is too small for size,
+// instead of leaving it behind and adding a new block. The grown block is
+// returned still free, like any other fit.
+MallocMetadata* grow_wilderness(size_t size) {
+    MallocMetadata* top = last_block;
+    if (top == nullptr || !top->is_free) {
+        return nullptr;
+    }
+    size_t old_size = top->size;
+    free_remove(top);
+    bool grown = extend_top(top, size);
+    free_insert(top);
+    if (!grown) {
+        return nullptr;
+    }
+    memory_stats.num_free_bytes += size - old_size;
+    return top;
 }
 
+// Grows an allocated block to size bytes without moving it, by absorbing a
+// free next neighbour and/or extending the heap when the block is on top.
+bool grow_in_place(MallocMetadata* block, size_t size) {
+    MallocMetadata* next = block->next;
+    if (next != nullptr && next->is_free &&
+        (next == last_block || block->size + METADATA_SIZE + next->size >= size)) {
+        free_remove(next);
+        memory_stats.num_free_blocks--;
+        memory_stats.num_free_bytes -= next->size;
+        merge_with_next(block);
+    }
+    if (block->size >= size) {
+#ifdef MALLOC2_COALESCE
+        split_block(block, size);
+#endif
+        return true;
+    }
+    return extend_top(block, size);
+}
+#endif
+
 void* smalloc(size_t size) {
+    TRACE_SCOPE();
     if (size == 0 || size > MAX_ALLOCATION_SIZE) {
         return nullptr;
     }
 
     MallocMetadata* block = allocate(size);
-    if (block == nullptr || (block->next == nullptr && !block->is_free)) {
-        void* block_ptr = sbrk(0);
-        if (sbrk(METADATA_SIZE + size) == reinterpret_cast<void *>(-1)) {
+#ifdef MALLOC2_GROW_IN_PLACE
+    if (block == nullptr) {
+        block = grow_wilderness(size);
+    }
+#endif
+    if (block == nullptr) {
+        void* block_ptr = heap.alloc(METADATA_SIZE + size);
+        if (block_ptr == nullptr) {
             return nullptr;
         }
 
-        auto* new_block = static_cast<MallocMetadata*>(block_ptr);
-        new_block->size = size;
-        new_block->is_free = false;
+        block = static_cast<MallocMetadata*>(block_ptr);
+        block->size = size;
+        block->next = nullptr;
+        block->prev = last_block;
 
-        if (block == nullptr) {
-            memory_blocks = new_block;
+        if (last_block == nullptr) {
+            memory_blocks = block;
         } else {
-            block->next = new_block;
-            new_block->prev = block;
+            last_block->next = block;
         }
+        last_block = block;
 
-        return reinterpret_cast<char *>(new_block) + METADATA_SIZE;
+        memory_stats.num_allocated_blocks++;
+        memory_stats.num_allocated_bytes += size;
+    } else {
+        free_remove(block);
+        memory_stats.num_free_blocks--;
+        memory_stats.num_free_bytes -= block->size;
+#ifdef MALLOC2_COALESCE
+        split_block(block, size);
+#endif
     }
 
     block->is_free = false;
-    return reinterpret_cast<char *>(block) + METADATA_SIZE;
+    block->is_purged = false;
+    void* ptr = reinterpret_cast<char *>(block) + METADATA_SIZE;
+    TRACE_EVENT(TRACE_MALLOC, size, nullptr, ptr);
+    return ptr;
 }
 
 void* scalloc(size_t num, size_t size) {
+    TRACE_SCOPE();
     size_t mem_size = num * size;
     void* block_ptr = smalloc(mem_size);
     if (block_ptr != nullptr) {
         std::memset(block_ptr, 0, mem_size);
+        TRACE_EVENT(TRACE_CALLOC, mem_size, nullptr, block_ptr);
     }
     return block_ptr;
 }
@@ -75,12 +565,23 @@ void sfree(void* p) {
     if (p == nullptr) {
         return;
     }
+    TRACE_SCOPE();
+    TRACE_EVENT(TRACE_FREE, 0, p, nullptr);
 
     auto* block = reinterpret_cast<MallocMetadata*>(reinterpret_cast<char*>(p) - METADATA_SIZE);
+    if (block->is_free) {
+        return;
+    }
     block->is_free = true;
+#ifdef MALLOC2_COALESCE
+    block = coalesce(block);
+#endif
+    free_insert(block);
+    memory_stats.num_free_blocks++;
+    memory_stats.num_free_bytes += block->size;
 }
 
-void* srealloc(void* oldp, size_t size) {
+void* reallocate(void* oldp, size_t size) {
     if (size == 0 || size > MAX_ALLOCATION_SIZE) {
         return nullptr;
     }
@@ -94,6 +595,11 @@ void* srealloc(void* oldp, size_t size) {
     if (size <= block->size) {
         return oldp;
     }
+#ifdef MALLOC2_GROW_IN_PLACE
+    if (grow_in_place(block, size)) {
+        return oldp;
+    }
+#endif
 
     void* new_block = smalloc(size);
     if (new_block != nullptr) {
@@ -104,46 +610,92 @@ void* srealloc(void* oldp, size_t size) {
     return new_block;
 }
 
+void* srealloc(void* oldp, size_t size) {
+    TRACE_SCOPE();
+    void* newp = reallocate(oldp, size);
+    TRACE_EVENT(TRACE_REALLOC, size, oldp, newp);
+    return newp;
+}
+
 size_t _num_free_blocks() {
-    size_t count = 0;
-    for (const MallocMetadata* iter = memory_blocks; iter != nullptr; iter = iter->next) {
-        if (iter->is_free) {
-            count++;
-        }
-    }
-    return count;
+    return memory_stats.num_free_blocks;
 }
 
 size_t _num_free_bytes() {
-    size_t total_size = 0;
-    for (const MallocMetadata* iter = memory_blocks; iter != nullptr; iter = iter->next) {
-        if (iter->is_free) {
-            total_size += iter->size;
-        }
-    }
-    return total_size;
+    return memory_stats.num_free_bytes;
 }
 
 size_t _num_allocated_blocks() {
-    size_t count = 0;
-    for (const MallocMetadata* iter = memory_blocks; iter != nullptr; iter = iter->next) {
-        count++;
-    }
-    return count;
+    return memory_stats.num_allocated_blocks;
 }
 
 size_t _num_allocated_bytes() {
-    size_t total_size = 0;
-    for (const MallocMetadata* iter = memory_blocks; iter != nullptr; iter = iter->next) {
-        total_size += iter->size;
-    }
-    return total_size;
+    return memory_stats.num_allocated_bytes;
 }
 
 size_t _num_meta_data_bytes() {
-    return METADATA_SIZE * _num_allocated_blocks();
+    return METADATA_SIZE * memory_stats.num_allocated_blocks;
 }
 
 size_t _size_meta_data() {
     return METADATA_SIZE;
 }
+
+constexpr uintptr_t PAGE_SIZE = 4096;
+
+// Releases the free block at the top of the heap with a negative sbrk,
+// shrinking it to pad bytes rather than dropping it when pad is not zero,
+// then gives back the whole pages inside every other free block with
+// madvise. Blocks given back by an earlier call are skipped until they are
+// allocated, split or merged again. Returns the bytes released.
+size_t smalloc_trim(size_t pad) {
+    size_t released = 0;
+    MallocMetadata* top = last_block;
+    if (top != nullptr && top->is_free && top->size > pad) {
+        char* end = reinterpret_cast<char*>(top) + METADATA_SIZE + top->size;
+        size_t cut = pad == 0 ? METADATA_SIZE + top->size : top->size - pad;
+        size_t old_size = top->size;
+        // Without padding the header goes back too, so read it first.
+        MallocMetadata* below = top->prev;
+        free_remove(top);
+        size_t length = heap.release(end, cut);
+        if (length == 0) {
+            free_insert(top);
+        } else if (pad == 0) {
+            last_block = below;
+            if (last_block == nullptr) {
+                memory_blocks = nullptr;
+            } else {
+                last_block->next = nullptr;
+            }
+            memory_stats.num_allocated_blocks--;
+            memory_stats.num_allocated_bytes -= old_size;
+            memory_stats.num_free_blocks--;
+            memory_stats.num_free_bytes -= old_size;
+            released += length;
+        } else {
+            top->size = pad;
+            free_insert(top);
+            memory_stats.num_allocated_bytes -= cut;
+            memory_stats.num_free_bytes -= cut;
+            released += length;
+        }
+    }
+
+    for (MallocMetadata* block = memory_blocks; block != nullptr; block = block->next) {
+        if (!block->is_free || block->is_purged) {
+            continue;
+        }
+        uintptr_t start = reinterpret_cast<uintptr_t>(block) + METADATA_SIZE;
+        uintptr_t end = start + block->size;
+        start = (start + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+        end &= ~(PAGE_SIZE - 1);
+        if (start < end && madvise(reinterpret_cast<void*>(start), end - start, MADV_DONTNEED) == 0) {
+            block->is_purged = true;
+            released += end - start;
+        }
+    }
+    return released;
+}
+
+MALLOC_ENGINE_END
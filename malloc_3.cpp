@@ -1,17 +1,44 @@
 #include <unistd.h>
+#include <cassert>
 #include <cstdio>
 #include <cstring>
+#include <ctime>
 #include <iostream>
+#include <pthread.h>
+#include <sched.h>
 #include <sys/mman.h>
 
+#include "malloc_engine.h"
+#include "malloc_latency.h"
+#include "malloc_trace.h"
+#include "smalloc_ext.h"
+
+MALLOC_ENGINE_BEGIN
+
+constexpr int MIN_BLOCK_LOG2 = 7;   // 128-byte order-0 blocks
 constexpr int MAX_ORDER = 10;
-constexpr size_t INITIAL_BLOCK_SIZE = 32 * 131072;
+constexpr size_t MAX_BLOCK_SIZE = size_t(1) << (MIN_BLOCK_LOG2 + MAX_ORDER);
+constexpr size_t INITIAL_BLOCK_SIZE = 32 * MAX_BLOCK_SIZE;
 constexpr size_t MAX_ALLOCATION_SIZE = 100000000;
 
+// What is known about the pages of a free block past its first page.
+enum PurgeState : unsigned char {
+    PURGE_NONE,      // resident, contents left by the last user
+    PURGE_ZEROED,    // given back with MADV_DONTNEED, read back as zero
+    PURGE_FREED,     // given back with MADV_FREE, contents undefined
+};
+
 struct MallocMetadata {
     bool is_free = true;
+    PurgeState purge = PURGE_NONE;
+    bool quick = false;        // free, but parked on a quick list unmerged
+    unsigned char shard = 0;   // index of the owning shard
     size_t size = 0;
+#ifdef MALLOC3_REQUESTED_STATS
+    size_t requested = 0;      // what the caller asked for, for smalloc_stats
+#endif
     int order = 0;
+    uint32_t freed_at = 0;     // ms timestamp for the purger's decay
     MallocMetadata *next = nullptr;
     MallocMetadata *prev = nullptr;
     MallocMetadata *next_ordered = nullptr;
@@ -25,19 +52,211 @@ struct MemoryStats {
     size_t num_free_blocks = 0;
     size_t num_allocated_blocks = 0;
     size_t num_allocated_bytes = 0;
+
+    size_t free_per_order[MAX_ORDER + 1] = {0};
+    size_t blocks_per_order[MAX_ORDER + 1] = {0};
+    size_t requested_bytes = 0;
+    size_t granted_bytes = 0;
+    size_t mmap_blocks = 0;
+    size_t mmap_bytes = 0;
+    size_t sbrk_calls = 0;
+    size_t mmap_calls = 0;
+    size_t munmap_calls = 0;
+    size_t heap_growths = 0;
+    size_t heap_bytes = 0;
+    size_t madvise_calls = 0;
+    size_t purged_bytes = 0;
+};
+
+static_assert(MAX_ORDER < HEAP_STATS_MAX_ORDERS, "heap_stats cannot describe every order");
+
+smalloc_purge_policy purge_policy = {MAX_ORDER, SMALLOC_PURGE_DONTNEED, SMALLOC_PURGE_NEVER};
+
+#ifdef MALLOC3_SHARDS
+constexpr int NUM_SHARDS = MALLOC3_SHARDS;
+#else
+constexpr int NUM_SHARDS = 1;
+#endif
+
+static_assert(NUM_SHARDS >= 1 && NUM_SHARDS <= 256, "a shard index must fit in a block header");
+
+// One buddy heap: free lists, counters and the lock that guards them. A
+// normal build has a single shard. With MALLOC3_SHARDS=N there are N, each
+// thread allocates from the one it was assigned, and every block header
+// records the shard owning the superchunk it was carved from, so sfree goes
+// straight to that shard's lock. Shard 0 owns the sbrk region, the others
+// map 4 MB superchunks of their own; any shard maps more when it runs out.
+struct alignas(64) Shard {
+    MallocMetadata *block_list[MAX_ORDER + 1] = {nullptr};
+    MemoryStats stats;
+    bool blocks_init = false;
+    // Where the purger's sweep resumes: a block of purge_order, or the end of
+    // that list. list_remove() moves it off a block that leaves the list.
+    int purge_order = -1;
+    MallocMetadata *purge_cursor = nullptr;
+#ifdef MALLOC3_DEFERRED_COALESCE
+    MallocMetadata *quick_list[MAX_ORDER + 1] = {nullptr};
+    size_t quick_count[MAX_ORDER + 1] = {0};
+#endif
+    pthread_mutex_t lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+};
+
+Shard shards[NUM_SHARDS];
+
+// The shard the engine code below works on: the one whose guard this thread
+// holds.
+#ifdef MALLOC3_SHARDS
+thread_local Shard *shard = &shards[0];
+unsigned next_home = 0;
+thread_local int home_index = -1;
+
+Shard &home_shard() {
+    if (home_index < 0) home_index = __atomic_fetch_add(&next_home, 1, __ATOMIC_RELAXED) % NUM_SHARDS;
+    return shards[home_index];
+}
+#else
+Shard *const shard = &shards[0];
+
+Shard &home_shard() {
+    return shards[0];
+}
+#endif
+
+Shard &owner_of(const MallocMetadata *block) {
+    assert(block->shard < NUM_SHARDS);
+    return shards[block->shard];
+}
+
+unsigned char shard_index() {
+    return static_cast<unsigned char>(shard - shards);
+}
+
+// What callers asked for is kept per block only with MALLOC3_REQUESTED_STATS,
+// which grows every header by 8 bytes; without it requested_bytes stays 0.
+#ifdef MALLOC3_REQUESTED_STATS
+size_t requested_of(const MallocMetadata *block) {
+    return block->requested;
+}
+
+void grant_requested(MallocMetadata *block, size_t size) {
+    block->requested = size;
+    shard->stats.requested_bytes += size;
+}
+#else
+size_t requested_of(const MallocMetadata *) {
+    return 0;
+}
+
+void grant_requested(MallocMetadata *, size_t) {}
+#endif
+
+// The heap is single threaded except while the background purger runs; the
+// allocation calls only take the shard locks then, or always in the
+// MALLOC3_THREAD_SAFE, MALLOC3_PER_CPU and MALLOC3_SHARDS builds. They are
+// recursive so that the public calls may nest.
+struct Purger {
+    pthread_t thread;
+    pthread_mutex_t wake_lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t wake;
+    bool running = false;
+    bool stopping = false;
+    smalloc_purger_config config = {};
 };
 
-MallocMetadata *block_list[11] = {nullptr};
-MemoryStats memory_stats;
+Purger purger;
+
+#if defined(MALLOC3_THREAD_SAFE) || defined(MALLOC3_PER_CPU) || defined(MALLOC3_SHARDS)
+constexpr bool ALWAYS_LOCKED = true;
+#else
+constexpr bool ALWAYS_LOCKED = false;
+#endif
+
+// Locks a shard and makes it the one the engine works on.
+class HeapGuard {
+public:
+    explicit HeapGuard(Shard &target = home_shard())
+        : target_(target), previous_(shard), locked_(ALWAYS_LOCKED || __atomic_load_n(&purger.running, __ATOMIC_ACQUIRE)) {
+        if (locked_) pthread_mutex_lock(&target_.lock);
+#ifdef MALLOC3_SHARDS
+        shard = &target_;
+#endif
+    }
+    ~HeapGuard() {
+#ifdef MALLOC3_SHARDS
+        shard = previous_;
+#endif
+        if (locked_) pthread_mutex_unlock(&target_.lock);
+    }
+    HeapGuard(const HeapGuard &) = delete;
+    HeapGuard &operator=(const HeapGuard &) = delete;
+
+private:
+    Shard &target_;
+    Shard *previous_;
+    bool locked_;
+};
 
-bool blocks_init = false;
+uint32_t now_ms() {
+    timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return static_cast<uint32_t>(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+char *heap_start = nullptr;   // the aligned buddy region
+char *heap_end = nullptr;
+size_t trimmed_blocks = 0;    // max-order blocks smalloc_trim gave back
 
 constexpr size_t size_of_block(int order) {
-    return 128 * (1 << order);
+    return size_t(1) << (MIN_BLOCK_LOG2 + order);
+}
+
+int order_for(size_t size) {
+    int order = 0;
+    while (order < MAX_ORDER && size > size_of_block(order) - METADATA_SIZE) order++;
+    return order;
+}
+
+constexpr size_t PAGE_SIZE = 4096;
+
+// Bytes of a block that purging gives back: everything past its first page.
+constexpr size_t purgeable_bytes(int order) {
+    return size_of_block(order) > PAGE_SIZE ? size_of_block(order) - PAGE_SIZE : 0;
+}
+
+void set_purge_state(MallocMetadata *block, PurgeState state) {
+    if ((block->purge != PURGE_NONE) == (state != PURGE_NONE)) {
+        block->purge = state;
+        return;
+    }
+    if (state == PURGE_NONE) {
+        shard->stats.purged_bytes -= purgeable_bytes(block->order);
+    } else {
+        shard->stats.purged_bytes += purgeable_bytes(block->order);
+    }
+    block->purge = state;
+}
+
+size_t purge_block(MallocMetadata *block) {
+    size_t length = purgeable_bytes(block->order);
+    if (block->purge != PURGE_NONE || length == 0) return 0;
+
+    int advice = MADV_DONTNEED;
+    PurgeState state = PURGE_ZEROED;
+#ifdef MADV_FREE
+    if (purge_policy.advice == SMALLOC_PURGE_FREE) {
+        advice = MADV_FREE;
+        state = PURGE_FREED;
+    }
+#endif
+    shard->stats.madvise_calls++;
+    if (madvise(reinterpret_cast<char *>(block) + PAGE_SIZE, length, advice) != 0) return 0;
+    set_purge_state(block, state);
+    return length;
 }
 
 void list_insert(MallocMetadata *metadata) {
-    auto &head = block_list[metadata->order];
+    auto &head = shard->block_list[metadata->order];
+    shard->stats.free_per_order[metadata->order]++;
     if (head == nullptr) {
         metadata->next_ordered = nullptr;
         metadata->prev_ordered = nullptr;
@@ -67,9 +286,11 @@ void list_insert(MallocMetadata *metadata) {
 }
 
 void list_remove(MallocMetadata *metadata) {
-    auto &head = block_list[metadata->order];
+    auto &head = shard->block_list[metadata->order];
     for (MallocMetadata *iter = head; iter != nullptr; iter = iter->next_ordered) {
         if (iter == metadata) {
+            shard->stats.free_per_order[metadata->order]--;
+            if (shard->purge_cursor == metadata) shard->purge_cursor = metadata->next_ordered;
             if (iter->prev_ordered == nullptr) {
                 head = iter->next_ordered;
             } else {
@@ -86,18 +307,32 @@ void list_remove(MallocMetadata *metadata) {
 MallocMetadata *split_blocks(MallocMetadata *metadata_to_split) {
     if (!metadata_to_split || metadata_to_split->order == 0) return metadata_to_split;
 
+    LATENCY_DEPTH();
     list_remove(metadata_to_split);
 
     size_t half_size = size_of_block(metadata_to_split->order - 1);
     auto *new_meta = reinterpret_cast<MallocMetadata *>(reinterpret_cast<char *>(metadata_to_split) + half_size);
 
+    // Both halves keep the parent's purge state: neither header lands past
+    // the first page of the half it belongs to.
+    PurgeState purge = metadata_to_split->purge;
+    if (purge != PURGE_NONE) set_purge_state(metadata_to_split, PURGE_NONE);
     new_meta->order = metadata_to_split->order - 1;
     new_meta->is_free = true;
+    new_meta->quick = false;
+    new_meta->shard = metadata_to_split->shard;
+    new_meta->size = 0;
+    new_meta->freed_at = metadata_to_split->freed_at;
     new_meta->next = metadata_to_split->next;
     new_meta->prev = metadata_to_split;
 
     metadata_to_split->order--;
     metadata_to_split->next = new_meta;
+    new_meta->purge = PURGE_NONE;
+    if (purge != PURGE_NONE && purgeable_bytes(new_meta->order) > 0) {
+        set_purge_state(new_meta, purge);
+        set_purge_state(metadata_to_split, purge);
+    }
 
     if (new_meta->next) {
         new_meta->next->prev = new_meta;
@@ -106,10 +341,12 @@ MallocMetadata *split_blocks(MallocMetadata *metadata_to_split) {
     list_insert(new_meta);
     list_insert(metadata_to_split);
 
-    memory_stats.num_free_blocks++;
-    memory_stats.num_free_bytes -= METADATA_SIZE;
-    memory_stats.num_allocated_blocks++;
-    memory_stats.num_allocated_bytes -= METADATA_SIZE;
+    shard->stats.blocks_per_order[new_meta->order + 1]--;
+    shard->stats.blocks_per_order[new_meta->order] += 2;
+    shard->stats.num_free_blocks++;
+    shard->stats.num_free_bytes -= METADATA_SIZE;
+    shard->stats.num_allocated_blocks++;
+    shard->stats.num_allocated_bytes -= METADATA_SIZE;
 
     return metadata_to_split;
 }
@@ -120,7 +357,7 @@ MallocMetadata *split_memory(size_t size, MallocMetadata *metadata = nullptr) {
 
     if (metadata == nullptr) {
         for (int i = 0; i <= MAX_ORDER; i++) {
-            iter = block_list[i];
+            iter = shard->block_list[i];
             if (iter && size <= size_of_block(i) - METADATA_SIZE) {
                 order = i;
                 break;
@@ -140,18 +377,73 @@ MallocMetadata *split_memory(size_t size, MallocMetadata *metadata = nullptr) {
     return iter;
 }
 
+#ifdef MALLOC3_SHARDS
+// Maps another 4 MB superchunk of max-order blocks for the active shard,
+// aligned so that buddies are found by address as in the sbrk region.
+bool add_superchunk() {
+    void *raw = mmap(nullptr, 2 * INITIAL_BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    shard->stats.mmap_calls++;
+    if (raw == MAP_FAILED) return false;
+    char *start = static_cast<char *>(raw);
+    char *base = reinterpret_cast<char *>((reinterpret_cast<uintptr_t>(start) + INITIAL_BLOCK_SIZE - 1) &
+                                          ~(INITIAL_BLOCK_SIZE - 1));
+    if (base != start) munmap(start, base - start);
+    if (base + INITIAL_BLOCK_SIZE != start + 2 * INITIAL_BLOCK_SIZE) {
+        munmap(base + INITIAL_BLOCK_SIZE, start + INITIAL_BLOCK_SIZE - base);
+    }
+
+    constexpr size_t num_blocks = INITIAL_BLOCK_SIZE / size_of_block(MAX_ORDER);
+    MallocMetadata *prev = nullptr;
+    for (size_t i = 0; i < num_blocks; i++) {
+        auto *block = reinterpret_cast<MallocMetadata *>(base + i * size_of_block(MAX_ORDER));
+        *block = MallocMetadata{};
+        block->order = MAX_ORDER;
+        block->shard = shard_index();
+        block->prev = prev;
+        if (prev != nullptr) prev->next = block;
+        prev = block;
+        list_insert(block);
+    }
+    shard->stats.num_allocated_blocks += num_blocks;
+    shard->stats.num_free_blocks += num_blocks;
+    shard->stats.num_allocated_bytes += num_blocks * (size_of_block(MAX_ORDER) - METADATA_SIZE);
+    shard->stats.num_free_bytes += num_blocks * (size_of_block(MAX_ORDER) - METADATA_SIZE);
+    shard->stats.blocks_per_order[MAX_ORDER] += num_blocks;
+    shard->stats.heap_growths++;
+    shard->stats.heap_bytes += INITIAL_BLOCK_SIZE;
+    return true;
+}
+#else
+bool add_superchunk() {
+    return false;
+}
+#endif
+
 void init_blocks() {
-    if (blocks_init) return;
+    if (shard->blocks_init) return;
+    if (shard != &shards[0]) {
+        shard->blocks_init = add_superchunk();
+        return;
+    }
 
     void *block_ptr = sbrk(0);
     size_t align = INITIAL_BLOCK_SIZE - (reinterpret_cast<uintptr_t>(block_ptr) % INITIAL_BLOCK_SIZE);
-    if (sbrk(INITIAL_BLOCK_SIZE + align) == reinterpret_cast<void *>(-1)) return;
+    if (sbrk(INITIAL_BLOCK_SIZE + align) == reinterpret_cast<void *>(-1)) {
+        shard->stats.sbrk_calls++;
+        return;
+    }
 
     block_ptr = reinterpret_cast<void *>(reinterpret_cast<char *>(block_ptr) + align);
-    block_list[MAX_ORDER] = static_cast<MallocMetadata *>(block_ptr);
+    shard->block_list[MAX_ORDER] = static_cast<MallocMetadata *>(block_ptr);
+    heap_start = static_cast<char *>(block_ptr);
+    heap_end = heap_start + INITIAL_BLOCK_SIZE;
 
-    MallocMetadata *iter = block_list[MAX_ORDER];
+    MallocMetadata *iter = shard->block_list[MAX_ORDER];
     iter->is_free = true;
+    iter->purge = PURGE_NONE;
+    iter->quick = false;
+    iter->shard = 0;
+    iter->freed_at = 0;
     iter->order = MAX_ORDER;
     iter->prev_ordered = nullptr;
     iter->prev = nullptr;
@@ -165,51 +457,99 @@ void init_blocks() {
         iter = iter->next;
         iter->order = MAX_ORDER;
         iter->is_free = true;
+        iter->purge = PURGE_NONE;
+        iter->quick = false;
+        iter->shard = 0;
+        iter->freed_at = 0;
     }
     iter->next_ordered = nullptr;
     iter->next = nullptr;
-    memory_stats.num_allocated_blocks += num_blocks;
-    memory_stats.num_free_blocks += num_blocks;
-    memory_stats.num_allocated_bytes += num_blocks * (size_of_block(MAX_ORDER) - METADATA_SIZE);
-    memory_stats.num_free_bytes += num_blocks * (size_of_block(MAX_ORDER) - METADATA_SIZE);
-    blocks_init = true;
+    shard->stats.num_allocated_blocks += num_blocks;
+    shard->stats.num_free_blocks += num_blocks;
+    shard->stats.num_allocated_bytes += num_blocks * (size_of_block(MAX_ORDER) - METADATA_SIZE);
+    shard->stats.num_free_bytes += num_blocks * (size_of_block(MAX_ORDER) - METADATA_SIZE);
+    shard->stats.free_per_order[MAX_ORDER] += num_blocks;
+    shard->stats.blocks_per_order[MAX_ORDER] += num_blocks;
+    shard->stats.sbrk_calls++;
+    shard->stats.heap_growths++;
+    shard->stats.heap_bytes += INITIAL_BLOCK_SIZE + align;
+    shard->blocks_init = true;
 }
 
 void* allocate_large_block(size_t size) {
     void *ptr = mmap(nullptr, size + METADATA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    shard->stats.mmap_calls++;
     if (ptr == reinterpret_cast<void *>(-1)) return nullptr;
 
+    LATENCY_PATH(LAT_SLOT_MMAP);
     auto *meta = static_cast<MallocMetadata *>(ptr);
     meta->size = size;
+    grant_requested(meta, size);
     meta->is_free = false;
+    meta->shard = shard_index();
 
-    memory_stats.num_allocated_bytes += size;
-    memory_stats.num_allocated_blocks++;
+    shard->stats.num_allocated_bytes += size;
+    shard->stats.num_allocated_blocks++;
+    shard->stats.mmap_blocks++;
+    shard->stats.mmap_bytes += size + METADATA_SIZE;
+    shard->stats.granted_bytes += size;
 
     return reinterpret_cast<char *>(meta) + METADATA_SIZE;
 }
 
-void* allocate_small_block(size_t size) {
-    MallocMetadata *block = split_memory(size);
-    if (!block) return nullptr;
-
-    block->is_free = false;
-    list_remove(block);
-
-    memory_stats.num_free_blocks--;
-    memory_stats.num_free_bytes -= size_of_block(block->order) - METADATA_SIZE;
-
-    return reinterpret_cast<char *>(block) + METADATA_SIZE;
+// Takes back the max-order blocks smalloc_trim released, once the heap has
+// run out of free blocks. A sharded heap maps another superchunk instead.
+bool regrow_heap() {
+    if (shard != &shards[0] || trimmed_blocks == 0 || sbrk(0) != heap_end) return add_superchunk();
+    size_t length = trimmed_blocks * size_of_block(MAX_ORDER);
+    shard->stats.sbrk_calls++;
+    if (sbrk(length) == reinterpret_cast<void *>(-1)) return false;
+
+    MallocMetadata *last = nullptr;
+    if (heap_end != heap_start) {
+        last = reinterpret_cast<MallocMetadata *>(heap_start);
+        while (last->next != nullptr) last = last->next;
+    }
+    for (size_t i = 0; i < trimmed_blocks; i++) {
+        auto *block = reinterpret_cast<MallocMetadata *>(heap_end + i * size_of_block(MAX_ORDER));
+        block->is_free = true;
+        block->purge = PURGE_NONE;
+        block->quick = false;
+        block->shard = 0;
+        block->freed_at = 0;
+        block->size = 0;
+        block->order = MAX_ORDER;
+        block->prev = last;
+        block->next = nullptr;
+        if (last != nullptr) last->next = block;
+        last = block;
+        list_insert(block);
+    }
+    shard->stats.num_allocated_blocks += trimmed_blocks;
+    shard->stats.num_free_blocks += trimmed_blocks;
+    shard->stats.num_allocated_bytes += trimmed_blocks * (size_of_block(MAX_ORDER) - METADATA_SIZE);
+    shard->stats.num_free_bytes += trimmed_blocks * (size_of_block(MAX_ORDER) - METADATA_SIZE);
+    shard->stats.blocks_per_order[MAX_ORDER] += trimmed_blocks;
+    shard->stats.heap_growths++;
+    shard->stats.heap_bytes += length;
+    heap_end += length;
+    trimmed_blocks = 0;
+    return true;
 }
 
 MallocMetadata *merge_blocks(MallocMetadata *first_metadata, MallocMetadata *second_metadata) {
     if (!first_metadata || !second_metadata) return nullptr;
 
+    LATENCY_DEPTH();
     list_remove(first_metadata);
     list_remove(second_metadata);
 
     if (first_metadata > second_metadata) std::swap(first_metadata, second_metadata);
 
+    // The upper half's header page is resident inside the merged block.
+    if (first_metadata->purge != PURGE_NONE) set_purge_state(first_metadata, PURGE_NONE);
+    if (second_metadata->purge != PURGE_NONE) set_purge_state(second_metadata, PURGE_NONE);
+
     first_metadata->next = second_metadata->next;
     if (second_metadata->next) {
         second_metadata->next->prev = first_metadata;
@@ -218,10 +558,12 @@ MallocMetadata *merge_blocks(MallocMetadata *first_metadata, MallocMetadata *sec
     first_metadata->order++;
     list_insert(first_metadata);
 
-    memory_stats.num_free_bytes += METADATA_SIZE;
-    memory_stats.num_free_blocks--;
-    memory_stats.num_allocated_bytes += METADATA_SIZE;
-    memory_stats.num_allocated_blocks--;
+    shard->stats.blocks_per_order[first_metadata->order - 1] -= 2;
+    shard->stats.blocks_per_order[first_metadata->order]++;
+    shard->stats.num_free_bytes += METADATA_SIZE;
+    shard->stats.num_free_blocks--;
+    shard->stats.num_allocated_bytes += METADATA_SIZE;
+    shard->stats.num_allocated_blocks--;
 
     return first_metadata;
 }
@@ -230,49 +572,437 @@ MallocMetadata *merge_memory(MallocMetadata *metadata) {
     MallocMetadata *iter = metadata;
     for (int i = metadata->order; i < MAX_ORDER; i++) {
         auto *buddy = reinterpret_cast<MallocMetadata *>(reinterpret_cast<uintptr_t>(iter) ^ size_of_block(i));
-        if (iter->order != buddy->order || !buddy->is_free) return iter;
+        if (iter->order != buddy->order || !buddy->is_free || buddy->quick) return iter;
 
         iter = merge_blocks(iter, buddy);
     }
     return iter;
 }
 
-void *smalloc(size_t size) {
-    if (!blocks_init) init_blocks();
+// Puts a block that just became free back on the free lists, merging it
+// with its buddies as far as they are free.
+void release_block(MallocMetadata *block) {
+    list_insert(block);
+    MallocMetadata *merged = merge_memory(block);
+    if (__atomic_load_n(&purger.running, __ATOMIC_RELAXED)) merged->freed_at = now_ms();
+    if (purge_policy.trigger == SMALLOC_PURGE_ON_FREE && merged->order >= purge_policy.min_order) {
+        purge_block(merged);
+    }
+}
+
+#ifdef MALLOC3_DEFERRED_COALESCE
+// Freed blocks below MAX_ORDER are parked unmerged on a per-order quick list,
+// so an alloc/free loop of one size reuses them without splitting and
+// merging every time. They count as free blocks everywhere, but are only
+// merged when a request cannot be served by splitting (or on trim).
+constexpr size_t QUICK_LIST_MAX = 32;
+
+bool quick_push(MallocMetadata *block) {
+    int order = block->order;
+    if (order == MAX_ORDER || shard->quick_count[order] == QUICK_LIST_MAX) return false;
+    block->quick = true;
+    block->next_ordered = shard->quick_list[order];
+    shard->quick_list[order] = block;
+    shard->quick_count[order]++;
+    shard->stats.free_per_order[order]++;
+    return true;
+}
+
+MallocMetadata *quick_pop(size_t size) {
+    for (int order = 0; order < MAX_ORDER; order++) {
+        if (size > size_of_block(order) - METADATA_SIZE) continue;
+        MallocMetadata *block = shard->quick_list[order];
+        if (block == nullptr) return nullptr;
+        shard->quick_list[order] = block->next_ordered;
+        shard->quick_count[order]--;
+        shard->stats.free_per_order[order]--;
+        return block;
+    }
+    return nullptr;
+}
+
+// Merges every parked block. Returns whether there was any.
+bool flush_quick_lists() {
+    bool flushed = false;
+    for (int order = 0; order < MAX_ORDER; order++) {
+        while (shard->quick_list[order] != nullptr) {
+            MallocMetadata *block = shard->quick_list[order];
+            shard->quick_list[order] = block->next_ordered;
+            block->quick = false;
+            shard->stats.free_per_order[order]--;
+            release_block(block);
+            flushed = true;
+        }
+        shard->quick_count[order] = 0;
+    }
+    return flushed;
+}
+#endif
+
+#ifdef MALLOC3_BATCH_REFILL
+// An empty free list is refilled with this many blocks at once.
+constexpr size_t REFILL_COUNT = 32;
+
+// Carves a free block into all of its children of the given order in one
+// pass and splices them, already in address order, into that order's list.
+void carve_block(MallocMetadata *block, int order) {
+    LATENCY_DEPTH();
+    list_remove(block);
+    if (block->purge != PURGE_NONE) set_purge_state(block, PURGE_NONE);
+
+    size_t count = size_t(1) << (block->order - order);
+    shard->stats.blocks_per_order[block->order]--;
+    MallocMetadata *prev = block->prev;
+    MallocMetadata *after = block->next;
+    uint32_t freed_at = block->freed_at;
+    unsigned char owner = block->shard;
+    auto *child = block;
+    for (size_t i = 0; i < count; i++) {
+        auto *next = reinterpret_cast<MallocMetadata *>(reinterpret_cast<char *>(child) + size_of_block(order));
+        child->is_free = true;
+        child->purge = PURGE_NONE;
+        child->quick = false;
+        child->shard = owner;
+        child->size = 0;
+        child->order = order;
+        child->freed_at = freed_at;
+        child->prev = prev;
+        child->next = i + 1 < count ? next : after;
+        child->prev_ordered = i > 0 ? prev : nullptr;
+        child->next_ordered = i + 1 < count ? next : nullptr;
+        prev = child;
+        child = next;
+    }
+    MallocMetadata *last = prev;
+    if (after) after->prev = last;
+
+    // One scan finds where the run goes in the address-ordered list.
+    auto &head = shard->block_list[order];
+    MallocMetadata *before = nullptr;
+    MallocMetadata *iter = head;
+    while (iter != nullptr && iter < block) {
+        before = iter;
+        iter = iter->next_ordered;
+    }
+    block->prev_ordered = before;
+    last->next_ordered = iter;
+    if (before) before->next_ordered = block;
+    else head = block;
+    if (iter) iter->prev_ordered = last;
+
+    shard->stats.free_per_order[order] += count;
+    shard->stats.blocks_per_order[order] += count;
+    shard->stats.num_free_blocks += count - 1;
+    shard->stats.num_allocated_blocks += count - 1;
+    shard->stats.num_free_bytes -= (count - 1) * METADATA_SIZE;
+    shard->stats.num_allocated_bytes -= (count - 1) * METADATA_SIZE;
+}
+
+// Fills the empty free list of the given order with up to count blocks,
+// carved from the smallest free block above it.
+bool refill(int order, size_t count) {
+    int span = 0;
+    while ((size_t(1) << span) < count && order + span < MAX_ORDER) span++;
+
+    MallocMetadata *source = nullptr;
+    for (int i = order + 1; i <= MAX_ORDER && !source; i++) source = shard->block_list[i];
+    if (!source) return false;
+
+    while (source->order > order + span) source = split_blocks(source);
+    carve_block(source, order);
+    return true;
+}
+
+// A freed block merges with a free buddy of its order, but siblings carved
+// free side by side are never freed, so nothing merges them; under memory
+// pressure merge every pair of free buddies. Returns whether any merged.
+bool coalesce_free_lists() {
+    bool merged = false;
+    for (int order = 0; order < MAX_ORDER; order++) {
+        MallocMetadata *block = shard->block_list[order];
+        while (block != nullptr) {
+            auto *buddy = reinterpret_cast<MallocMetadata *>(reinterpret_cast<uintptr_t>(block) ^ size_of_block(order));
+            MallocMetadata *next = block->next_ordered;
+            if (buddy->is_free && !buddy->quick && buddy->order == order) {
+                if (next == buddy) next = buddy->next_ordered;
+                merge_blocks(block, buddy);
+                merged = true;
+            }
+            block = next;
+        }
+    }
+    return merged;
+}
+
+#endif
+
+void* allocate_small_block(size_t size) {
+    // A parked block of the right order is taken before anything is carved.
+#ifdef MALLOC3_DEFERRED_COALESCE
+    MallocMetadata *block = quick_pop(size);
+#else
+    MallocMetadata *block = nullptr;
+#endif
+#ifdef MALLOC3_BATCH_REFILL
+    int order = order_for(size);
+    if (!block && shard->block_list[order] == nullptr) refill(order, REFILL_COUNT);
+#endif
+    if (!block) block = split_memory(size);
+#ifdef MALLOC3_DEFERRED_COALESCE
+    if (!block && flush_quick_lists()) block = split_memory(size);
+#endif
+#ifdef MALLOC3_BATCH_REFILL
+    if (!block && coalesce_free_lists()) block = split_memory(size);
+#endif
+    if (!block && regrow_heap()) block = split_memory(size);
+    if (!block) return nullptr;
+
+    block->is_free = false;
+    if (block->quick) {
+        block->quick = false;
+    } else {
+        list_remove(block);
+    }
+    // Keep the purge state for scalloc; it only counts toward purged_bytes
+    // while the block is free.
+    PurgeState purge = block->purge;
+    if (purge != PURGE_NONE) {
+        set_purge_state(block, PURGE_NONE);
+        block->purge = purge;
+    }
+
+    shard->stats.num_free_blocks--;
+    shard->stats.num_free_bytes -= size_of_block(block->order) - METADATA_SIZE;
+
+    grant_requested(block, size);
+    shard->stats.granted_bytes += size_of_block(block->order) - METADATA_SIZE;
+
+    return reinterpret_cast<char *>(block) + METADATA_SIZE;
+}
+
+void *heap_allocate(size_t size) {
+    HeapGuard guard;
+    if (!shard->blocks_init) init_blocks();
     if (size == 0 || size > MAX_ALLOCATION_SIZE) return nullptr;
-    if (size >= size_of_block(MAX_ORDER)) return allocate_large_block(size);
+    return size >= size_of_block(MAX_ORDER) ? allocate_large_block(size) : allocate_small_block(size);
+}
+
+void free_small_block(MallocMetadata *meta) {
+    meta->is_free = true;
+    shard->stats.num_free_blocks++;
+    shard->stats.num_free_bytes += size_of_block(meta->order) - METADATA_SIZE;
+    shard->stats.requested_bytes -= requested_of(meta);
+    shard->stats.granted_bytes -= size_of_block(meta->order) - METADATA_SIZE;
+
+    meta->purge = PURGE_NONE;
+#ifdef MALLOC3_DEFERRED_COALESCE
+    if (!quick_push(meta)) release_block(meta);
+#else
+    release_block(meta);
+#endif
+}
+
+void heap_free(MallocMetadata *meta) {
+    HeapGuard guard(owner_of(meta));
+    if (meta->is_free) return;
+
+    if (meta->size > 0) {
+        LATENCY_PATH(LAT_SLOT_MMAP);
+        shard->stats.num_allocated_blocks--;
+        shard->stats.num_allocated_bytes -= meta->size;
+        shard->stats.mmap_blocks--;
+        shard->stats.mmap_bytes -= meta->size + METADATA_SIZE;
+        shard->stats.munmap_calls++;
+        shard->stats.requested_bytes -= requested_of(meta);
+        shard->stats.granted_bytes -= meta->size;
+
+        munmap(meta, meta->size + METADATA_SIZE);
+    } else {
+        free_small_block(meta);
+    }
+}
 
-    return allocate_small_block(size);
+#ifdef MALLOC3_PER_CPU
+// Per-CPU front end. Each CPU slot keeps a LIFO of blocks per small order
+// behind its own mutex, so threads only meet on a shard lock when a cache
+// runs empty or overflows, and then move a batch of blocks at once. The slot
+// is picked with sched_getcpu(), which glibc answers from its registered rseq
+// area. Cached blocks stay allocated as far as the heap is concerned (marked
+// by quick), with requested set to their whole usable size.
+//
+// A CPU lock is never held while taking a shard lock, so srealloc may call
+// into the caches with a shard lock held.
+constexpr int CPU_CACHE_SLOTS = 256;
+constexpr int CPU_CACHE_ORDERS = 6;
+constexpr size_t CPU_CACHE_BYTES = 16384;   // cap per order and CPU
+
+struct alignas(64) CpuCache {
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    MallocMetadata *blocks[CPU_CACHE_ORDERS] = {nullptr};
+    size_t count[CPU_CACHE_ORDERS] = {0};
+};
+
+CpuCache cpu_caches[CPU_CACHE_SLOTS];
+
+constexpr size_t cpu_cache_limit(int order) {
+    return CPU_CACHE_BYTES / size_of_block(order);
+}
+
+CpuCache &current_cpu_cache() {
+    int cpu = sched_getcpu();
+    return cpu_caches[cpu < 0 ? 0 : cpu % CPU_CACHE_SLOTS];
+}
+
+// Takes a refill batch of half the cap from the heap, chained through
+// next_ordered.
+MallocMetadata *cpu_cache_refill(int order) {
+    HeapGuard guard;
+    if (!shard->blocks_init) init_blocks();
+    MallocMetadata *chain = nullptr;
+    for (size_t i = 0; i < cpu_cache_limit(order) / 2; i++) {
+        void *ptr = allocate_small_block(size_of_block(order) - METADATA_SIZE);
+        if (!ptr) break;
+        auto *block = reinterpret_cast<MallocMetadata *>(reinterpret_cast<char *>(ptr) - METADATA_SIZE);
+        block->quick = true;
+        block->next_ordered = chain;
+        chain = block;
+    }
+    return chain;
+}
+
+// Frees a chain of cached blocks, taking each owning shard's lock once per
+// run of its blocks.
+void cpu_cache_release(MallocMetadata *chain) {
+    while (chain != nullptr) {
+        HeapGuard guard(owner_of(chain));
+        while (chain != nullptr && &owner_of(chain) == shard) {
+            MallocMetadata *block = chain;
+            chain = block->next_ordered;
+            block->quick = false;
+            free_small_block(block);
+        }
+    }
+}
+
+void *cpu_cache_alloc(size_t size) {
+    if (size > size_of_block(CPU_CACHE_ORDERS - 1) - METADATA_SIZE) return nullptr;
+    int order = order_for(size);
+    CpuCache &cache = current_cpu_cache();
+
+    pthread_mutex_lock(&cache.lock);
+    MallocMetadata *block = cache.blocks[order];
+    if (block == nullptr) {
+        pthread_mutex_unlock(&cache.lock);
+        block = cpu_cache_refill(order);
+        if (block == nullptr) return nullptr;
+
+        MallocMetadata *last = block;
+        size_t count = 1;
+        for (; last->next_ordered != nullptr; last = last->next_ordered) count++;
+        pthread_mutex_lock(&cache.lock);
+        last->next_ordered = cache.blocks[order];
+        cache.count[order] += count;
+    }
+    cache.blocks[order] = block->next_ordered;
+    cache.count[order]--;
+    pthread_mutex_unlock(&cache.lock);
+
+    block->quick = false;
+    return reinterpret_cast<char *>(block) + METADATA_SIZE;
+}
+
+// Returns false for blocks the caches do not take. A cache that goes over its
+// cap hands everything past half of it back to the heap.
+bool cpu_cache_free(MallocMetadata *block) {
+    if (block->size > 0 || block->order >= CPU_CACHE_ORDERS) return false;
+    if (block->is_free || block->quick) return true;
+    int order = block->order;
+    block->quick = true;
+    block->purge = PURGE_NONE;
+    CpuCache &cache = current_cpu_cache();
+
+    pthread_mutex_lock(&cache.lock);
+    block->next_ordered = cache.blocks[order];
+    cache.blocks[order] = block;
+    MallocMetadata *excess = nullptr;
+    if (++cache.count[order] > cpu_cache_limit(order)) {
+        size_t keep = cpu_cache_limit(order) / 2;
+        MallocMetadata *last = block;
+        for (size_t i = 1; i < keep; i++) last = last->next_ordered;
+        excess = last->next_ordered;
+        last->next_ordered = nullptr;
+        cache.count[order] = keep;
+    }
+    pthread_mutex_unlock(&cache.lock);
+
+    if (excess != nullptr) cpu_cache_release(excess);
+    return true;
+}
+
+// Hands every cached block back to the heap.
+void drain_cpu_caches() {
+    for (CpuCache &cache : cpu_caches) {
+        for (int order = 0; order < CPU_CACHE_ORDERS; order++) {
+            pthread_mutex_lock(&cache.lock);
+            MallocMetadata *chain = cache.blocks[order];
+            cache.blocks[order] = nullptr;
+            cache.count[order] = 0;
+            pthread_mutex_unlock(&cache.lock);
+            cpu_cache_release(chain);
+        }
+    }
+}
+#endif
+
+void *smalloc(size_t size) {
+    TRACE_SCOPE();
+    LATENCY_BEGIN();
+    // Invalid sizes still set the heap up, but are neither traced nor timed.
+    if (size == 0 || size > MAX_ALLOCATION_SIZE) return heap_allocate(size);
+
+#ifdef MALLOC3_PER_CPU
+    void *ptr = cpu_cache_alloc(size);
+    if (!ptr) ptr = heap_allocate(size);
+#else
+    void *ptr = heap_allocate(size);
+#endif
+    TRACE_EVENT(TRACE_MALLOC, size, nullptr, ptr);
+    LATENCY_END(LAT_MALLOC);
+    return ptr;
 }
 
 void *scalloc(size_t num, size_t size) {
+    TRACE_SCOPE();
+    LATENCY_BEGIN();
     int real_size = num * size;
     void *block_ptr = smalloc(real_size);
     if (block_ptr != nullptr) {
-        memset(block_ptr, 0, real_size);
+        // Pages given back with MADV_DONTNEED are still zero.
+        auto *meta = reinterpret_cast<MallocMetadata *>(reinterpret_cast<char *>(block_ptr) - METADATA_SIZE);
+        size_t dirty = real_size;
+        if (meta->size == 0 && meta->purge == PURGE_ZEROED && dirty > PAGE_SIZE - METADATA_SIZE) {
+            dirty = PAGE_SIZE - METADATA_SIZE;
+        }
+        memset(block_ptr, 0, dirty);
+        TRACE_EVENT(TRACE_CALLOC, real_size, nullptr, block_ptr);
     }
+    LATENCY_END(LAT_CALLOC);
     return block_ptr;
 }
 
 void sfree(void *p) {
     if (!p) return;
+    TRACE_SCOPE();
+    LATENCY_BEGIN();
+    TRACE_EVENT(TRACE_FREE, 0, p, nullptr);
 
     auto *meta = reinterpret_cast<MallocMetadata *>(reinterpret_cast<char *>(p) - METADATA_SIZE);
-    if (meta->is_free) return;
-
-    if (meta->size > 0) {
-        memory_stats.num_allocated_blocks--;
-        memory_stats.num_allocated_bytes -= meta->size;
-
-        munmap(meta, meta->size + METADATA_SIZE);
-    } else {
-        meta->is_free = true;
-        memory_stats.num_free_blocks++;
-        memory_stats.num_free_bytes += size_of_block(meta->order) - METADATA_SIZE;
-
-        list_insert(meta);
-        merge_memory(meta);
-    }
+#ifdef MALLOC3_PER_CPU
+    if (!cpu_cache_free(meta)) heap_free(meta);
+#else
+    heap_free(meta);
+#endif
+    LATENCY_END(LAT_FREE);
 }
 
 void* allocate_new_block(size_t size, void* oldp, size_t oldSize) {
@@ -282,10 +1012,17 @@ void* allocate_new_block(size_t size, void* oldp, size_t oldSize) {
     }
     memmove(newPtr, oldp, oldSize);
     sfree(oldp);
+    LATENCY_PATH(LAT_SLOT_MOVE);
     return newPtr;
 }
 
+void set_requested(MallocMetadata* block, size_t size) {
+    shard->stats.requested_bytes -= requested_of(block);
+    grant_requested(block, size);
+}
+
 void* handle_large_allocation(MallocMetadata* block, void* oldp, size_t size) {
+    LATENCY_PATH(LAT_SLOT_MMAP);
     if (block->size == size) {
         return oldp;
     }
@@ -297,7 +1034,7 @@ MallocMetadata* merge_free_blocks(MallocMetadata* block, size_t size) {
     for (int i = iter->order; i < MAX_ORDER; i++) {
         auto* buddy = reinterpret_cast<MallocMetadata*>(reinterpret_cast<uintptr_t>(iter) ^ size_of_block(i));
 
-        if (!buddy->is_free) {
+        if (!buddy->is_free || buddy->quick) {
             break;
         }
 
@@ -313,7 +1050,7 @@ MallocMetadata* merge_free_blocks(MallocMetadata* block, size_t size) {
                     return nullptr;
                 }
 
-                memory_stats.num_free_bytes -= size_of_block(iter->order - 1);
+                shard->stats.num_free_bytes -= size_of_block(iter->order - 1);
             }
 
             iter->is_free = false;
@@ -325,35 +1062,372 @@ MallocMetadata* merge_free_blocks(MallocMetadata* block, size_t size) {
 }
 
 
-void* srealloc(void* oldp, size_t size) {
-    if (size == 0 || size > MAX_ALLOCATION_SIZE) return nullptr;
-    if (!oldp) return smalloc(size);
-
-    auto *block = reinterpret_cast<MallocMetadata *>(reinterpret_cast<char *>(oldp) - METADATA_SIZE);
-    if (size >= 131072) {
-        return handle_large_allocation(block, oldp, size);
+// Resizes a heap block where it is, under its shard's lock. Returns nullptr
+// when it has to move.
+void* reallocate_in_place(MallocMetadata* block, void* oldp, size_t size) {
+    HeapGuard guard(owner_of(block));
+    if (size <= size_of_block(block->order) - METADATA_SIZE) {
+        set_requested(block, size);
+        return oldp;
     }
 
-    if (size <= size_of_block(block->order)) return oldp;
-
+    int old_order = block->order;
+    size_t old_requested = requested_of(block);
+    block->purge = PURGE_NONE;
     auto *new_block = merge_free_blocks(block, size);
     if (new_block) {
+        shard->stats.granted_bytes += size_of_block(new_block->order) - size_of_block(old_order);
+        shard->stats.requested_bytes -= old_requested;
+        grant_requested(new_block, size);
         memmove(reinterpret_cast<char *>(new_block) + METADATA_SIZE, oldp, size_of_block(block->order) - METADATA_SIZE);
         return reinterpret_cast<char *>(new_block) + METADATA_SIZE;
     }
+    return nullptr;
+}
+
+// Moving a block allocates from the caller's shard and frees to the owner's
+// without holding either lock across both, so two threads moving blocks
+// between the same shards cannot deadlock.
+void* reallocate(void* oldp, size_t size) {
+    if (size == 0 || size > MAX_ALLOCATION_SIZE) return nullptr;
+    if (!oldp) return smalloc(size);
+
+    auto *block = reinterpret_cast<MallocMetadata *>(reinterpret_cast<char *>(oldp) - METADATA_SIZE);
+    if (size >= MAX_BLOCK_SIZE) {
+        return handle_large_allocation(block, oldp, size);
+    }
 
+    if (void* newp = reallocate_in_place(block, oldp, size)) return newp;
     return allocate_new_block(size, oldp, size_of_block(block->order) - METADATA_SIZE);
 }
 
+void* srealloc(void* oldp, size_t size) {
+    TRACE_SCOPE();
+    LATENCY_BEGIN();
+    void* newp = reallocate(oldp, size);
+    TRACE_EVENT(TRACE_REALLOC, size, oldp, newp);
+    LATENCY_END(LAT_REALLOC);
+    return newp;
+}
+
+// The counters summed over every shard. Readers take no lock, as before.
+size_t total(size_t MemoryStats::*counter) {
+    size_t sum = 0;
+    for (Shard &part : shards) sum += part.stats.*counter;
+    return sum;
+}
 
-size_t _num_free_blocks() { return memory_stats.num_free_blocks; }
+size_t _num_free_blocks() { return total(&MemoryStats::num_free_blocks); }
 
-size_t _num_free_bytes() { return memory_stats.num_free_bytes; }
+size_t _num_free_bytes() { return total(&MemoryStats::num_free_bytes); }
 
-size_t _num_allocated_blocks() { return memory_stats.num_allocated_blocks; }
+size_t _num_allocated_blocks() { return total(&MemoryStats::num_allocated_blocks); }
 
-size_t _num_allocated_bytes() { return memory_stats.num_allocated_bytes; }
+size_t _num_allocated_bytes() { return total(&MemoryStats::num_allocated_bytes); }
 
 size_t _num_meta_data_bytes() { return METADATA_SIZE * _num_allocated_blocks(); }
 
-size_t _size_meta_data() { return METADATA_SIZE; }
\ No newline at end of file
+size_t _size_meta_data() { return METADATA_SIZE; }
+
+// Counters smalloc_stats adds up over the shards, next to the per-order ones.
+constexpr size_t MemoryStats::*SUMMED_COUNTERS[] = {
+    &MemoryStats::requested_bytes, &MemoryStats::granted_bytes, &MemoryStats::mmap_blocks,
+    &MemoryStats::mmap_bytes,      &MemoryStats::sbrk_calls,    &MemoryStats::mmap_calls,
+    &MemoryStats::munmap_calls,    &MemoryStats::heap_growths,  &MemoryStats::heap_bytes,
+    &MemoryStats::madvise_calls,   &MemoryStats::purged_bytes,
+};
+
+void smalloc_stats(heap_stats *stats) {
+    *stats = heap_stats{};
+    MemoryStats sum;
+    for (Shard &part : shards) {
+        HeapGuard guard(part);
+        for (int order = 0; order <= MAX_ORDER; order++) {
+            sum.free_per_order[order] += shard->stats.free_per_order[order];
+            sum.blocks_per_order[order] += shard->stats.blocks_per_order[order];
+        }
+        for (size_t MemoryStats::*counter : SUMMED_COUNTERS) sum.*counter += shard->stats.*counter;
+#ifdef MALLOC3_DEFERRED_COALESCE
+        for (size_t count : shard->quick_count) stats->quick_blocks += count;
+#endif
+    }
+
+    stats->num_orders = MAX_ORDER + 1;
+    for (int order = 0; order <= MAX_ORDER; order++) {
+        stats->block_size[order] = size_of_block(order);
+        stats->free_blocks[order] = sum.free_per_order[order];
+        stats->used_blocks[order] = sum.blocks_per_order[order] - sum.free_per_order[order];
+        stats->free_bytes += sum.free_per_order[order] * size_of_block(order);
+        if (sum.free_per_order[order] > 0) stats->largest_free_block = size_of_block(order);
+    }
+    if (stats->free_bytes > 0) {
+        stats->external_fragmentation = 1.0 - double(stats->largest_free_block) / stats->free_bytes;
+    }
+
+    stats->requested_bytes = sum.requested_bytes;
+    stats->granted_bytes = sum.granted_bytes;
+    if (stats->requested_bytes > 0) {
+        stats->internal_fragmentation = 1.0 - double(stats->requested_bytes) / stats->granted_bytes;
+    }
+
+    stats->mmap_blocks = sum.mmap_blocks;
+    stats->mmap_bytes = sum.mmap_bytes;
+    stats->sbrk_calls = sum.sbrk_calls;
+    stats->mmap_calls = sum.mmap_calls;
+    stats->munmap_calls = sum.munmap_calls;
+    stats->heap_growths = sum.heap_growths;
+    stats->heap_bytes = sum.heap_bytes;
+    stats->madvise_calls = sum.madvise_calls;
+    stats->purged_bytes = sum.purged_bytes;
+#ifdef MALLOC3_PER_CPU
+    for (CpuCache &cache : cpu_caches) {
+        pthread_mutex_lock(&cache.lock);
+        for (int order = 0; order < CPU_CACHE_ORDERS; order++) {
+            stats->cpu_cache_blocks += cache.count[order];
+            stats->cpu_cache_bytes += cache.count[order] * size_of_block(order);
+        }
+        pthread_mutex_unlock(&cache.lock);
+    }
+#endif
+}
+
+void smalloc_stats_print(FILE *out, smalloc_stats_format format) {
+    heap_stats stats;
+    MALLOC_ENGINE_NS::smalloc_stats(&stats);
+
+    if (format == SMALLOC_STATS_JSON) {
+        fprintf(out, "{\"orders\":[");
+        for (int order = 0; order < stats.num_orders; order++) {
+            fprintf(out, "%s{\"order\":%d,\"block_size\":%zu,\"free\":%zu,\"used\":%zu}", order ? "," : "", order,
+                    stats.block_size[order], stats.free_blocks[order], stats.used_blocks[order]);
+        }
+        fprintf(out,
+                "],\"free_bytes\":%zu,\"largest_free_block\":%zu,\"external_fragmentation\":%.4f,"
+                "\"requested_bytes\":%zu,\"granted_bytes\":%zu,\"internal_fragmentation\":%.4f,"
+                "\"mmap_blocks\":%zu,\"mmap_bytes\":%zu,\"sbrk_calls\":%zu,\"mmap_calls\":%zu,"
+                "\"munmap_calls\":%zu,\"heap_growths\":%zu,\"heap_bytes\":%zu,\"madvise_calls\":%zu,"
+                "\"purged_bytes\":%zu}\n",
+                stats.free_bytes, stats.largest_free_block, stats.external_fragmentation, stats.requested_bytes,
+                stats.granted_bytes, stats.internal_fragmentation, stats.mmap_blocks, stats.mmap_bytes,
+                stats.sbrk_calls, stats.mmap_calls, stats.munmap_calls, stats.heap_growths, stats.heap_bytes,
+                stats.madvise_calls, stats.purged_bytes);
+        return;
+    }
+
+    fprintf(out, "order  block_size      free      used\n");
+    for (int order = 0; order < stats.num_orders; order++) {
+        fprintf(out, "%5d %11zu %9zu %9zu\n", order, stats.block_size[order], stats.free_blocks[order],
+                stats.used_blocks[order]);
+    }
+    fprintf(out, "free bytes:             %zu (largest block %zu)\n", stats.free_bytes, stats.largest_free_block);
+    fprintf(out, "external fragmentation: %.2f%%\n", 100.0 * stats.external_fragmentation);
+    fprintf(out, "requested / granted:    %zu / %zu\n", stats.requested_bytes, stats.granted_bytes);
+    fprintf(out, "internal fragmentation: %.2f%%\n", 100.0 * stats.internal_fragmentation);
+    fprintf(out, "mmap blocks:            %zu (%zu bytes)\n", stats.mmap_blocks, stats.mmap_bytes);
+    fprintf(out, "syscalls:               sbrk %zu, mmap %zu, munmap %zu\n", stats.sbrk_calls, stats.mmap_calls,
+            stats.munmap_calls);
+    fprintf(out, "heap:                   %zu bytes, grown %zu times\n", stats.heap_bytes, stats.heap_growths);
+    fprintf(out, "purged:                 %zu bytes, madvise %zu\n", stats.purged_bytes, stats.madvise_calls);
+    fprintf(out, "per-CPU caches:         %zu blocks (%zu bytes)\n", stats.cpu_cache_blocks, stats.cpu_cache_bytes);
+}
+
+void smalloc_get_purge_policy(smalloc_purge_policy *policy) {
+    HeapGuard guard;
+    *policy = purge_policy;
+}
+
+void smalloc_set_purge_policy(const smalloc_purge_policy *policy) {
+    HeapGuard guard;
+    purge_policy = *policy;
+    if (purge_policy.min_order < 0) purge_policy.min_order = 0;
+}
+
+size_t smalloc_purge() {
+    size_t released = 0;
+    for (Shard &part : shards) {
+        HeapGuard guard(part);
+        for (int order = purge_policy.min_order; order <= MAX_ORDER; order++) {
+            for (MallocMetadata *block = shard->block_list[order]; block != nullptr; block = block->next_ordered) {
+                released += purge_block(block);
+            }
+        }
+    }
+    return released;
+}
+
+// Blocks purged, and free blocks looked at, per hold of a shard lock, so an
+// allocation never waits behind more than a few madvise calls.
+constexpr int PURGE_BATCH = 4;
+constexpr int PURGE_SCAN = 64;
+
+// Purges up to PURGE_BATCH decayed blocks of one shard, going on from where
+// the last batch of the sweep stopped, largest orders first; restart begins
+// a new sweep. Adds the bytes released to done and returns false once the
+// sweep has reached the end of the lists.
+bool purge_decayed_batch(Shard &part, uint32_t now, size_t budget, bool restart, size_t &done) {
+    HeapGuard guard(part);
+    if (restart) {
+        shard->purge_order = MAX_ORDER;
+        shard->purge_cursor = shard->block_list[MAX_ORDER];
+    }
+    size_t released = 0;
+    int purged = 0;
+    bool more = true;
+    for (int seen = 0; seen < PURGE_SCAN && purged < PURGE_BATCH; seen++) {
+        MallocMetadata *block = shard->purge_cursor;
+        if (block == nullptr) {
+            if (--shard->purge_order < purge_policy.min_order) {
+                more = false;
+                break;
+            }
+            shard->purge_cursor = shard->block_list[shard->purge_order];
+            continue;
+        }
+        shard->purge_cursor = block->next_ordered;
+        if (block->purge != PURGE_NONE || now - block->freed_at < purger.config.decay_ms) continue;
+        if (released + purgeable_bytes(block->order) > budget) continue;
+        size_t length = purge_block(block);
+        released += length;
+        purged += length > 0;
+    }
+    done += released;
+    return more;
+}
+
+void *purger_main(void *) {
+    pthread_mutex_lock(&purger.wake_lock);
+    while (!purger.stopping) {
+        timespec deadline{};
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += purger.config.interval_ms / 1000;
+        deadline.tv_nsec += (purger.config.interval_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (!purger.stopping && pthread_cond_timedwait(&purger.wake, &purger.wake_lock, &deadline) == 0) {
+        }
+        if (purger.stopping) break;
+        pthread_mutex_unlock(&purger.wake_lock);
+
+        uint32_t now = now_ms();
+        size_t done = 0;
+        for (Shard &part : shards) {
+            bool more = true;
+            for (bool restart = true; more && done < purger.config.max_bytes_per_tick; restart = false) {
+                more = purge_decayed_batch(part, now, purger.config.max_bytes_per_tick - done, restart, done);
+                sched_yield();
+            }
+        }
+
+        pthread_mutex_lock(&purger.wake_lock);
+    }
+    pthread_mutex_unlock(&purger.wake_lock);
+    return nullptr;
+}
+
+int smalloc_purger_start(const smalloc_purger_config *config) {
+    if (purger.running) return -1;
+    if (!shard->blocks_init) init_blocks();
+
+    purger.config = *config;
+    if (purger.config.interval_ms == 0) purger.config.interval_ms = 1;
+    purger.stopping = false;
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&purger.wake, &attr);
+    pthread_condattr_destroy(&attr);
+
+    // Allocation calls start locking before the thread can touch the heap.
+    __atomic_store_n(&purger.running, true, __ATOMIC_RELEASE);
+    if (pthread_create(&purger.thread, nullptr, purger_main, nullptr) != 0) {
+        __atomic_store_n(&purger.running, false, __ATOMIC_RELEASE);
+        pthread_cond_destroy(&purger.wake);
+        return -1;
+    }
+    return 0;
+}
+
+void smalloc_purger_stop() {
+    if (!purger.running) return;
+    pthread_mutex_lock(&purger.wake_lock);
+    purger.stopping = true;
+    pthread_cond_signal(&purger.wake);
+    pthread_mutex_unlock(&purger.wake_lock);
+    pthread_join(purger.thread, nullptr);
+    pthread_cond_destroy(&purger.wake);
+    __atomic_store_n(&purger.running, false, __ATOMIC_RELEASE);
+}
+
+// Releases the free max-order blocks at the top of the sbrk heap, keeping at
+// least pad bytes of them. Called with the first shard's lock held.
+size_t trim_heap_top(size_t pad) {
+    size_t trailing = 0;
+    for (char *slot = heap_end; slot != heap_start; slot -= size_of_block(MAX_ORDER)) {
+        auto *block = reinterpret_cast<MallocMetadata *>(slot - size_of_block(MAX_ORDER));
+        if (!block->is_free || block->order != MAX_ORDER) break;
+        trailing++;
+    }
+    size_t keep = (pad + size_of_block(MAX_ORDER) - 1) / size_of_block(MAX_ORDER);
+    size_t count = trailing > keep ? trailing - keep : 0;
+    if (count == 0 || sbrk(0) != heap_end) return 0;
+
+    size_t length = count * size_of_block(MAX_ORDER);
+    for (size_t i = 0; i < count; i++) {
+        auto *block = reinterpret_cast<MallocMetadata *>(heap_end - (i + 1) * size_of_block(MAX_ORDER));
+        set_purge_state(block, PURGE_NONE);
+        list_remove(block);
+        if (block->prev != nullptr) block->prev->next = nullptr;
+    }
+    shard->stats.sbrk_calls++;
+    if (sbrk(-static_cast<intptr_t>(length)) == reinterpret_cast<void *>(-1)) {
+        for (size_t i = 0; i < count; i++) {
+            auto *block = reinterpret_cast<MallocMetadata *>(heap_end - (count - i) * size_of_block(MAX_ORDER));
+            if (block->prev != nullptr) block->prev->next = block;
+            list_insert(block);
+        }
+        return 0;
+    }
+    shard->stats.num_allocated_blocks -= count;
+    shard->stats.num_free_blocks -= count;
+    shard->stats.num_allocated_bytes -= count * (size_of_block(MAX_ORDER) - METADATA_SIZE);
+    shard->stats.num_free_bytes -= count * (size_of_block(MAX_ORDER) - METADATA_SIZE);
+    shard->stats.blocks_per_order[MAX_ORDER] -= count;
+    shard->stats.heap_bytes -= length;
+    heap_end -= length;
+    trimmed_blocks += count;
+    return length;
+}
+
+// Gives the free max-order blocks at the top of the heap back with a negative
+// sbrk, keeping at least pad bytes of them, then purges every other free
+// block. Returns the bytes released.
+size_t smalloc_trim(size_t pad) {
+#ifdef MALLOC3_PER_CPU
+    drain_cpu_caches();
+#endif
+    size_t released = 0;
+    for (Shard &part : shards) {
+        HeapGuard guard(part);
+        if (!shard->blocks_init) continue;
+#ifdef MALLOC3_DEFERRED_COALESCE
+        flush_quick_lists();
+#endif
+#ifdef MALLOC3_BATCH_REFILL
+        coalesce_free_lists();
+#endif
+        // Only the first shard owns the sbrk region.
+        if (shard == &shards[0]) released += trim_heap_top(pad);
+
+        for (int order = 0; order <= MAX_ORDER; order++) {
+            for (MallocMetadata *block = shard->block_list[order]; block != nullptr; block = block->next_ordered) {
+                released += purge_block(block);
+            }
+        }
+    }
+    return released;
+}
+
+MALLOC_ENGINE_END
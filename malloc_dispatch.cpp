@@ -0,0 +1,163 @@
+#include <cstdlib>
+#include <cstring>
+
+#include "malloc_engine.h"
+
+// The my_stdlib.h API over whichever engine the process picks, see
+// malloc_engine.h. Each call has its own pointer in calls, so it is one load
+// and one indirect call. Until an engine is chosen the pointers lead to
+// bootstrap functions that make the choice and then forward; choosing writes
+// every pointer once, so the calls themselves never test for it.
+
+const MallocEngine *const ENGINES[] = {
+    &malloc_engine_buddy, &malloc_engine_tlsf, &malloc_engine_bestfit, &malloc_engine_firstfit, &malloc_engine_lockfree,
+};
+
+const MallocEngine *active = nullptr;
+
+const MallocEngine *find_engine(const char *name) {
+    if (name == nullptr) return nullptr;
+    for (const MallocEngine *engine : ENGINES) {
+        if (std::strcmp(engine->name, name) == 0) return engine;
+    }
+    return nullptr;
+}
+
+extern MallocEngine calls;
+
+// Makes engine the active one unless another already is, and returns the one
+// that is. A call that still reads a bootstrap pointer while the others are
+// written lands in settle_engine() and forwards.
+const MallocEngine *install(const MallocEngine *engine) {
+    const MallocEngine *expected = nullptr;
+    if (!__atomic_compare_exchange_n(&active, &expected, engine, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return expected;
+    }
+    __atomic_store_n(&calls.smalloc, engine->smalloc, __ATOMIC_RELAXED);
+    __atomic_store_n(&calls.scalloc, engine->scalloc, __ATOMIC_RELAXED);
+    __atomic_store_n(&calls.sfree, engine->sfree, __ATOMIC_RELAXED);
+    __atomic_store_n(&calls.srealloc, engine->srealloc, __ATOMIC_RELAXED);
+    __atomic_store_n(&calls.num_free_blocks, engine->num_free_blocks, __ATOMIC_RELAXED);
+    __atomic_store_n(&calls.num_free_bytes, engine->num_free_bytes, __ATOMIC_RELAXED);
+    __atomic_store_n(&calls.num_allocated_blocks, engine->num_allocated_blocks, __ATOMIC_RELAXED);
+    __atomic_store_n(&calls.num_allocated_bytes, engine->num_allocated_bytes, __ATOMIC_RELAXED);
+    __atomic_store_n(&calls.num_meta_data_bytes, engine->num_meta_data_bytes, __ATOMIC_RELAXED);
+    __atomic_store_n(&calls.size_meta_data, engine->size_meta_data, __ATOMIC_RELAXED);
+    return engine;
+}
+
+// Settles the engine on the first call. Threads racing here all find the
+// same one.
+const MallocEngine *settle_engine() {
+    const MallocEngine *engine = __atomic_load_n(&active, __ATOMIC_ACQUIRE);
+    if (engine != nullptr) return engine;
+    engine = find_engine(std::getenv("SMALLOC_ENGINE"));
+    return install(engine != nullptr ? engine : ENGINES[0]);
+}
+
+void *bootstrap_smalloc(size_t size) {
+    return settle_engine()->smalloc(size);
+}
+
+void *bootstrap_scalloc(size_t num, size_t size) {
+    return settle_engine()->scalloc(num, size);
+}
+
+void bootstrap_sfree(void *p) {
+    settle_engine()->sfree(p);
+}
+
+void *bootstrap_srealloc(void *oldp, size_t size) {
+    return settle_engine()->srealloc(oldp, size);
+}
+
+size_t bootstrap_num_free_blocks() {
+    return settle_engine()->num_free_blocks();
+}
+
+size_t bootstrap_num_free_bytes() {
+    return settle_engine()->num_free_bytes();
+}
+
+size_t bootstrap_num_allocated_blocks() {
+    return settle_engine()->num_allocated_blocks();
+}
+
+size_t bootstrap_num_allocated_bytes() {
+    return settle_engine()->num_allocated_bytes();
+}
+
+size_t bootstrap_num_meta_data_bytes() {
+    return settle_engine()->num_meta_data_bytes();
+}
+
+size_t bootstrap_size_meta_data() {
+    return settle_engine()->size_meta_data();
+}
+
+// Constant-initialized, so calls made before main() already find it.
+MallocEngine calls = {
+    nullptr,
+    bootstrap_smalloc,
+    bootstrap_scalloc,
+    bootstrap_sfree,
+    bootstrap_srealloc,
+    bootstrap_num_free_blocks,
+    bootstrap_num_free_bytes,
+    bootstrap_num_allocated_blocks,
+    bootstrap_num_allocated_bytes,
+    bootstrap_num_meta_data_bytes,
+    bootstrap_size_meta_data,
+};
+
+int smalloc_select_engine(const char *name) {
+    const MallocEngine *engine = find_engine(name);
+    if (engine == nullptr) return -1;
+    return install(engine) == engine ? 0 : -1;
+}
+
+const char *smalloc_engine_name() {
+    return settle_engine()->name;
+}
+
+// Relaxed loads: each pointer is written once, before any block of the engine
+// exists, and a stale one still leads to the engine through settle_engine().
+void *smalloc(size_t size) {
+    return __atomic_load_n(&calls.smalloc, __ATOMIC_RELAXED)(size);
+}
+
+void *scalloc(size_t num, size_t size) {
+    return __atomic_load_n(&calls.scalloc, __ATOMIC_RELAXED)(num, size);
+}
+
+void sfree(void *p) {
+    __atomic_load_n(&calls.sfree, __ATOMIC_RELAXED)(p);
+}
+
+void *srealloc(void *oldp, size_t size) {
+    return __atomic_load_n(&calls.srealloc, __ATOMIC_RELAXED)(oldp, size);
+}
+
+size_t _num_free_blocks() {
+    return __atomic_load_n(&calls.num_free_blocks, __ATOMIC_RELAXED)();
+}
+
+size_t _num_free_bytes() {
+    return __atomic_load_n(&calls.num_free_bytes, __ATOMIC_RELAXED)();
+}
+
+size_t _num_allocated_blocks() {
+    return __atomic_load_n(&calls.num_allocated_blocks, __ATOMIC_RELAXED)();
+}
+
+size_t _num_allocated_bytes() {
+    return __atomic_load_n(&calls.num_allocated_bytes, __ATOMIC_RELAXED)();
+}
+
+size_t _num_meta_data_bytes() {
+    return __atomic_load_n(&calls.num_meta_data_bytes, __ATOMIC_RELAXED)();
+}
+
+size_t _size_meta_data() {
+    return __atomic_load_n(&calls.size_meta_data, __ATOMIC_RELAXED)();
+}
@@ -0,0 +1,73 @@
+#ifndef MALLOC_ENGINE_H
+#define MALLOC_ENGINE_H
+
+#include <stddef.h>
+
+// Several engines in one binary. Every engine defines the my_stdlib.h API as
+// global functions, so normally a binary links exactly one. Built with
+// MALLOC_ENGINE=<name>, an engine source instead puts all of its definitions
+// in namespace engine_<name> and exports them as the table malloc_engine_<name>.
+// malloc_dispatch.cpp links those tables and defines the global API on top:
+// it picks an engine once, on the first call, and from then on every call is
+// a single indirect call through a pointer set to the chosen engine's function.
+
+struct MallocEngine {
+    const char *name;
+    void *(*smalloc)(size_t size);
+    void *(*scalloc)(size_t num, size_t size);
+    void (*sfree)(void *p);
+    void *(*srealloc)(void *oldp, size_t size);
+    size_t (*num_free_blocks)();
+    size_t (*num_free_bytes)();
+    size_t (*num_allocated_blocks)();
+    size_t (*num_allocated_bytes)();
+    size_t (*num_meta_data_bytes)();
+    size_t (*size_meta_data)();
+};
+
+// Engines linked into malloc_dispatch, in order of preference.
+extern const MallocEngine malloc_engine_buddy;      // malloc_3.cpp
+extern const MallocEngine malloc_engine_tlsf;       // malloc_tlsf.cpp
+extern const MallocEngine malloc_engine_bestfit;    // malloc_2.cpp
+extern const MallocEngine malloc_engine_firstfit;   // malloc_2.cpp with MALLOC2_FIRST_FIT
+extern const MallocEngine malloc_engine_lockfree;   // malloc_lockfree.cpp
+
+// Chooses the engine by name before the first allocation. Returns -1 for an
+// unknown name or once an engine is in use. Without a call, the first
+// allocation takes the engine named by the SMALLOC_ENGINE environment variable,
+// or the first in the list when it is unset or unknown.
+int smalloc_select_engine(const char *name);
+const char *smalloc_engine_name(void);
+
+#ifdef MALLOC_ENGINE
+
+#define MALLOC_ENGINE_PASTE_(a, b) a##b
+#define MALLOC_ENGINE_PASTE(a, b) MALLOC_ENGINE_PASTE_(a, b)
+#define MALLOC_ENGINE_STRING_(a) #a
+#define MALLOC_ENGINE_STRING(a) MALLOC_ENGINE_STRING_(a)
+#define MALLOC_ENGINE_NS MALLOC_ENGINE_PASTE(engine_, MALLOC_ENGINE)
+
+// Wrap an engine's definitions, after its #includes. Calls that take types
+// from the shared headers qualify the callee with MALLOC_ENGINE_NS, since
+// argument-dependent lookup also finds the global declaration.
+#define MALLOC_ENGINE_BEGIN namespace MALLOC_ENGINE_NS {
+#define MALLOC_ENGINE_END                                                                           \
+    }                                                                                               \
+    extern const MallocEngine MALLOC_ENGINE_PASTE(malloc_engine_, MALLOC_ENGINE) = {                 \
+        MALLOC_ENGINE_STRING(MALLOC_ENGINE),     MALLOC_ENGINE_NS::smalloc,                         \
+        MALLOC_ENGINE_NS::scalloc,               MALLOC_ENGINE_NS::sfree,                           \
+        MALLOC_ENGINE_NS::srealloc,              MALLOC_ENGINE_NS::_num_free_blocks,                \
+        MALLOC_ENGINE_NS::_num_free_bytes,       MALLOC_ENGINE_NS::_num_allocated_blocks,           \
+        MALLOC_ENGINE_NS::_num_allocated_bytes,  MALLOC_ENGINE_NS::_num_meta_data_bytes,            \
+        MALLOC_ENGINE_NS::_size_meta_data,                                                          \
+    };
+
+#else
+
+#define MALLOC_ENGINE_NS
+#define MALLOC_ENGINE_BEGIN
+#define MALLOC_ENGINE_END
+
+#endif
+
+#endif /* MALLOC_ENGINE_H */
@@ -0,0 +1,167 @@
+#include "malloc_latency.h"
+
+#include <atomic>
+#include <cstring>
+#include <ctime>
+#include <pthread.h>
+#include <sys/mman.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Histograms are written by their owning thread only and read by collectors
+// without locking; relaxed atomics keep that well defined without a locked
+// instruction on the hot path. They live in anonymous mappings so timing an
+// engine never allocates from it, and are kept after the thread exits so its
+// samples stay in the report.
+
+struct ThreadHistograms {
+    std::atomic<uint32_t> counts[LAT_NUM_OPS][LAT_NUM_SLOTS][LAT_NUM_BUCKETS];
+    std::atomic<uint64_t> max[LAT_NUM_OPS][LAT_NUM_SLOTS];
+    ThreadHistograms *next;
+};
+
+struct LatencyContext {
+    int depth = 0;
+    int slot = -1;
+    int nesting = 0;
+};
+
+pthread_mutex_t latency_lock = PTHREAD_MUTEX_INITIALIZER;
+ThreadHistograms *latency_threads = nullptr;
+thread_local ThreadHistograms *latency_histograms = nullptr;
+thread_local LatencyContext latency_context;
+
+uint64_t latency_now() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+ThreadHistograms *thread_histograms() {
+    if (latency_histograms) return latency_histograms;
+
+    void *ptr = mmap(nullptr, sizeof(ThreadHistograms), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) return nullptr;
+
+    // Fresh anonymous pages are zero, which is a valid state for the atomics.
+    auto *histograms = static_cast<ThreadHistograms *>(ptr);
+    pthread_mutex_lock(&latency_lock);
+    histograms->next = latency_threads;
+    latency_threads = histograms;
+    pthread_mutex_unlock(&latency_lock);
+    return latency_histograms = histograms;
+}
+
+LatencyProbe::LatencyProbe() : outermost(latency_context.nesting++ == 0), start(0) {
+    if (outermost) {
+        latency_context.depth = 0;
+        latency_context.slot = -1;
+        start = latency_now();
+    }
+}
+
+LatencyProbe::~LatencyProbe() { latency_context.nesting--; }
+
+void LatencyProbe::finish(LatencyOp op) {
+    if (!outermost) return;
+    uint64_t cycles = latency_now() - start;
+
+    ThreadHistograms *histograms = thread_histograms();
+    if (!histograms) return;
+
+    int slot = latency_context.slot;
+    if (slot < 0) slot = latency_context.depth < LAT_MAX_DEPTH ? latency_context.depth : LAT_MAX_DEPTH;
+
+    auto &count = histograms->counts[op][slot][latency_bucket(cycles)];
+    count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    auto &max = histograms->max[op][slot];
+    if (cycles > max.load(std::memory_order_relaxed)) max.store(cycles, std::memory_order_relaxed);
+}
+
+void latency_note_depth() { latency_context.depth++; }
+
+void latency_note_path(int slot) { latency_context.slot = slot; }
+
+uint64_t percentile(const uint64_t *buckets, uint64_t count, double fraction) {
+    uint64_t rank = static_cast<uint64_t>(fraction * count);
+    if (rank >= count) rank = count - 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < LAT_NUM_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen > rank) return latency_bucket_floor(i);
+    }
+    return latency_bucket_floor(LAT_NUM_BUCKETS - 1);
+}
+
+size_t smalloc_latency_collect(LatencySummary *summaries, size_t max_summaries) {
+    size_t found = 0;
+    uint64_t buckets[LAT_NUM_BUCKETS];
+
+    pthread_mutex_lock(&latency_lock);
+    for (int op = 0; op < LAT_NUM_OPS; op++) {
+        for (int slot = 0; slot < LAT_NUM_SLOTS; slot++) {
+            memset(buckets, 0, sizeof(buckets));
+            uint64_t count = 0, max = 0;
+            for (ThreadHistograms *iter = latency_threads; iter != nullptr; iter = iter->next) {
+                for (int i = 0; i < LAT_NUM_BUCKETS; i++) {
+                    uint32_t n = iter->counts[op][slot][i].load(std::memory_order_relaxed);
+                    buckets[i] += n;
+                    count += n;
+                }
+                uint64_t thread_max = iter->max[op][slot].load(std::memory_order_relaxed);
+                if (thread_max > max) max = thread_max;
+            }
+            if (count == 0) continue;
+
+            if (found < max_summaries) {
+                summaries[found] = {op, slot, count, percentile(buckets, count, 0.5), percentile(buckets, count, 0.9),
+                                    percentile(buckets, count, 0.99), percentile(buckets, count, 0.999), max};
+            }
+            found++;
+        }
+    }
+    pthread_mutex_unlock(&latency_lock);
+    return found;
+}
+
+void smalloc_latency_reset() {
+    pthread_mutex_lock(&latency_lock);
+    for (ThreadHistograms *iter = latency_threads; iter != nullptr; iter = iter->next) {
+        for (auto &per_op : iter->counts) {
+            for (auto &per_slot : per_op) {
+                for (auto &count : per_slot) count.store(0, std::memory_order_relaxed);
+            }
+        }
+        for (auto &per_op : iter->max) {
+            for (auto &max : per_op) max.store(0, std::memory_order_relaxed);
+        }
+    }
+    pthread_mutex_unlock(&latency_lock);
+}
+
+void smalloc_latency_print(FILE *out) {
+    static const char *op_names[LAT_NUM_OPS] = {"smalloc", "scalloc", "srealloc", "sfree"};
+    LatencySummary summaries[LAT_NUM_OPS * LAT_NUM_SLOTS];
+    size_t found = smalloc_latency_collect(summaries, LAT_NUM_OPS * LAT_NUM_SLOTS);
+
+    fprintf(out, "%-9s %-9s %12s %10s %10s %10s %10s %12s\n", "op", "path", "count", "p50", "p90", "p99", "p99.9",
+            "max");
+    for (size_t i = 0; i < found; i++) {
+        const LatencySummary &s = summaries[i];
+        char path[16];
+        if (s.slot == LAT_SLOT_MMAP) snprintf(path, sizeof(path), "mmap");
+        else if (s.slot == LAT_SLOT_MOVE) snprintf(path, sizeof(path), "move");
+        else if (s.slot == 0) snprintf(path, sizeof(path), "fast");
+        else snprintf(path, sizeof(path), "%s%d", s.op == LAT_FREE || s.op == LAT_REALLOC ? "merge" : "split", s.slot);
+
+        fprintf(out, "%-9s %-9s %12lu %10lu %10lu %10lu %10lu %12lu\n", op_names[s.op], path,
+                static_cast<unsigned long>(s.count), static_cast<unsigned long>(s.p50),
+                static_cast<unsigned long>(s.p90), static_cast<unsigned long>(s.p99),
+                static_cast<unsigned long>(s.p999), static_cast<unsigned long>(s.max));
+    }
+}
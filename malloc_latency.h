@@ -0,0 +1,95 @@
+#ifndef MALLOC_LATENCY_H
+#define MALLOC_LATENCY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Per-operation latency histograms, available when the engine is built with
+// MALLOC_LATENCY. Every public call is timed in cycles (rdtsc where available,
+// nanoseconds otherwise) and recorded into a per-thread log-linear histogram
+// selected by operation and by the path the call took inside the engine.
+
+enum LatencyOp {
+    LAT_MALLOC,
+    LAT_CALLOC,
+    LAT_REALLOC,
+    LAT_FREE,
+    LAT_NUM_OPS,
+};
+
+// Slot 0 is the fast path (free list hit, in-place srealloc, free without
+// merging), slots 1..LAT_MAX_DEPTH are the split or merge depth.
+constexpr int LAT_MAX_DEPTH = 16;
+constexpr int LAT_SLOT_MMAP = LAT_MAX_DEPTH + 1;
+constexpr int LAT_SLOT_MOVE = LAT_MAX_DEPTH + 2;
+constexpr int LAT_NUM_SLOTS = LAT_MAX_DEPTH + 3;
+
+// 16 linear sub-buckets per power of two, values up to 2^40 cycles.
+constexpr int LAT_SUB_BITS = 4;
+constexpr int LAT_MAX_BITS = 40;
+constexpr int LAT_NUM_BUCKETS = (LAT_MAX_BITS - LAT_SUB_BITS + 1) << LAT_SUB_BITS;
+
+struct LatencySummary {
+    int op;
+    int slot;
+    uint64_t count;
+    uint64_t p50;
+    uint64_t p90;
+    uint64_t p99;
+    uint64_t p999;
+    uint64_t max;
+};
+
+// Merges the histograms of every thread that ever allocated and writes one
+// summary per non-empty (op, slot) pair. Returns the number of pairs, which may
+// exceed max_summaries.
+size_t smalloc_latency_collect(LatencySummary *summaries, size_t max_summaries);
+void smalloc_latency_print(FILE *out);
+void smalloc_latency_reset();
+
+constexpr int latency_bucket(uint64_t value) {
+    if (value < (uint64_t(1) << LAT_SUB_BITS)) return static_cast<int>(value);
+    int msb = 63 - __builtin_clzll(value);
+    if (msb >= LAT_MAX_BITS) return LAT_NUM_BUCKETS - 1;
+    int shift = msb - LAT_SUB_BITS;
+    return ((shift + 1) << LAT_SUB_BITS) + static_cast<int>((value >> shift) & ((1 << LAT_SUB_BITS) - 1));
+}
+
+constexpr uint64_t latency_bucket_floor(int bucket) {
+    if (bucket < (1 << LAT_SUB_BITS)) return bucket;
+    int shift = (bucket >> LAT_SUB_BITS) - 1;
+    uint64_t mantissa = (uint64_t(1) << LAT_SUB_BITS) | (bucket & ((1 << LAT_SUB_BITS) - 1));
+    return mantissa << shift;
+}
+
+#ifdef MALLOC_LATENCY
+
+// Only the outermost public call of a thread is recorded; nested smalloc/sfree
+// calls from scalloc/srealloc contribute their split/merge depth to it.
+struct LatencyProbe {
+    LatencyProbe();
+    ~LatencyProbe();
+    void finish(LatencyOp op);
+    bool outermost;
+    uint64_t start;
+};
+
+void latency_note_depth();
+void latency_note_path(int slot);
+
+#define LATENCY_BEGIN() LatencyProbe latency_probe_
+#define LATENCY_END(op) latency_probe_.finish(op)
+#define LATENCY_DEPTH() latency_note_depth()
+#define LATENCY_PATH(slot) latency_note_path(slot)
+
+#else
+
+#define LATENCY_BEGIN() do { } while (0)
+#define LATENCY_END(op) do { } while (0)
+#define LATENCY_DEPTH() do { } while (0)
+#define LATENCY_PATH(slot) do { } while (0)
+
+#endif
+
+#endif /* MALLOC_LATENCY_H */
@@ -0,0 +1,385 @@
+#include <unistd.h>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <sys/mman.h>
+
+#include "malloc_engine.h"
+#include "smalloc_ext.h"
+
+MALLOC_ENGINE_BEGIN
+
+// Non-blocking buddy engine, after the NBBS design (Marotta et al.). Memory
+// comes in 4 MB superchunks, each a forest of 32 buddy trees of 128 KB. Every
+// tree node is one atomic byte saying whether the node itself is allocated
+// and whether anything below its left and right halves is; smalloc and sfree
+// only ever CAS those bytes, so there is no lock anywhere and threads working
+// in different trees never touch the same cache line.
+//
+// Blocks carry no header. The order of each allocation is kept per leaf in
+// the superchunk descriptor, next to its trees, and the descriptor sits right
+// after its superchunk, so a pointer finds it by masking. Requests above
+// 128 KB are mapped on their own behind a small header, as in malloc_3.
+
+constexpr int MAX_ORDER = 10;
+constexpr size_t MIN_BLOCK = 128;
+constexpr size_t MAX_BLOCK = MIN_BLOCK << MAX_ORDER;
+constexpr size_t CHUNK_SIZE = 4 * 1024 * 1024;
+constexpr int ROOTS_PER_CHUNK = CHUNK_SIZE / MAX_BLOCK;
+constexpr unsigned TREE_NODES = 2u << MAX_ORDER;   // heap order, node 1 is the root
+constexpr int MAX_CHUNKS = 256;
+constexpr size_t MAX_ALLOCATION_SIZE = 100000000;
+
+// Node state. OCC marks the allocated node itself; its ancestors get the
+// OCC bit of the side it is on. A free sets the COAL bit of its side on the
+// way up first, and only clears OCC bits where that COAL bit survived, so a
+// concurrent allocation that re-marks a half is never undone.
+constexpr uint8_t OCC_RIGHT = 0x1;
+constexpr uint8_t OCC_LEFT = 0x2;
+constexpr uint8_t COAL_RIGHT = 0x4;
+constexpr uint8_t COAL_LEFT = 0x8;
+constexpr uint8_t OCC = 0x10;
+constexpr uint8_t BUSY = OCC | OCC_LEFT | OCC_RIGHT;
+
+using Tree = std::atomic<uint8_t>[TREE_NODES];
+
+struct Chunk {
+    char *base;
+    Tree trees[ROOTS_PER_CHUNK];
+    uint8_t order_of[CHUNK_SIZE / MIN_BLOCK];   // by first leaf of each allocation
+};
+
+struct LargeHeader {
+    size_t size;
+    size_t pad;   // keeps the payload 16-byte aligned
+};
+
+// Buddy blocks start on a MIN_BLOCK boundary and mapped payloads never do.
+static_assert(sizeof(LargeHeader) % MIN_BLOCK != 0, "a mapped block must be told apart by its address");
+
+constexpr size_t DESCRIPTOR_SIZE = (sizeof(Chunk) + 4095) & ~size_t(4095);
+
+std::atomic<Chunk *> chunks[MAX_CHUNKS];
+std::atomic<int> chunk_count{0};
+
+std::atomic<size_t> large_blocks{0};
+std::atomic<size_t> large_bytes{0};
+std::atomic<size_t> mmap_calls{0};
+std::atomic<size_t> munmap_calls{0};
+
+std::atomic<unsigned> next_thread{0};
+
+// Threads start their search in different trees.
+thread_local unsigned root_hint = next_thread.fetch_add(1, std::memory_order_relaxed) * 7;
+
+constexpr size_t size_of_block(int order) {
+    return MIN_BLOCK << order;
+}
+
+int order_for(size_t size) {
+    int order = 0;
+    while (size > size_of_block(order)) order++;
+    return order;
+}
+
+int depth_of(unsigned node) {
+    return 31 - __builtin_clz(node);
+}
+
+uint8_t occ_bit(unsigned child) {
+    return child & 1 ? OCC_RIGHT : OCC_LEFT;
+}
+
+uint8_t coal_bit(unsigned child) {
+    return child & 1 ? COAL_RIGHT : COAL_LEFT;
+}
+
+// Clears the OCC bits the free of node left behind, from its parent up to
+// depth upper, stopping at the first ancestor whose other half is in use or
+// that an allocation has re-marked meanwhile.
+void unmark(Tree &tree, unsigned node, int upper) {
+    unsigned current = node;
+    uint8_t value;
+    unsigned child;
+    do {
+        child = current;
+        current >>= 1;
+        uint8_t old_value = tree[current].load(std::memory_order_relaxed);
+        do {
+            if (!(old_value & coal_bit(child))) return;
+            value = old_value & ~(occ_bit(child) | coal_bit(child));
+        } while (!tree[current].compare_exchange_weak(old_value, value, std::memory_order_acq_rel));
+    } while (depth_of(current) > upper && !(value & occ_bit(child ^ 1)));
+}
+
+// Frees node, whose ancestors are marked up to depth upper. The COAL bits go
+// up past a buddy that is being freed too: whichever of the two clears its
+// half last goes on unmarking above, and needs them there.
+void free_node(Tree &tree, unsigned node, int upper) {
+    unsigned runner = node;
+    while (depth_of(runner) > upper) {
+        unsigned current = runner >> 1;
+        uint8_t old_value = tree[current].fetch_or(coal_bit(runner), std::memory_order_acq_rel);
+        if ((old_value & occ_bit(runner ^ 1)) && !(old_value & coal_bit(runner ^ 1))) break;
+        runner = current;
+    }
+    tree[node].store(0, std::memory_order_release);
+    if (depth_of(node) > upper) unmark(tree, node, upper);
+}
+
+// Claims node and marks its ancestors. Returns 0 on success, otherwise the
+// node that was in the way: node itself, or an allocated ancestor.
+unsigned try_alloc(Tree &tree, unsigned node) {
+    uint8_t expected = 0;
+    if (!tree[node].compare_exchange_strong(expected, BUSY, std::memory_order_acq_rel)) return node;
+
+    unsigned current = node;
+    while (current > 1) {
+        unsigned child = current;
+        current >>= 1;
+        uint8_t old_value = tree[current].load(std::memory_order_relaxed);
+        uint8_t value;
+        do {
+            if (old_value & OCC) {
+                free_node(tree, node, depth_of(child));
+                return current;
+            }
+            value = (old_value & ~coal_bit(child)) | occ_bit(child);
+        } while (!tree[current].compare_exchange_weak(old_value, value, std::memory_order_acq_rel));
+    }
+    return 0;
+}
+
+// Finds and claims a free node of the given depth. Returns 0 if none is.
+unsigned alloc_in_tree(Tree &tree, int depth) {
+    unsigned end = 2u << depth;
+    for (unsigned node = 1u << depth; node < end;) {
+        if (tree[node].load(std::memory_order_relaxed) != 0) {
+            node++;
+            continue;
+        }
+        unsigned blocker = try_alloc(tree, node);
+        if (blocker == 0) return node;
+        // Skip everything below an allocated ancestor.
+        node = blocker == node ? node + 1 : (blocker + 1) << (depth - depth_of(blocker));
+    }
+    return 0;
+}
+
+Chunk *map_chunk() {
+    // Map twice the size and cut it down to an aligned superchunk followed by
+    // its descriptor.
+    constexpr size_t length = 2 * CHUNK_SIZE + DESCRIPTOR_SIZE;
+    void *raw = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) return nullptr;
+    char *start = static_cast<char *>(raw);
+    char *base = reinterpret_cast<char *>((reinterpret_cast<uintptr_t>(start) + CHUNK_SIZE - 1) & ~(CHUNK_SIZE - 1));
+    char *end = base + CHUNK_SIZE + DESCRIPTOR_SIZE;
+    if (base != start) munmap(start, base - start);
+    if (end != start + length) munmap(end, start + length - end);
+
+    // Fresh anonymous pages are zero, which is every node free.
+    auto *chunk = reinterpret_cast<Chunk *>(base + CHUNK_SIZE);
+    chunk->base = base;
+    return chunk;
+}
+
+// Publishes a new superchunk in slot count, or helps whoever got there first.
+bool add_chunk(int count) {
+    if (count == MAX_CHUNKS) return false;
+    if (chunks[count].load(std::memory_order_acquire) == nullptr) {
+        Chunk *chunk = map_chunk();
+        if (chunk == nullptr) return false;
+        Chunk *expected = nullptr;
+        if (!chunks[count].compare_exchange_strong(expected, chunk, std::memory_order_acq_rel)) {
+            munmap(chunk->base, CHUNK_SIZE + DESCRIPTOR_SIZE);
+        }
+    }
+    chunk_count.compare_exchange_strong(count, count + 1, std::memory_order_acq_rel);
+    return true;
+}
+
+void *allocate_block(int order) {
+    int depth = MAX_ORDER - order;
+    for (;;) {
+        int count = chunk_count.load(std::memory_order_acquire);
+        unsigned roots = count * ROOTS_PER_CHUNK;
+        for (unsigned i = 0; i < roots; i++) {
+            unsigned root = (root_hint + i) % roots;
+            Chunk *chunk = chunks[root / ROOTS_PER_CHUNK].load(std::memory_order_acquire);
+            Tree &tree = chunk->trees[root % ROOTS_PER_CHUNK];
+            if (tree[1].load(std::memory_order_relaxed) & OCC) continue;
+            unsigned node = alloc_in_tree(tree, depth);
+            if (node == 0) continue;
+
+            root_hint = root;
+            size_t offset = (root % ROOTS_PER_CHUNK) * MAX_BLOCK + (node - (1u << depth)) * size_of_block(order);
+            chunk->order_of[offset / MIN_BLOCK] = static_cast<uint8_t>(order);
+            return chunk->base + offset;
+        }
+        if (!add_chunk(count)) return nullptr;
+    }
+}
+
+void *allocate_large_block(size_t size) {
+    size_t length = sizeof(LargeHeader) + size;
+    void *mapping = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) return nullptr;
+    mmap_calls.fetch_add(1, std::memory_order_relaxed);
+    large_blocks.fetch_add(1, std::memory_order_relaxed);
+    large_bytes.fetch_add(size, std::memory_order_relaxed);
+    auto *header = static_cast<LargeHeader *>(mapping);
+    header->size = size;
+    return header + 1;
+}
+
+// The descriptor of the superchunk holding p, or nullptr for a mapped block.
+Chunk *chunk_of(void *p) {
+    auto address = reinterpret_cast<uintptr_t>(p);
+    if (address % MIN_BLOCK != 0) return nullptr;
+    return reinterpret_cast<Chunk *>((address & ~(CHUNK_SIZE - 1)) + CHUNK_SIZE);
+}
+
+// Usable bytes of the block at p.
+size_t block_size(void *p) {
+    Chunk *chunk = chunk_of(p);
+    if (chunk == nullptr) return (static_cast<LargeHeader *>(p) - 1)->size;
+    size_t offset = static_cast<char *>(p) - chunk->base;
+    return size_of_block(chunk->order_of[offset / MIN_BLOCK]);
+}
+
+void *smalloc(size_t size) {
+    if (size == 0 || size > MAX_ALLOCATION_SIZE) return nullptr;
+    return size > MAX_BLOCK ? allocate_large_block(size) : allocate_block(order_for(size));
+}
+
+void *scalloc(size_t num, size_t size) {
+    if (size != 0 && num > MAX_ALLOCATION_SIZE / size) return nullptr;
+    void *block = smalloc(num * size);
+    if (block != nullptr) memset(block, 0, num * size);
+    return block;
+}
+
+void sfree(void *p) {
+    if (!p) return;
+    Chunk *chunk = chunk_of(p);
+    if (chunk == nullptr) {
+        auto *header = static_cast<LargeHeader *>(p) - 1;
+        large_blocks.fetch_sub(1, std::memory_order_relaxed);
+        large_bytes.fetch_sub(header->size, std::memory_order_relaxed);
+        munmap_calls.fetch_add(1, std::memory_order_relaxed);
+        munmap(header, sizeof(LargeHeader) + header->size);
+        return;
+    }
+
+    size_t offset = static_cast<char *>(p) - chunk->base;
+    int order = chunk->order_of[offset / MIN_BLOCK];
+    int depth = MAX_ORDER - order;
+    Tree &tree = chunk->trees[offset / MAX_BLOCK];
+    unsigned node = (1u << depth) + (offset % MAX_BLOCK) / size_of_block(order);
+    // Double frees are ignored, as far as they can be told apart.
+    if (!(tree[node].load(std::memory_order_acquire) & OCC)) return;
+    free_node(tree, node, 0);
+}
+
+void *srealloc(void *oldp, size_t size) {
+    if (size == 0 || size > MAX_ALLOCATION_SIZE) return nullptr;
+    if (!oldp) return smalloc(size);
+    size_t old_size = block_size(oldp);
+    if (size <= old_size) return oldp;
+
+    void *newp = smalloc(size);
+    if (newp == nullptr) return nullptr;
+    memmove(newp, oldp, old_size);
+    sfree(oldp);
+    return newp;
+}
+
+// The statistics walk the trees; they are a snapshot, exact only while no
+// other thread allocates or frees.
+struct TreeCounts {
+    size_t free_blocks[MAX_ORDER + 1] = {0};
+    size_t used_blocks[MAX_ORDER + 1] = {0};
+};
+
+void count_node(Tree &tree, unsigned node, TreeCounts &counts) {
+    uint8_t value = tree[node].load(std::memory_order_relaxed);
+    int order = MAX_ORDER - depth_of(node);
+    if (value == 0) {
+        counts.free_blocks[order]++;
+    } else if (value & OCC) {
+        counts.used_blocks[order]++;
+    } else if (order > 0) {
+        count_node(tree, 2 * node, counts);
+        count_node(tree, 2 * node + 1, counts);
+    }
+}
+
+TreeCounts count_blocks() {
+    TreeCounts counts;
+    int count = chunk_count.load(std::memory_order_acquire);
+    for (int i = 0; i < count; i++) {
+        for (Tree &tree : chunks[i].load(std::memory_order_acquire)->trees) count_node(tree, 1, counts);
+    }
+    return counts;
+}
+
+size_t _num_free_blocks() {
+    TreeCounts counts = count_blocks();
+    size_t blocks = 0;
+    for (size_t free_blocks : counts.free_blocks) blocks += free_blocks;
+    return blocks;
+}
+
+size_t _num_free_bytes() {
+    TreeCounts counts = count_blocks();
+    size_t bytes = 0;
+    for (int order = 0; order <= MAX_ORDER; order++) bytes += counts.free_blocks[order] * size_of_block(order);
+    return bytes;
+}
+
+size_t _num_allocated_blocks() {
+    TreeCounts counts = count_blocks();
+    size_t blocks = large_blocks.load(std::memory_order_relaxed);
+    for (int order = 0; order <= MAX_ORDER; order++) blocks += counts.free_blocks[order] + counts.used_blocks[order];
+    return blocks;
+}
+
+size_t _num_allocated_bytes() {
+    return chunk_count.load(std::memory_order_acquire) * CHUNK_SIZE + large_bytes.load(std::memory_order_relaxed);
+}
+
+// Buddy blocks have no header; their metadata is the superchunk descriptors.
+size_t _num_meta_data_bytes() {
+    return chunk_count.load(std::memory_order_acquire) * sizeof(Chunk) +
+           large_blocks.load(std::memory_order_relaxed) * sizeof(LargeHeader);
+}
+
+size_t _size_meta_data() { return 0; }
+
+// Fills what this engine tracks; requested/granted bytes and the purge and
+// cache counters stay zero.
+void smalloc_stats(heap_stats *stats) {
+    *stats = heap_stats{};
+    TreeCounts counts = count_blocks();
+    stats->num_orders = MAX_ORDER + 1;
+    for (int order = 0; order <= MAX_ORDER; order++) {
+        stats->block_size[order] = size_of_block(order);
+        stats->free_blocks[order] = counts.free_blocks[order];
+        stats->used_blocks[order] = counts.used_blocks[order];
+        stats->free_bytes += counts.free_blocks[order] * size_of_block(order);
+        if (counts.free_blocks[order] > 0) stats->largest_free_block = size_of_block(order);
+    }
+    if (stats->free_bytes > 0) {
+        stats->external_fragmentation = 1.0 - double(stats->largest_free_block) / stats->free_bytes;
+    }
+
+    stats->mmap_blocks = large_blocks.load(std::memory_order_relaxed);
+    stats->mmap_bytes = large_bytes.load(std::memory_order_relaxed) + stats->mmap_blocks * sizeof(LargeHeader);
+    stats->mmap_calls = mmap_calls.load(std::memory_order_relaxed) + chunk_count.load(std::memory_order_relaxed);
+    stats->munmap_calls = munmap_calls.load(std::memory_order_relaxed);
+    stats->heap_growths = chunk_count.load(std::memory_order_relaxed);
+    stats->heap_bytes = stats->heap_growths * CHUNK_SIZE;
+}
+
+MALLOC_ENGINE_END
@@ -0,0 +1,373 @@
+#include <unistd.h>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <sys/mman.h>
+
+#include "malloc_engine.h"
+#include "malloc_trace.h"
+
+MALLOC_ENGINE_BEGIN
+
+// Two-level segregated fit engine, after Masmano et al. Free blocks are kept
+// in size classes: the first level is the power of two of the size, the
+// second splits each power of two into SL_COUNT equal ranges. One bitmap says
+// which first-level classes have any free block, one per first level says
+// which of its ranges do, so smalloc finds a fitting class with two bit scans
+// and sfree coalesces with both physical neighbours through the headers.
+// Every call is O(1) apart from the syscalls that grow the pool.
+//
+// Sizes are rounded to 16 bytes only, so a 129-byte request takes 144 bytes
+// where the buddy engine takes 256. The search rounds the size up to the next
+// class boundary, so any block found fits without looking at it ("good fit").
+//
+// The pool grows with sbrk in steps of at least POOL_GROWTH. Each area ends
+// with a used, empty sentinel header so that walking to the next physical
+// block never leaves the area; an area that lands right after the previous
+// one takes over its sentinel and coalesces with the block below it. Requests
+// of 128 KB and above are mapped on their own, as in malloc_3.
+
+constexpr size_t MAX_ALLOCATION_SIZE = 100000000;
+constexpr size_t MMAP_THRESHOLD = 128 * 1024;
+constexpr size_t POOL_GROWTH = 256 * 1024;
+
+constexpr size_t ALIGN = 16;
+constexpr int SL_BITS = 4;
+constexpr int SL_COUNT = 1 << SL_BITS;
+// Below SMALL_BLOCK the second level alone has one exact class per ALIGN.
+constexpr int FL_SHIFT = SL_BITS + 4;
+constexpr size_t SMALL_BLOCK = size_t(1) << FL_SHIFT;
+constexpr int FL_COUNT = 48 - FL_SHIFT;
+
+static_assert(SMALL_BLOCK / SL_COUNT == ALIGN, "small classes must match the alignment");
+static_assert(FL_COUNT < 64, "the first-level bitmap is one word");
+
+// Low bits of BlockHeader::size; sizes are multiples of ALIGN.
+constexpr size_t BLOCK_FREE = 0x1;
+constexpr size_t BLOCK_MMAP = 0x2;
+constexpr size_t FLAG_MASK = ALIGN - 1;
+
+struct BlockHeader {
+    BlockHeader *prev_phys;    // physical neighbour below, nullptr at the start of an area
+    size_t size;               // usable bytes, flags in the low bits
+    // Only meaningful while the block is free, in its payload.
+    BlockHeader *next_free;
+    BlockHeader *prev_free;
+};
+
+constexpr size_t HEADER_SIZE = offsetof(BlockHeader, next_free);
+constexpr size_t MIN_BLOCK = sizeof(BlockHeader) - HEADER_SIZE;
+
+struct MemoryStats {
+    size_t num_free_bytes = 0;
+    size_t num_free_blocks = 0;
+    size_t num_allocated_blocks = 0;
+    size_t num_allocated_bytes = 0;
+};
+
+BlockHeader *free_lists[FL_COUNT][SL_COUNT] = {{nullptr}};
+uint64_t fl_bitmap = 0;
+uint32_t sl_bitmap[FL_COUNT] = {0};
+char *pool_end = nullptr;   // end of the last area, just past its sentinel
+MemoryStats memory_stats;
+
+size_t block_size(const BlockHeader *block) {
+    return block->size & ~FLAG_MASK;
+}
+
+bool is_free(const BlockHeader *block) {
+    return block->size & BLOCK_FREE;
+}
+
+void *payload(BlockHeader *block) {
+    return reinterpret_cast<char *>(block) + HEADER_SIZE;
+}
+
+BlockHeader *header_of(void *p) {
+    return reinterpret_cast<BlockHeader *>(static_cast<char *>(p) - HEADER_SIZE);
+}
+
+BlockHeader *next_phys(BlockHeader *block) {
+    return reinterpret_cast<BlockHeader *>(static_cast<char *>(payload(block)) + block_size(block));
+}
+
+size_t adjust_size(size_t size) {
+    size = (size + ALIGN - 1) & ~(ALIGN - 1);
+    return size < MIN_BLOCK ? MIN_BLOCK : size;
+}
+
+int highest_bit(size_t value) {
+    return 63 - __builtin_clzll(value);
+}
+
+// The class a free block of size bytes is filed under.
+void mapping_insert(size_t size, int &fl, int &sl) {
+    if (size < SMALL_BLOCK) {
+        fl = 0;
+        sl = static_cast<int>(size / ALIGN);
+        return;
+    }
+    int bit = highest_bit(size);
+    sl = static_cast<int>(size >> (bit - SL_BITS)) ^ SL_COUNT;
+    fl = bit - FL_SHIFT + 1;
+}
+
+// The first class whose every block holds size bytes.
+void mapping_search(size_t size, int &fl, int &sl) {
+    if (size >= SMALL_BLOCK) size += (size_t(1) << (highest_bit(size) - SL_BITS)) - 1;
+    mapping_insert(size, fl, sl);
+}
+
+void insert_free(BlockHeader *block) {
+    int fl, sl;
+    mapping_insert(block_size(block), fl, sl);
+    BlockHeader *head = free_lists[fl][sl];
+    block->next_free = head;
+    block->prev_free = nullptr;
+    if (head != nullptr) head->prev_free = block;
+    free_lists[fl][sl] = block;
+    fl_bitmap |= uint64_t(1) << fl;
+    sl_bitmap[fl] |= 1u << sl;
+}
+
+void remove_free(BlockHeader *block) {
+    int fl, sl;
+    mapping_insert(block_size(block), fl, sl);
+    if (block->prev_free == nullptr) {
+        free_lists[fl][sl] = block->next_free;
+    } else {
+        block->prev_free->next_free = block->next_free;
+    }
+    if (block->next_free != nullptr) block->next_free->prev_free = block->prev_free;
+    if (free_lists[fl][sl] == nullptr) {
+        sl_bitmap[fl] &= ~(1u << sl);
+        if (sl_bitmap[fl] == 0) fl_bitmap &= ~(uint64_t(1) << fl);
+    }
+}
+
+// A free block of at least size bytes, or nullptr.
+BlockHeader *find_free(size_t size) {
+    int fl, sl;
+    mapping_search(size, fl, sl);
+    if (fl >= FL_COUNT) return nullptr;
+    uint32_t sl_map = sl_bitmap[fl] & (~0u << sl);
+    if (sl_map == 0) {
+        uint64_t fl_map = fl_bitmap & (~uint64_t(0) << (fl + 1));
+        if (fl_map == 0) return nullptr;
+        fl = __builtin_ctzll(fl_map);
+        sl_map = sl_bitmap[fl];
+    }
+    return free_lists[fl][__builtin_ctz(sl_map)];
+}
+
+// Absorbs the free block physically after block into it. The caller has
+// already taken that block out of its free list.
+void absorb_next(BlockHeader *block) {
+    BlockHeader *next = next_phys(block);
+    block->size += HEADER_SIZE + block_size(next);
+    next_phys(block)->prev_phys = block;
+    memory_stats.num_allocated_blocks--;
+    memory_stats.num_allocated_bytes += HEADER_SIZE;
+}
+
+// Frees a pool block, merging it with free neighbours on both sides. The
+// flag is set first so that a header left inside a merged block still reads
+// as free, and a second sfree of it is ignored.
+void release(BlockHeader *block) {
+    block->size |= BLOCK_FREE;
+    BlockHeader *next = next_phys(block);
+    if (is_free(next)) {
+        remove_free(next);
+        memory_stats.num_free_blocks--;
+        memory_stats.num_free_bytes -= block_size(next);
+        absorb_next(block);
+    }
+    BlockHeader *prev = block->prev_phys;
+    if (prev != nullptr && is_free(prev)) {
+        remove_free(prev);
+        memory_stats.num_free_blocks--;
+        memory_stats.num_free_bytes -= block_size(prev);
+        absorb_next(prev);
+        block = prev;
+    }
+    insert_free(block);
+    memory_stats.num_free_blocks++;
+    memory_stats.num_free_bytes += block_size(block);
+}
+
+// Cuts block down to size bytes when the rest can stand as a block of its
+// own, and frees the rest.
+void split_block(BlockHeader *block, size_t size) {
+    size_t rest = block_size(block) - size;
+    if (rest < HEADER_SIZE + MIN_BLOCK) return;
+
+    block->size -= rest;
+    auto *tail = next_phys(block);
+    tail->prev_phys = block;
+    tail->size = rest - HEADER_SIZE;
+    next_phys(tail)->prev_phys = tail;
+    memory_stats.num_allocated_blocks++;
+    memory_stats.num_allocated_bytes -= HEADER_SIZE;
+    release(tail);
+}
+
+// Adds an area of at least size usable bytes to the pool, as a free block.
+bool grow_pool(size_t size) {
+    size_t length = (size + 2 * HEADER_SIZE + POOL_GROWTH - 1) / POOL_GROWTH * POOL_GROWTH;
+    char *brk = static_cast<char *>(sbrk(0));
+    bool contiguous = brk == pool_end;
+    size_t pad = contiguous ? 0 : (ALIGN - reinterpret_cast<uintptr_t>(brk) % ALIGN) % ALIGN;
+    if (sbrk(pad + length) == reinterpret_cast<void *>(-1)) return false;
+
+    BlockHeader *block;
+    if (contiguous) {
+        // The old sentinel becomes the header of the new block.
+        block = reinterpret_cast<BlockHeader *>(pool_end - HEADER_SIZE);
+        block->size = length - HEADER_SIZE;
+    } else {
+        block = reinterpret_cast<BlockHeader *>(brk + pad);
+        block->prev_phys = nullptr;
+        block->size = length - 2 * HEADER_SIZE;
+    }
+    pool_end = brk + pad + length;
+
+    BlockHeader *sentinel = next_phys(block);
+    sentinel->prev_phys = block;
+    sentinel->size = 0;
+
+    memory_stats.num_allocated_blocks++;
+    memory_stats.num_allocated_bytes += block_size(block);
+    release(block);
+    return true;
+}
+
+void *allocate_small(size_t size) {
+    size = adjust_size(size);
+    BlockHeader *block = find_free(size);
+    if (block == nullptr) {
+        if (!grow_pool(size)) return nullptr;
+        block = find_free(size);
+    }
+
+    remove_free(block);
+    block->size &= ~BLOCK_FREE;
+    memory_stats.num_free_blocks--;
+    memory_stats.num_free_bytes -= block_size(block);
+    split_block(block, size);
+    return payload(block);
+}
+
+void *allocate_large(size_t size) {
+    size = adjust_size(size);
+    void *ptr = mmap(nullptr, HEADER_SIZE + size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) return nullptr;
+
+    auto *block = static_cast<BlockHeader *>(ptr);
+    block->prev_phys = nullptr;
+    block->size = size | BLOCK_MMAP;
+    memory_stats.num_allocated_blocks++;
+    memory_stats.num_allocated_bytes += size;
+    return payload(block);
+}
+
+void *smalloc(size_t size) {
+    TRACE_SCOPE();
+    if (size == 0 || size > MAX_ALLOCATION_SIZE) return nullptr;
+    void *ptr = size >= MMAP_THRESHOLD ? allocate_large(size) : allocate_small(size);
+    if (ptr != nullptr) TRACE_EVENT(TRACE_MALLOC, size, nullptr, ptr);
+    return ptr;
+}
+
+void *scalloc(size_t num, size_t size) {
+    if (size != 0 && num > MAX_ALLOCATION_SIZE / size) return nullptr;
+    TRACE_SCOPE();
+    size_t mem_size = num * size;
+    void *ptr = smalloc(mem_size);
+    if (ptr != nullptr) {
+        std::memset(ptr, 0, mem_size);
+        TRACE_EVENT(TRACE_CALLOC, mem_size, nullptr, ptr);
+    }
+    return ptr;
+}
+
+void sfree(void *p) {
+    if (p == nullptr) return;
+    TRACE_SCOPE();
+    TRACE_EVENT(TRACE_FREE, 0, p, nullptr);
+
+    BlockHeader *block = header_of(p);
+    if (is_free(block)) return;
+    if (block->size & BLOCK_MMAP) {
+        memory_stats.num_allocated_blocks--;
+        memory_stats.num_allocated_bytes -= block_size(block);
+        munmap(block, HEADER_SIZE + block_size(block));
+        return;
+    }
+    release(block);
+}
+
+void *reallocate(void *oldp, size_t size) {
+    if (size == 0 || size > MAX_ALLOCATION_SIZE) return nullptr;
+    if (oldp == nullptr) return smalloc(size);
+
+    BlockHeader *block = header_of(oldp);
+    bool pooled = !(block->size & BLOCK_MMAP);
+    if (size <= block_size(block)) {
+        if (pooled) split_block(block, adjust_size(size));
+        return oldp;
+    }
+
+    // Grow into a free block above before moving.
+    if (pooled && size < MMAP_THRESHOLD) {
+        size_t needed = adjust_size(size);
+        BlockHeader *next = next_phys(block);
+        if (is_free(next) && block_size(block) + HEADER_SIZE + block_size(next) >= needed) {
+            remove_free(next);
+            memory_stats.num_free_blocks--;
+            memory_stats.num_free_bytes -= block_size(next);
+            absorb_next(block);
+            split_block(block, needed);
+            return oldp;
+        }
+    }
+
+    void *newp = smalloc(size);
+    if (newp != nullptr) {
+        std::memcpy(newp, oldp, block_size(block));
+        sfree(oldp);
+    }
+    return newp;
+}
+
+void *srealloc(void *oldp, size_t size) {
+    TRACE_SCOPE();
+    void *newp = reallocate(oldp, size);
+    TRACE_EVENT(TRACE_REALLOC, size, oldp, newp);
+    return newp;
+}
+
+size_t _num_free_blocks() {
+    return memory_stats.num_free_blocks;
+}
+
+size_t _num_free_bytes() {
+    return memory_stats.num_free_bytes;
+}
+
+size_t _num_allocated_blocks() {
+    return memory_stats.num_allocated_blocks;
+}
+
+size_t _num_allocated_bytes() {
+    return memory_stats.num_allocated_bytes;
+}
+
+size_t _num_meta_data_bytes() {
+    return HEADER_SIZE * memory_stats.num_allocated_blocks;
+}
+
+size_t _size_meta_data() {
+    return HEADER_SIZE;
+}
+
+MALLOC_ENGINE_END
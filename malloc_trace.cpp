@@ -0,0 +1,340 @@
+#include "malloc_trace.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <utility>
+
+// The recorder must not allocate through the engine it is tracing, so every
+// table here lives in its own anonymous mapping.
+
+constexpr size_t TRACE_BUFFER_SIZE = 64 * 1024;
+constexpr size_t MAX_EVENT_SIZE = 1 + 5 * 10;
+constexpr size_t INITIAL_TABLE_SIZE = 1 << 8;
+constexpr size_t INITIAL_FREE_IDS = 1 << 10;
+constexpr int STRIPE_BITS = 6;
+constexpr size_t NUM_STRIPES = size_t(1) << STRIPE_BITS;
+
+// A thread records into its own buffer under its own lock, which only a flush
+// from another thread ever contends for. Ids it frees go on its own free
+// list and come back out in its later allocations, so an id is never live
+// twice; ids still on the list when the thread exits are dropped with it and
+// only leave holes in the id range.
+struct ThreadBuffer {
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    uint8_t data[TRACE_BUFFER_SIZE];
+    size_t len = 0;
+    uint32_t thread = 0;
+    uint64_t base_ns = 0;
+    uint64_t last_ns = 0;
+    bool registered = false;
+    ThreadBuffer *next = nullptr;
+    ThreadBuffer *prev = nullptr;
+
+    uint32_t *free_ids = nullptr;
+    size_t free_ids_capacity = 0;
+    size_t num_free_ids = 0;
+
+    ~ThreadBuffer();
+};
+
+struct PointerSlot {
+    uintptr_t ptr;
+    uint32_t id;
+};
+
+// One stripe of the pointer -> id table. A pointer's hash picks its stripe,
+// so threads working on different blocks rarely share a lock.
+struct alignas(64) PointerTable {
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    PointerSlot *slots = nullptr;
+    size_t capacity = 0;
+    size_t used = 0;
+};
+
+// The global lock only guards the list of buffers and the output file; the
+// recording path never takes it past a thread's first event.
+struct TraceState {
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    std::atomic<int> fd{-1};
+    std::atomic<bool> env_checked{false};
+
+    PointerTable stripes[NUM_STRIPES];
+    std::atomic<uint32_t> next_id{1};
+
+    uint32_t next_thread = 1;
+    ThreadBuffer *buffers = nullptr;
+};
+
+TraceState trace_state;
+thread_local int trace_depth = 0;
+
+void *trace_map(size_t bytes) {
+    void *ptr = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return ptr == MAP_FAILED ? nullptr : ptr;
+}
+
+uint64_t trace_now_ns() {
+    timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+uint64_t hash_of(uintptr_t ptr) {
+    // Allocations are at least 8-byte aligned, drop the always-zero bits first.
+    return (ptr >> 3) * 0x9E3779B97F4A7C15ull;
+}
+
+// The top bits pick the stripe, the middle ones the slot in it.
+PointerTable &stripe_of(void *ptr) {
+    return trace_state.stripes[hash_of(reinterpret_cast<uintptr_t>(ptr)) >> (64 - STRIPE_BITS)];
+}
+
+size_t slot_of(uintptr_t ptr, size_t capacity) {
+    return static_cast<size_t>(hash_of(ptr) >> 32) & (capacity - 1);
+}
+
+bool table_grow(PointerTable &table) {
+    size_t new_capacity = table.capacity ? table.capacity * 2 : INITIAL_TABLE_SIZE;
+    auto *new_slots = static_cast<PointerSlot *>(trace_map(new_capacity * sizeof(PointerSlot)));
+    if (!new_slots) return false;
+
+    for (size_t i = 0; i < table.capacity; i++) {
+        const PointerSlot &slot = table.slots[i];
+        if (!slot.ptr) continue;
+        size_t j = slot_of(slot.ptr, new_capacity);
+        while (new_slots[j].ptr) j = (j + 1) & (new_capacity - 1);
+        new_slots[j] = slot;
+    }
+    if (table.slots) munmap(table.slots, table.capacity * sizeof(PointerSlot));
+    table.slots = new_slots;
+    table.capacity = new_capacity;
+    return true;
+}
+
+// The table calls run with the stripe's lock held.
+uint32_t id_acquire(PointerTable &table, ThreadBuffer &buffer, void *ptr) {
+    if (!ptr) return 0;
+    if (table.used * 2 >= table.capacity && !table_grow(table)) return 0;
+
+    uint32_t id;
+    if (buffer.num_free_ids > 0) {
+        id = buffer.free_ids[--buffer.num_free_ids];
+    } else {
+        id = trace_state.next_id.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    auto key = reinterpret_cast<uintptr_t>(ptr);
+    size_t i = slot_of(key, table.capacity);
+    while (table.slots[i].ptr && table.slots[i].ptr != key) i = (i + 1) & (table.capacity - 1);
+    if (!table.slots[i].ptr) table.used++;
+    table.slots[i] = {key, id};
+    return id;
+}
+
+uint32_t id_lookup(PointerTable &table, void *ptr) {
+    if (!ptr || table.capacity == 0) return 0;
+
+    auto key = reinterpret_cast<uintptr_t>(ptr);
+    size_t i = slot_of(key, table.capacity);
+    while (table.slots[i].ptr && table.slots[i].ptr != key) i = (i + 1) & (table.capacity - 1);
+    return table.slots[i].id;
+}
+
+// Linear probing with backward-shift deletion, so the table never fills up
+// with tombstones on long-running traces.
+uint32_t id_release(PointerTable &table, ThreadBuffer &buffer, void *ptr) {
+    if (!ptr || table.capacity == 0) return 0;
+
+    auto key = reinterpret_cast<uintptr_t>(ptr);
+    size_t mask = table.capacity - 1;
+    size_t i = slot_of(key, table.capacity);
+    while (table.slots[i].ptr && table.slots[i].ptr != key) i = (i + 1) & mask;
+    if (!table.slots[i].ptr) return 0;
+
+    uint32_t id = table.slots[i].id;
+    for (size_t j = (i + 1) & mask; table.slots[j].ptr; j = (j + 1) & mask) {
+        size_t home = slot_of(table.slots[j].ptr, table.capacity);
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            table.slots[i] = table.slots[j];
+            i = j;
+        }
+    }
+    table.slots[i] = {0, 0};
+    table.used--;
+
+    if (buffer.num_free_ids == buffer.free_ids_capacity) {
+        size_t new_capacity = buffer.free_ids_capacity ? buffer.free_ids_capacity * 2 : INITIAL_FREE_IDS;
+        auto *new_ids = static_cast<uint32_t *>(trace_map(new_capacity * sizeof(uint32_t)));
+        if (!new_ids) return id;
+        if (buffer.free_ids) {
+            memcpy(new_ids, buffer.free_ids, buffer.num_free_ids * sizeof(uint32_t));
+            munmap(buffer.free_ids, buffer.free_ids_capacity * sizeof(uint32_t));
+        }
+        buffer.free_ids = new_ids;
+        buffer.free_ids_capacity = new_capacity;
+    }
+    buffer.free_ids[buffer.num_free_ids++] = id;
+    return id;
+}
+
+// Runs with the buffer's lock held.
+void buffer_flush(ThreadBuffer &buffer) {
+    int fd = trace_state.fd.load(std::memory_order_relaxed);
+    if (buffer.len == 0 || fd < 0) {
+        buffer.len = 0;
+        return;
+    }
+
+    uint8_t header[1 + 3 * 10];
+    uint8_t *end = header;
+    *end++ = TRACE_CHUNK;
+    end = trace_put_varint(end, buffer.thread);
+    end = trace_put_varint(end, buffer.base_ns);
+    end = trace_put_varint(end, buffer.len);
+
+    // O_APPEND plus a single writev keeps chunks from different threads whole.
+    iovec iov[2] = {{header, static_cast<size_t>(end - header)}, {buffer.data, buffer.len}};
+    ssize_t ignored = writev(fd, iov, 2);
+    (void)ignored;
+    buffer.len = 0;
+}
+
+// Flushes every registered buffer; runs with the global lock held.
+void flush_all() {
+    for (ThreadBuffer *iter = trace_state.buffers; iter != nullptr; iter = iter->next) {
+        pthread_mutex_lock(&iter->lock);
+        buffer_flush(*iter);
+        pthread_mutex_unlock(&iter->lock);
+    }
+}
+
+ThreadBuffer::~ThreadBuffer() {
+    pthread_mutex_lock(&trace_state.lock);
+    pthread_mutex_lock(&lock);
+    buffer_flush(*this);
+    pthread_mutex_unlock(&lock);
+    if (registered) {
+        if (prev) prev->next = next;
+        else trace_state.buffers = next;
+        if (next) next->prev = prev;
+    }
+    pthread_mutex_unlock(&trace_state.lock);
+    if (free_ids) munmap(free_ids, free_ids_capacity * sizeof(uint32_t));
+}
+
+ThreadBuffer &thread_buffer() {
+    static thread_local ThreadBuffer buffer;
+    return buffer;
+}
+
+int smalloc_trace_start(const char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) return -1;
+
+    uint8_t header[sizeof(TRACE_MAGIC) + 1];
+    memcpy(header, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    header[sizeof(TRACE_MAGIC)] = TRACE_VERSION;
+    if (write(fd, header, sizeof(header)) != static_cast<ssize_t>(sizeof(header))) {
+        close(fd);
+        return -1;
+    }
+
+    pthread_mutex_lock(&trace_state.lock);
+    flush_all();
+    trace_state.env_checked.store(true, std::memory_order_relaxed);
+    int old_fd = trace_state.fd.exchange(fd);
+    pthread_mutex_unlock(&trace_state.lock);
+    if (old_fd >= 0) close(old_fd);
+    return 0;
+}
+
+void smalloc_trace_flush() {
+    pthread_mutex_lock(&trace_state.lock);
+    flush_all();
+    pthread_mutex_unlock(&trace_state.lock);
+}
+
+void smalloc_trace_stop() {
+    smalloc_trace_flush();
+    int fd = trace_state.fd.exchange(-1);
+    if (fd >= 0) close(fd);
+}
+
+TraceScope::TraceScope() : outermost(trace_depth++ == 0) {}
+
+TraceScope::~TraceScope() { trace_depth--; }
+
+void trace_record(const TraceScope &scope, TraceOp op, size_t size, void *oldp, void *newp) {
+    if (!scope.outermost) return;
+    if (!trace_state.env_checked.load(std::memory_order_relaxed)) {
+        trace_state.env_checked.store(true, std::memory_order_relaxed);
+        const char *path = getenv("SMALLOC_TRACE");
+        if (path && *path) smalloc_trace_start(path);
+    }
+    if (trace_state.fd.load(std::memory_order_relaxed) < 0) return;
+
+    ThreadBuffer &buffer = thread_buffer();
+    if (!buffer.registered) {
+        pthread_mutex_lock(&trace_state.lock);
+        buffer.thread = trace_state.next_thread++;
+        buffer.next = trace_state.buffers;
+        if (buffer.next) buffer.next->prev = &buffer;
+        trace_state.buffers = &buffer;
+        buffer.registered = true;
+        pthread_mutex_unlock(&trace_state.lock);
+    }
+
+    // The stripes of the pointers involved, locked in address order. The
+    // timestamp is taken under them, so the events of one pointer are
+    // ordered by time the way they happened, whichever threads they are on.
+    PointerTable *first = op == TRACE_FREE ? &stripe_of(oldp) : &stripe_of(newp);
+    PointerTable *second = op == TRACE_REALLOC ? &stripe_of(oldp) : first;
+    if (second < first) std::swap(first, second);
+    pthread_mutex_lock(&first->lock);
+    if (second != first) pthread_mutex_lock(&second->lock);
+
+    uint32_t id = 0, new_id = 0;
+    switch (op) {
+        case TRACE_MALLOC:
+        case TRACE_CALLOC:
+            id = id_acquire(stripe_of(newp), buffer, newp);
+            break;
+        case TRACE_FREE:
+            id = id_release(stripe_of(oldp), buffer, oldp);
+            break;
+        case TRACE_REALLOC:
+            if (newp) {
+                id = id_release(stripe_of(oldp), buffer, oldp);
+                new_id = id_acquire(stripe_of(newp), buffer, newp);
+            } else {
+                // A failed srealloc leaves the old block live under its old id.
+                id = id_lookup(stripe_of(oldp), oldp);
+            }
+            break;
+    }
+    uint64_t now = trace_now_ns();
+
+    if (second != first) pthread_mutex_unlock(&second->lock);
+    pthread_mutex_unlock(&first->lock);
+
+    pthread_mutex_lock(&buffer.lock);
+    if (buffer.len + MAX_EVENT_SIZE > TRACE_BUFFER_SIZE) buffer_flush(buffer);
+    if (buffer.len == 0) buffer.base_ns = buffer.last_ns = now;
+
+    uint8_t *out = buffer.data + buffer.len;
+    *out++ = op;
+    out = trace_put_varint(out, now - buffer.last_ns);
+    if (op != TRACE_FREE) out = trace_put_varint(out, size);
+    out = trace_put_varint(out, id);
+    if (op == TRACE_REALLOC) out = trace_put_varint(out, new_id);
+    buffer.len = out - buffer.data;
+    buffer.last_ns = now;
+    pthread_mutex_unlock(&buffer.lock);
+}
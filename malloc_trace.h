@@ -0,0 +1,118 @@
+#ifndef MALLOC_TRACE_H
+#define MALLOC_TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Binary allocation trace format.
+//
+// A trace file starts with TRACE_MAGIC followed by a sequence of chunks. Each
+// chunk is one flush of a single thread's buffer:
+//
+//   'C' varint(thread) varint(base_ns) varint(payload_len) payload
+//
+// The payload is a run of events. Every event is an op byte followed by
+// varint fields; timestamps are deltas against the previous event of the same
+// thread (the first one against base_ns):
+//
+//   TRACE_MALLOC   dt size id
+//   TRACE_CALLOC   dt size id            (size is num * size)
+//   TRACE_REALLOC  dt size old_id new_id
+//   TRACE_FREE     dt id
+//
+// Pointer ids are small integers handed out by the recorder and recycled on
+// free, so a replayer can keep live pointers in a dense array. Id 0 stands for
+// nullptr and for pointers the recorder never saw.
+
+constexpr char TRACE_MAGIC[4] = {'S', 'M', 'T', 'R'};
+constexpr uint8_t TRACE_VERSION = 1;
+constexpr uint8_t TRACE_CHUNK = 'C';
+
+enum TraceOp : uint8_t {
+    TRACE_MALLOC = 1,
+    TRACE_CALLOC = 2,
+    TRACE_REALLOC = 3,
+    TRACE_FREE = 4,
+};
+
+struct TraceEvent {
+    uint8_t op = 0;
+    uint32_t thread = 0;
+    uint64_t time_ns = 0;
+    uint64_t size = 0;
+    uint32_t id = 0;
+    uint32_t new_id = 0;
+};
+
+inline uint8_t *trace_put_varint(uint8_t *out, uint64_t value) {
+    while (value >= 0x80) {
+        *out++ = static_cast<uint8_t>(value) | 0x80;
+        value >>= 7;
+    }
+    *out++ = static_cast<uint8_t>(value);
+    return out;
+}
+
+// Returns nullptr if the varint runs past end.
+inline const uint8_t *trace_get_varint(const uint8_t *in, const uint8_t *end, uint64_t *value) {
+    uint64_t result = 0;
+    for (int shift = 0; in < end && shift < 64; shift += 7) {
+        uint8_t byte = *in++;
+        result |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *value = result;
+            return in;
+        }
+    }
+    return nullptr;
+}
+
+// Decodes one event of a chunk payload. time_ns must hold the previous event's
+// timestamp and is advanced by the delta. Returns nullptr on a malformed event.
+inline const uint8_t *trace_decode_event(const uint8_t *in, const uint8_t *end, TraceEvent *event) {
+    if (in >= end) return nullptr;
+    event->op = *in++;
+
+    uint64_t dt = 0, size = 0, id = 0, new_id = 0;
+    if (!(in = trace_get_varint(in, end, &dt))) return nullptr;
+    if (event->op != TRACE_FREE && !(in = trace_get_varint(in, end, &size))) return nullptr;
+    if (!(in = trace_get_varint(in, end, &id))) return nullptr;
+    if (event->op == TRACE_REALLOC && !(in = trace_get_varint(in, end, &new_id))) return nullptr;
+    if (event->op < TRACE_MALLOC || event->op > TRACE_FREE) return nullptr;
+
+    event->time_ns += dt;
+    event->size = size;
+    event->id = static_cast<uint32_t>(id);
+    event->new_id = static_cast<uint32_t>(new_id);
+    return in;
+}
+
+// Recording API, available when the engine is built with MALLOC_TRACE. Setting
+// SMALLOC_TRACE=<path> in the environment starts recording on the first call.
+int smalloc_trace_start(const char *path);
+void smalloc_trace_stop();
+void smalloc_trace_flush();
+
+#ifdef MALLOC_TRACE
+
+// Only the outermost public call of a thread is recorded, so scalloc/srealloc
+// calling smalloc/sfree internally does not produce duplicate events.
+struct TraceScope {
+    TraceScope();
+    ~TraceScope();
+    bool outermost;
+};
+
+void trace_record(const TraceScope &scope, TraceOp op, size_t size, void *oldp, void *newp);
+
+#define TRACE_SCOPE() TraceScope trace_scope_
+#define TRACE_EVENT(op, size, oldp, newp) trace_record(trace_scope_, op, size, oldp, newp)
+
+#else
+
+#define TRACE_SCOPE() do { } while (0)
+#define TRACE_EVENT(op, size, oldp, newp) do { } while (0)
+
+#endif
+
+#endif /* MALLOC_TRACE_H */
@@ -0,0 +1,255 @@
+#include <new>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "buddy_heap.h"
+#include "sheap.h"
+
+// A heap_t is a BuddyHeap of one of the layouts in sheap.h, behind a table of
+// its operations, so each call is one indirect call into code compiled for
+// that layout. The heap object itself is mapped, not taken from an engine, or
+// for sheap_create_in() placed at the start of the caller's region.
+//
+// The heap names its table by index rather than by address, since a shared
+// heap is read by processes whose tables may sit elsewhere.
+
+template <class Lock>
+using DefaultHeap = BuddyHeap<7, 10, 32 * 131072, BuddyCountStats, Lock>;
+template <class Lock>
+using SmallHeap = BuddyHeap<5, 8, 256 * 1024, BuddyCountStats, Lock>;
+template <class Lock>
+using LargeHeap = BuddyHeap<12, 10, 64 * 1024 * 1024, BuddyCountStats, Lock>;
+
+// Shared mappings are aligned to the largest block of any layout, so that
+// every process agrees on which blocks are buddies.
+constexpr size_t SHARED_ALIGN = LargeHeap<BuddyNoLock>::MAX_BLOCK;
+static_assert(SHARED_ALIGN >= DefaultHeap<BuddyNoLock>::MAX_BLOCK && SHARED_ALIGN >= SmallHeap<BuddyNoLock>::MAX_BLOCK,
+              "shared mappings must align every layout's blocks");
+constexpr uint32_t SHARED_MAGIC = 0x53484150;   // "SHAP"
+
+struct SheapOps {
+    void *(*malloc)(heap_t *heap, size_t size);
+    void *(*calloc)(heap_t *heap, size_t num, size_t size);
+    void (*free)(heap_t *heap, void *p);
+    void *(*realloc)(heap_t *heap, void *oldp, size_t size);
+    void (*get_stats)(heap_t *heap, sheap_stats *stats);
+    void (*destroy)(heap_t *heap);
+};
+
+struct sheap {
+    unsigned char kind;   // index into KINDS, the same in every process
+    bool in_region;
+    bool shared;
+    uint32_t magic;       // SHARED_MAGIC once a shared heap is ready
+    size_t length;        // of a shared mapping
+};
+
+template <class Heap>
+struct SheapOf : sheap {
+    Heap heap;
+
+    SheapOf() = default;
+    SheapOf(void *base, size_t length) : heap(base, length) {}
+
+    static Heap &of(heap_t *h) { return static_cast<SheapOf *>(h)->heap; }
+
+    static void *malloc(heap_t *h, size_t size) { return of(h).allocate(size); }
+
+    static void *calloc(heap_t *h, size_t num, size_t size) { return of(h).allocate_zeroed(num, size); }
+
+    static void free(heap_t *h, void *p) { of(h).free(p); }
+
+    static void *realloc(heap_t *h, void *oldp, size_t size) { return of(h).reallocate(oldp, size); }
+
+    static void get_stats(heap_t *h, sheap_stats *stats) {
+        const BuddyCountStats &counts = of(h).stats();
+        stats->free_blocks = counts.free_blocks;
+        stats->free_bytes = counts.free_bytes;
+        stats->allocated_blocks = counts.allocated_blocks;
+        stats->allocated_bytes = counts.allocated_bytes;
+        stats->meta_data_bytes = counts.allocated_blocks * Heap::HEADER_SIZE;
+        stats->mapped_blocks = counts.mapped_blocks;
+        stats->chunks = counts.chunks;
+    }
+
+    static void destroy(heap_t *h) {
+        auto *self = static_cast<SheapOf *>(h);
+        bool in_region = self->in_region;
+        bool shared = self->shared;
+        size_t length = self->length;
+        // Cleared after any call under way, so nothing attaches to a heap
+        // being torn down.
+        if (shared && !of(h).run_locked([self] { __atomic_store_n(&self->magic, 0, __ATOMIC_RELEASE); })) {
+            __atomic_store_n(&self->magic, 0, __ATOMIC_RELEASE);
+        }
+        self->~SheapOf();
+        if (shared) {
+            munmap(self, length);
+        } else if (!in_region) {
+            munmap(self, sizeof(SheapOf));
+        }
+    }
+
+    static const SheapOps OPS;
+};
+
+template <class Heap>
+const SheapOps SheapOf<Heap>::OPS = {
+    SheapOf::malloc, SheapOf::calloc, SheapOf::free, SheapOf::realloc, SheapOf::get_stats, SheapOf::destroy,
+};
+
+// Every layout with every lock, in sheap_layout order.
+enum SheapLock { LOCK_NONE, LOCK_THREADS, LOCK_PROCESSES, NUM_LOCKS };
+
+const SheapOps *const KINDS[] = {
+    &SheapOf<DefaultHeap<BuddyNoLock>>::OPS, &SheapOf<DefaultHeap<BuddyMutexLock>>::OPS,
+    &SheapOf<DefaultHeap<BuddySharedMutexLock>>::OPS, &SheapOf<SmallHeap<BuddyNoLock>>::OPS,
+    &SheapOf<SmallHeap<BuddyMutexLock>>::OPS, &SheapOf<SmallHeap<BuddySharedMutexLock>>::OPS,
+    &SheapOf<LargeHeap<BuddyNoLock>>::OPS, &SheapOf<LargeHeap<BuddyMutexLock>>::OPS,
+    &SheapOf<LargeHeap<BuddySharedMutexLock>>::OPS,
+};
+constexpr unsigned NUM_KINDS = sizeof(KINDS) / sizeof(KINDS[0]);
+
+// A mapped heap without a region, else one placed in front of the blocks it
+// carves from [base, base + length).
+template <class Heap>
+heap_t *create(unsigned char kind, void *base, size_t length) {
+    SheapOf<Heap> *heap;
+    if (base == nullptr) {
+        void *raw = mmap(nullptr, sizeof(SheapOf<Heap>), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw == MAP_FAILED) return nullptr;
+        heap = new (raw) SheapOf<Heap>();
+    } else {
+        constexpr size_t align = alignof(SheapOf<Heap>);
+        auto begin = reinterpret_cast<uintptr_t>(base);
+        uintptr_t placed = (begin + align - 1) & ~(align - 1);
+        uintptr_t blocks = placed + sizeof(SheapOf<Heap>);
+        if (blocks - begin > length) return nullptr;
+        heap = new (reinterpret_cast<void *>(placed)) SheapOf<Heap>(reinterpret_cast<void *>(blocks),
+                                                                     length - (blocks - begin));
+    }
+    heap->kind = kind;
+    heap->in_region = base != nullptr;
+    heap->shared = false;
+    heap->magic = 0;
+    heap->length = 0;
+    return heap;
+}
+
+template <template <class> class Layout>
+heap_t *create(int layout, SheapLock lock, void *base, size_t length) {
+    auto kind = static_cast<unsigned char>(layout * NUM_LOCKS + lock);
+    switch (lock) {
+        case LOCK_THREADS:
+            return create<Layout<BuddyMutexLock>>(kind, base, length);
+        case LOCK_PROCESSES:
+            return create<Layout<BuddySharedMutexLock>>(kind, base, length);
+        default:
+            return create<Layout<BuddyNoLock>>(kind, base, length);
+    }
+}
+
+heap_t *create_heap(const sheap_config *config, SheapLock lock, void *base, size_t length) {
+    sheap_config chosen = config != nullptr ? *config : sheap_config{SHEAP_LAYOUT_DEFAULT, 0};
+    if (lock == LOCK_NONE && chosen.thread_safe) lock = LOCK_THREADS;
+    switch (chosen.layout) {
+        case SHEAP_LAYOUT_DEFAULT:
+            return create<DefaultHeap>(chosen.layout, lock, base, length);
+        case SHEAP_LAYOUT_SMALL:
+            return create<SmallHeap>(chosen.layout, lock, base, length);
+        case SHEAP_LAYOUT_LARGE:
+            return create<LargeHeap>(chosen.layout, lock, base, length);
+    }
+    return nullptr;
+}
+
+// Maps all of fd shared at an address aligned to SHARED_ALIGN.
+void *map_shared(int fd, size_t length) {
+    size_t pages = (length + BUDDY_PAGE_SIZE - 1) & ~(BUDDY_PAGE_SIZE - 1);
+    void *raw = mmap(nullptr, pages + SHARED_ALIGN, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (raw == MAP_FAILED) return nullptr;
+    char *start = static_cast<char *>(raw);
+    char *base = reinterpret_cast<char *>((reinterpret_cast<uintptr_t>(start) + SHARED_ALIGN - 1) & ~(SHARED_ALIGN - 1));
+    if (mmap(base, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(raw, pages + SHARED_ALIGN);
+        return nullptr;
+    }
+    if (base != start) munmap(start, base - start);
+    if (base != start + SHARED_ALIGN) munmap(base + pages, start + SHARED_ALIGN - base);
+    return base;
+}
+
+heap_t *sheap_create(const sheap_config *config) {
+    return create_heap(config, LOCK_NONE, nullptr, 0);
+}
+
+heap_t *sheap_create_in(void *base, size_t len, const sheap_config *config) {
+    if (base == nullptr) return nullptr;
+    return create_heap(config, LOCK_NONE, base, len);
+}
+
+heap_t *sheap_create_shared(int fd, size_t len, const sheap_config *config) {
+    if (len < sizeof(sheap) || ftruncate(fd, static_cast<off_t>(len)) != 0) return nullptr;
+    void *base = map_shared(fd, len);
+    if (base == nullptr) return nullptr;
+    heap_t *heap = create_heap(config, LOCK_PROCESSES, base, len);
+    if (heap == nullptr) {
+        munmap(base, len);
+        return nullptr;
+    }
+    heap->shared = true;
+    heap->length = len;
+    __atomic_store_n(&heap->magic, SHARED_MAGIC, __ATOMIC_RELEASE);
+    return heap;
+}
+
+heap_t *sheap_attach_shared(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(sheap)) return nullptr;
+    auto length = static_cast<size_t>(st.st_size);
+    auto *heap = static_cast<heap_t *>(map_shared(fd, length));
+    if (heap == nullptr) return nullptr;
+    if (__atomic_load_n(&heap->magic, __ATOMIC_ACQUIRE) != SHARED_MAGIC || heap->kind >= NUM_KINDS ||
+        heap->length != length) {
+        munmap(heap, length);
+        return nullptr;
+    }
+    return heap;
+}
+
+void sheap_detach_shared(heap_t *heap) {
+    if (heap != nullptr) munmap(heap, heap->length);
+}
+
+void sheap_destroy(heap_t *heap) {
+    if (heap != nullptr) KINDS[heap->kind]->destroy(heap);
+}
+
+void *sheap_malloc(heap_t *heap, size_t size) {
+    return KINDS[heap->kind]->malloc(heap, size);
+}
+
+void *sheap_calloc(heap_t *heap, size_t num, size_t size) {
+    return KINDS[heap->kind]->calloc(heap, num, size);
+}
+
+void sheap_free(heap_t *heap, void *p) {
+    KINDS[heap->kind]->free(heap, p);
+}
+
+void *sheap_realloc(heap_t *heap, void *oldp, size_t size) {
+    return KINDS[heap->kind]->realloc(heap, oldp, size);
+}
+
+void sheap_get_stats(heap_t *heap, sheap_stats *stats) {
+    KINDS[heap->kind]->get_stats(heap, stats);
+}
+
+size_t sheap_offset(heap_t *heap, const void *p) {
+    return reinterpret_cast<uintptr_t>(p) - reinterpret_cast<uintptr_t>(heap);
+}
+
+void *sheap_pointer(heap_t *heap, size_t offset) {
+    return reinterpret_cast<char *>(heap) + offset;
+}
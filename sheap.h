@@ -0,0 +1,88 @@
+#ifndef SHEAP_H
+#define SHEAP_H
+
+#include <stddef.h>
+
+// Independent buddy heaps (sheap.cpp over buddy_heap.h). Each heap has its
+// own chunks, free lists and counters, so a subsystem can keep its blocks
+// together and drop all of them at once with sheap_destroy(), without
+// freeing each one.
+
+typedef struct sheap heap_t;
+
+// Block sizes and chunk size are compile-time parameters of the engine, so a
+// heap picks one of these layouts.
+enum sheap_layout {
+    SHEAP_LAYOUT_DEFAULT,        // malloc_3's: 128 B to 128 KB blocks, 4 MB chunks
+    SHEAP_LAYOUT_SMALL,          // 32 B to 8 KB blocks, 256 KB chunks
+    SHEAP_LAYOUT_LARGE,          // 4 KB to 4 MB blocks, 64 MB chunks
+};
+
+struct sheap_config {
+    enum sheap_layout layout;
+    int thread_safe;             // nonzero: calls may come from several threads
+};
+
+struct sheap_stats {
+    size_t free_blocks;
+    size_t free_bytes;           // usable bytes, like _num_free_bytes()
+    size_t allocated_blocks;     // free and used
+    size_t allocated_bytes;
+    size_t meta_data_bytes;
+    size_t mapped_blocks;        // requests above the largest block
+    size_t chunks;
+};
+
+// A null config gives {SHEAP_LAYOUT_DEFAULT, 0}. Returns nullptr when the
+// heap cannot be mapped.
+heap_t *sheap_create(const struct sheap_config *config);
+
+// A heap over [base, base + len), memory the caller owns and keeps: a static
+// buffer, a hugetlbfs mapping, pinned or locked pages. The heap object sits at
+// the start of the region and the rest is carved into buddy blocks, the
+// misaligned edges into the largest aligned blocks that fit. The heap never
+// maps memory of its own, so requests the region cannot hold fail. Returns
+// nullptr if the region cannot even hold the heap object.
+heap_t *sheap_create_in(void *base, size_t len, const struct sheap_config *config = nullptr);
+
+// Releases every chunk and mapped block of the heap, live or not. The region
+// of a heap made by sheap_create_in() is left as it is.
+void sheap_destroy(heap_t *heap);
+
+// The my_stdlib.h calls, on one heap. Blocks must go back to the heap they
+// came from.
+void *sheap_malloc(heap_t *heap, size_t size);
+void *sheap_calloc(heap_t *heap, size_t num, size_t size);
+void sheap_free(heap_t *heap, void *p);
+void *sheap_realloc(heap_t *heap, void *oldp, size_t size);
+
+void sheap_get_stats(heap_t *heap, struct sheap_stats *stats);
+
+// A heap shared between processes. It lives in a file the caller opens, with
+// memfd_create() or shm_open(), and each process maps it wherever it likes:
+// the heap keeps no addresses, only offsets, and every call takes a
+// process-shared lock (config->thread_safe does not matter). Blocks are passed
+// between processes as offsets, see sheap_offset().
+//
+// If a process dies while it holds the lock, in the middle of a call, the heap
+// can no longer be trusted. From then on every call on it fails in every
+// process, sheap_malloc() returning nullptr and sheap_free() doing nothing,
+// rather than blocking; the heap can still be detached and destroyed.
+
+// Sizes fd to len bytes and makes a heap in it.
+heap_t *sheap_create_shared(int fd, size_t len, const struct sheap_config *config = nullptr);
+
+// Maps the heap another process made in fd. Returns nullptr if fd holds none.
+heap_t *sheap_attach_shared(int fd);
+
+// Unmaps the heap from this process and leaves it to the others.
+// sheap_destroy() instead ends it for every process: it may only be called
+// once every other process has detached, or exited. Afterwards fd holds no
+// heap to attach to.
+void sheap_detach_shared(heap_t *heap);
+
+// Where a block sits in its heap, the same in every process, and back.
+size_t sheap_offset(heap_t *heap, const void *p);
+void *sheap_pointer(heap_t *heap, size_t offset);
+
+#endif /* SHEAP_H */
@@ -0,0 +1,107 @@
+#ifndef SMALLOC_EXT_H
+#define SMALLOC_EXT_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+// Extensions to the my_stdlib.h API. Everything is implemented by the buddy
+// engine (malloc_3.cpp); smalloc_trim() also by malloc_2.cpp, and
+// smalloc_stats() also by the lock-free engine (malloc_lockfree.cpp).
+
+constexpr int HEAP_STATS_MAX_ORDERS = 32;
+
+// Snapshot of the buddy heap. Every field is maintained incrementally, so
+// smalloc_stats() costs O(orders) and never walks the heap.
+struct heap_stats {
+    int num_orders;
+    size_t block_size[HEAP_STATS_MAX_ORDERS];   // bytes per block of each order, metadata included
+    size_t free_blocks[HEAP_STATS_MAX_ORDERS];
+    size_t used_blocks[HEAP_STATS_MAX_ORDERS];
+
+    size_t free_bytes;           // free buddy blocks, metadata included
+    size_t largest_free_block;   // metadata included, 0 if nothing is free
+    double external_fragmentation;  // 1 - largest_free_block / free_bytes
+
+    // requested_bytes and internal_fragmentation need a build with
+    // MALLOC3_REQUESTED_STATS, which keeps the size asked for in every block
+    // header; otherwise they are 0.
+    size_t requested_bytes;      // what live allocations asked for
+    size_t granted_bytes;        // usable bytes of the blocks backing them
+    double internal_fragmentation;  // 1 - requested_bytes / granted_bytes
+
+    size_t mmap_blocks;
+    size_t mmap_bytes;           // mapped length, metadata included
+
+    size_t sbrk_calls;
+    size_t mmap_calls;
+    size_t munmap_calls;
+    size_t heap_growths;         // times the sbrk heap was extended
+    size_t heap_bytes;           // current size of the sbrk heap
+
+    size_t madvise_calls;
+    size_t purged_bytes;         // free block pages currently given back to the OS
+
+    size_t quick_blocks;         // free blocks parked unmerged (MALLOC3_DEFERRED_COALESCE)
+
+    // Blocks held by the per-CPU caches (MALLOC3_PER_CPU). The heap counts
+    // them as used, requesting their whole usable size.
+    size_t cpu_cache_blocks;
+    size_t cpu_cache_bytes;      // metadata included
+};
+
+enum smalloc_stats_format {
+    SMALLOC_STATS_TEXT,
+    SMALLOC_STATS_JSON,
+};
+
+void smalloc_stats(struct heap_stats *stats);
+void smalloc_stats_print(FILE *out, enum smalloc_stats_format format);
+
+// Purging hands the pages of free buddy blocks back to the OS with madvise.
+// The first page of a block holds its header and is always kept.
+enum smalloc_purge_advice {
+    SMALLOC_PURGE_DONTNEED,      // pages read back as zero, scalloc skips clearing them
+    SMALLOC_PURGE_FREE,          // cheaper, the kernel reclaims lazily; contents undefined
+};
+
+enum smalloc_purge_trigger {
+    SMALLOC_PURGE_NEVER,         // only smalloc_purge() purges
+    SMALLOC_PURGE_ON_FREE,       // sfree purges the block it leaves behind
+};
+
+struct smalloc_purge_policy {
+    int min_order;               // only free blocks of at least this order are purged
+    enum smalloc_purge_advice advice;
+    enum smalloc_purge_trigger trigger;
+};
+
+// The default is {MAX_ORDER, SMALLOC_PURGE_DONTNEED, SMALLOC_PURGE_NEVER}.
+void smalloc_get_purge_policy(struct smalloc_purge_policy *policy);
+void smalloc_set_purge_policy(const struct smalloc_purge_policy *policy);
+
+// Purges every eligible free block now. Returns the bytes given back.
+size_t smalloc_purge(void);
+
+// Returns free memory to the OS, after handing the per-CPU caches back to
+// the heap: free space at the top of the sbrk heap
+// beyond pad bytes is released by lowering the break, and the pages of other
+// free blocks are purged with madvise. Returns the bytes released.
+size_t smalloc_trim(size_t pad);
+
+// Optional background purger. Every interval_ms it purges free blocks of at
+// least the policy's min_order that have been free for decay_ms, at most
+// max_bytes_per_tick per wake-up. It takes the heap lock for a few madvise
+// calls and a bounded stretch of a free list at a time, and while it runs
+// the allocation calls serialize on that lock too.
+struct smalloc_purger_config {
+    unsigned decay_ms;
+    unsigned interval_ms;
+    size_t max_bytes_per_tick;
+};
+
+// Returns 0 on success, -1 if a purger is already running or the thread
+// cannot be created.
+int smalloc_purger_start(const struct smalloc_purger_config *config);
+void smalloc_purger_stop(void);
+
+#endif /* SMALLOC_EXT_H */
@@ -0,0 +1,222 @@
+#include "buddy_heap.h"
+#include <catch2/catch_test_macros.hpp>
+
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// The buddy engine as a template (buddy_heap.h). Most tests use a small heap:
+// 32-byte order-0 blocks up to 512-byte blocks, mapped 2 KB at a time. The
+// first 32 bytes of a chunk hold its header, so a fresh chunk is carved into
+// blocks of 32, 64, 128 and 256 bytes and three of 512.
+
+using SmallHeap = BuddyHeap<5, 4, 2048>;
+
+#define HEADER SmallHeap::HEADER_SIZE
+#define CHUNK_BLOCKS 7
+
+static_assert(SmallHeap::order_for(1) == 0, "");
+static_assert(SmallHeap::order_for(32 - HEADER) == 0, "");
+static_assert(SmallHeap::order_for(32 - HEADER + 1) == 1, "");
+static_assert(SmallHeap::order_for(512 - HEADER) == 4, "");
+static_assert(SmallHeap::order_for(512 - HEADER + 1) == 5, "");
+static_assert(SmallHeap::ORDERS.usable[3] == 256 - HEADER, "");
+
+// malloc_3's layout: 128-byte blocks up to 128 KB, 4 MB chunks.
+using DefaultHeap = BuddyHeap<7, 10, 32 * 131072>;
+static_assert(DefaultHeap::MAX_BLOCK == 131072, "");
+static_assert(DefaultHeap::order_for(100) == 0, "");
+static_assert(DefaultHeap::order_for(131072) == 11, "");
+
+TEST_CASE("A chunk is carved into aligned blocks", "[buddy_heap]")
+{
+    SmallHeap heap;
+    REQUIRE(heap.stats().chunks == 0);
+
+    char *a = (char *)heap.allocate(1);
+    REQUIRE(a != nullptr);
+    REQUIRE((uintptr_t)a % 16 == 0);
+    REQUIRE(heap.stats().chunks == 1);
+    REQUIRE(heap.stats().allocated_blocks == CHUNK_BLOCKS);
+    REQUIRE(heap.stats().free_blocks == CHUNK_BLOCKS - 1);
+    REQUIRE(heap.usable_of(a) == 32 - HEADER);
+
+    // The carved blocks never merge with each other.
+    heap.free(a);
+    REQUIRE(heap.stats().allocated_blocks == CHUNK_BLOCKS);
+    REQUIRE(heap.stats().free_blocks == CHUNK_BLOCKS);
+    REQUIRE(heap.stats().free_bytes == 2048 - 32 - CHUNK_BLOCKS * HEADER);
+
+    REQUIRE(heap.allocate(0) == nullptr);
+    REQUIRE(heap.allocate(BUDDY_MAX_ALLOCATION + 1) == nullptr);
+}
+
+TEST_CASE("Blocks split and merge with their buddies", "[buddy_heap]")
+{
+    SmallHeap heap;
+    char *a = (char *)heap.allocate(200);
+    REQUIRE(heap.usable_of(a) == 256 - HEADER);
+
+    // No 256-byte block is left, so a 512-byte one splits.
+    char *b = (char *)heap.allocate(200);
+    REQUIRE((uintptr_t)(b - HEADER) % 512 == 0);
+    REQUIRE(heap.stats().allocated_blocks == CHUNK_BLOCKS + 1);
+    REQUIRE(heap.stats().free_blocks == CHUNK_BLOCKS - 1);
+
+    char *c = (char *)heap.allocate(200);
+    REQUIRE(c == b + 256);
+    heap.free(b);
+    REQUIRE(heap.stats().free_blocks == CHUNK_BLOCKS - 1);
+    heap.free(c);
+    REQUIRE(heap.stats().allocated_blocks == CHUNK_BLOCKS);
+    heap.free(a);
+    REQUIRE(heap.stats().free_blocks == CHUNK_BLOCKS);
+
+    // A second chunk when the first is used up.
+    std::vector<void *> blocks;
+    for (int i = 0; i < 4; i++) blocks.push_back(heap.allocate(400));
+    REQUIRE(heap.stats().chunks == 2);
+    for (void *p : blocks) heap.free(p);
+    REQUIRE(heap.stats().free_blocks == 2 * CHUNK_BLOCKS);
+}
+
+TEST_CASE("reallocate grows into a free buddy", "[buddy_heap]")
+{
+    SmallHeap heap;
+    char *a = (char *)heap.allocate(200);
+    char *b = (char *)heap.allocate(200);
+    memset(b, 7, 200);
+    REQUIRE(heap.reallocate(b, 400) == b);
+    REQUIRE(heap.usable_of(b) == 512 - HEADER);
+    REQUIRE(heap.stats().allocated_blocks == CHUNK_BLOCKS);
+
+    // a is a carved block and cannot grow, so it moves.
+    memset(a, 3, 200);
+    char *moved = (char *)heap.reallocate(a, 300);
+    REQUIRE(moved != a);
+    REQUIRE(moved[199] == 3);
+    REQUIRE(heap.reallocate(moved, 10) == moved);
+    REQUIRE(b[199] == 7);
+}
+
+TEST_CASE("Large requests are mapped and released with the heap", "[buddy_heap]")
+{
+    SmallHeap heap;
+    char *a = (char *)heap.allocate(1000);
+    REQUIRE(a != nullptr);
+    REQUIRE((uintptr_t)a % 16 == 0);
+    memset(a, 1, 1000);
+    REQUIRE(heap.stats().mapped_blocks == 1);
+    REQUIRE(heap.usable_of(a) == 1000);
+
+    char *b = (char *)heap.reallocate(a, 5000);
+    REQUIRE(b[999] == 1);
+    REQUIRE(heap.stats().mapped_blocks == 1);
+
+    char *c = (char *)heap.allocate_zeroed(100, 100);
+    REQUIRE(c[9999] == 0);
+    REQUIRE(heap.allocate_zeroed(BUDDY_MAX_ALLOCATION, 2) == nullptr);
+    heap.free(c);
+    REQUIRE(heap.stats().mapped_blocks == 1);
+
+    heap.allocate(10);
+    heap.release_all();
+    REQUIRE(heap.stats().mapped_blocks == 0);
+    REQUIRE(heap.stats().allocated_blocks == 0);
+    REQUIRE(heap.stats().chunks == 0);
+    // And the heap is usable again.
+    REQUIRE(heap.allocate(10) != nullptr);
+}
+
+TEST_CASE("A region's edges are carved into aligned blocks", "[buddy_heap]")
+{
+    alignas(512) static char region[2048];
+    // [40, 1040) rounds in to [64, 1024): blocks of 64, 128, 256 and 512.
+    SmallHeap heap(region + 40, 1000);
+    REQUIRE(heap.stats().allocated_blocks == 4);
+    REQUIRE(heap.stats().free_bytes == 960 - 4 * HEADER);
+
+    char *a = (char *)heap.allocate(400);
+    REQUIRE(a == region + 512 + HEADER);
+    // Nothing is mapped past the region.
+    REQUIRE(heap.allocate(400) == nullptr);
+    REQUIRE(heap.allocate(1000) == nullptr);
+    REQUIRE(heap.stats().chunks == 0);
+
+    char *b = (char *)heap.allocate(1);
+    REQUIRE(b == region + 64 + HEADER);
+    heap.free(a);
+    heap.free(b);
+    REQUIRE(heap.stats().free_blocks == 4);
+
+    REQUIRE(heap.add_region(region + 1100, 20) == 0);
+    REQUIRE(heap.add_region(region + 1536, 512) == 512);
+    REQUIRE(heap.allocate(400) != nullptr);
+    REQUIRE(heap.allocate(400) != nullptr);
+}
+
+TEST_CASE("Policies are chosen at compile time", "[buddy_heap]")
+{
+    using Bare = BuddyHeap<5, 4, 2048, BuddyNoStats>;
+    using Locked = BuddyHeap<5, 4, 2048, BuddyNoStats, BuddyMutexLock>;
+    static_assert(sizeof(Bare) < sizeof(SmallHeap), "");
+
+    Locked heap;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++)
+    {
+        threads.emplace_back([&heap, t] {
+            void *blocks[64] = {nullptr};
+            for (int i = 0; i < 4000; i++)
+            {
+                int slot = (i * 7 + t) % 64;
+                heap.free(blocks[slot]);
+                blocks[slot] = heap.allocate(1 + (i * 13) % 600);
+                memset(blocks[slot], t, 1);
+            }
+            for (void *p : blocks) heap.free(p);
+        });
+    }
+    for (std::thread &thread : threads) thread.join();
+
+    Bare bare;
+    void *p = bare.allocate(100);
+    REQUIRE(p != nullptr);
+    bare.free(p);
+}
+
+TEST_CASE("A heap whose lock holder died refuses every call", "[buddy_heap]")
+{
+    using Shared = BuddyHeap<5, 4, 2048, BuddyCountStats, BuddySharedMutexLock>;
+    constexpr size_t length = 1 << 16;
+    char *mapping = (char *)mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    REQUIRE(mapping != MAP_FAILED);
+    Shared *heap = new (mapping) Shared(mapping + 4096, length - 4096);
+    void *p = heap->allocate(100);
+    REQUIRE(p != nullptr);
+    size_t free_blocks = heap->stats().free_blocks;
+
+    // The child exits in the middle of a call.
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        heap->run_locked([] { _exit(0); });
+        _exit(1);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    REQUIRE(WIFEXITED(status));
+    REQUIRE(WEXITSTATUS(status) == 0);
+
+    REQUIRE(heap->allocate(100) == nullptr);
+    heap->free(p);
+    REQUIRE(heap->stats().free_blocks == free_blocks);
+    REQUIRE(!heap->run_locked([] {}));
+    heap->~Shared();
+    munmap(mapping, length);
+}
@@ -0,0 +1,61 @@
+#include "buddy_model.h"
+#include <catch2/catch_test_macros.hpp>
+
+// 128-byte blocks up to 1 KB, grown two top blocks at a time.
+static const SimConfig config = {7, 3, 2048};
+static const size_t meta = 64;
+
+TEST_CASE("Split and merge on a short trace", "[buddy_sim]")
+{
+    std::vector<TraceRecord> ops = {
+        {1, 10, 1, 0, TRACE_MALLOC},
+        {2, 100, 2, 0, TRACE_MALLOC},
+        {3, 0, 1, 0, TRACE_FREE},
+        {4, 0, 2, 0, TRACE_FREE},
+    };
+    SimResult result;
+    BuddyModel(config, meta).run(ops, 2, result);
+
+    // The first block comes off a list of two top blocks and is split down to
+    // 128 bytes; the second takes the 256-byte half left over.
+    REQUIRE(result.peak_footprint == 2048);
+    REQUIRE(result.peak_requested == 110);
+    REQUIRE(result.granted == 128 + 256);
+    REQUIRE(result.internal_waste == 118 + 156);
+    REQUIRE(result.splits == 3);
+    REQUIRE(result.syscalls == 1);
+
+    // Freeing merges everything back into one top block, next to the other.
+    REQUIRE(result.merges == 3);
+    REQUIRE(result.list_ops == 10);
+    REQUIRE(result.list_steps == 12);
+    REQUIRE(result.cost == 12 + 2 * (3 + 3) + 2000);
+}
+
+TEST_CASE("List operations cost the length of the list", "[buddy_sim]")
+{
+    // Every other 128-byte block stays allocated, so the freed ones cannot
+    // merge and pile up on one list.
+    std::vector<TraceRecord> ops;
+    for (uint32_t id = 1; id <= 16; id++)
+    {
+        ops.push_back({id, 10, id, 0, TRACE_MALLOC});
+    }
+    for (uint32_t id = 1; id <= 16; id += 2)
+    {
+        ops.push_back({16 + id, 0, id, 0, TRACE_FREE});
+    }
+    SimResult result;
+    BuddyModel(config, meta).run(ops, 16, result);
+
+    REQUIRE(result.peak_footprint == 2048);
+    REQUIRE(result.merges == 0);
+    REQUIRE(result.splits == 2 * 7);
+
+    // The frees insert into a list of length 1 through 8.
+    SimResult allocated;
+    ops.resize(16);
+    BuddyModel(config, meta).run(ops, 16, allocated);
+    REQUIRE(result.list_ops - allocated.list_ops == 8);
+    REQUIRE(result.list_steps - allocated.list_steps == 1 + 2 + 3 + 4 + 5 + 6 + 7 + 8);
+}
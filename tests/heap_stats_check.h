@@ -0,0 +1,31 @@
+#ifndef HEAP_STATS_CHECK_H
+#define HEAP_STATS_CHECK_H
+
+#include "my_stdlib.h"
+#include "smalloc_ext.h"
+#include <catch2/catch_test_macros.hpp>
+
+// Checks smalloc_stats() against the _num_* counters of the same heap.
+inline void verify_consistent(const heap_stats &stats)
+{
+    size_t free_blocks = 0, total_blocks = 0, free_bytes = 0;
+    for (int order = 0; order < stats.num_orders; order++)
+    {
+        free_blocks += stats.free_blocks[order];
+        total_blocks += stats.free_blocks[order] + stats.used_blocks[order];
+        free_bytes += stats.free_blocks[order] * (stats.block_size[order] - _size_meta_data());
+    }
+    REQUIRE(free_blocks == _num_free_blocks());
+    REQUIRE(free_bytes == _num_free_bytes());
+    REQUIRE(total_blocks + stats.mmap_blocks == _num_allocated_blocks());
+    REQUIRE(stats.requested_bytes <= stats.granted_bytes);
+}
+
+inline void verify_consistent()
+{
+    heap_stats stats;
+    smalloc_stats(&stats);
+    verify_consistent(stats);
+}
+
+#endif /* HEAP_STATS_CHECK_H */
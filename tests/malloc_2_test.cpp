@@ -1,6 +1,8 @@
 #include "my_stdlib.h"
+#include "smalloc_ext.h"
 #include <catch2/catch_test_macros.hpp>
 
+#include <cstdint>
 #include <unistd.h>
 
 #define MAX_ALLOCATION_SIZE (1e8)
@@ -709,3 +711,195 @@ TEST_CASE("srealloc Max size", "[malloc2]")
     verify_blocks(1, MAX_ALLOCATION_SIZE, 1, MAX_ALLOCATION_SIZE);
     verify_size(base);
 }
+
+TEST_CASE("Double free", "[malloc2]")
+{
+    verify_blocks(0, 0, 0, 0);
+    void *base = sbrk(0);
+    char *a = (char *)smalloc(10);
+    REQUIRE(a != nullptr);
+    char *b = (char *)smalloc(20);
+    REQUIRE(b != nullptr);
+    verify_blocks(2, 30, 0, 0);
+
+    sfree(a);
+    sfree(a);
+    verify_blocks(2, 30, 1, 10);
+    verify_size(base);
+
+    char *c = (char *)smalloc(10);
+    REQUIRE(c == a);
+    verify_blocks(2, 30, 0, 0);
+    verify_size(base);
+
+    sfree(b);
+    sfree(c);
+    verify_blocks(2, 30, 2, 30);
+    verify_size(base);
+}
+
+TEST_CASE("Reuse smallest fitting block", "[malloc2]")
+{
+    verify_blocks(0, 0, 0, 0);
+    void *base = sbrk(0);
+    char *a = (char *)smalloc(1000);
+    char *b = (char *)smalloc(10);
+    char *c = (char *)smalloc(600);
+    char *d = (char *)smalloc(700);
+    REQUIRE(d != nullptr);
+    verify_blocks(4, 2310, 0, 0);
+
+    sfree(a);
+    sfree(b);
+    sfree(c);
+    verify_blocks(4, 2310, 3, 1610);
+
+    char *e = (char *)smalloc(500);
+    REQUIRE(e == c);
+    char *f = (char *)smalloc(600);
+    REQUIRE(f == a);
+    verify_blocks(4, 2310, 1, 10);
+    verify_size(base);
+
+    // The free block at the top of the heap is too small, a new one is needed.
+    sfree(d);
+    char *g = (char *)smalloc(800);
+    REQUIRE(g != d);
+    verify_blocks(5, 3110, 2, 710);
+    verify_size(base);
+}
+
+TEST_CASE("Best fit random", "[malloc2]")
+{
+    // Shadow copy of every block so each smalloc can be checked against the
+    // smallest, then lowest, free block that fits.
+    struct Block
+    {
+        char *p;
+        size_t size;
+        bool is_free;
+    };
+    static Block shadow[4096];
+    int count = 0;
+    char *live[256] = {nullptr};
+    unsigned state = 2024;
+
+    for (int i = 0; i < 20000; i++)
+    {
+        state = state * 1103515245 + 12345;
+        char *&slot = live[(state >> 8) % 256];
+        if (slot)
+        {
+            sfree(slot);
+            for (int j = 0; j < count; j++)
+            {
+                if (shadow[j].p == slot)
+                {
+                    shadow[j].is_free = true;
+                }
+            }
+            slot = nullptr;
+            continue;
+        }
+
+        // Mostly small exact-bin sizes, sometimes larger ones from the tree.
+        size_t size = (state >> 16) % 4 ? 1 + (state >> 12) % 511 : 512 + (state >> 12) % 4000;
+        int expected = -1;
+        for (int j = 0; j < count; j++)
+        {
+            if (shadow[j].is_free && shadow[j].size >= size &&
+                (expected < 0 || shadow[j].size < shadow[expected].size ||
+                 (shadow[j].size == shadow[expected].size && shadow[j].p < shadow[expected].p)))
+            {
+                expected = j;
+            }
+        }
+
+        slot = (char *)smalloc(size);
+        REQUIRE(slot != nullptr);
+        if (expected >= 0)
+        {
+            REQUIRE(slot == shadow[expected].p);
+            shadow[expected].is_free = false;
+        }
+        else
+        {
+            REQUIRE(count < 4096);
+            shadow[count++] = {slot, size, false};
+        }
+    }
+
+    size_t free_blocks = 0;
+    for (int j = 0; j < count; j++)
+    {
+        free_blocks += shadow[j].is_free;
+    }
+    REQUIRE(_num_free_blocks() == free_blocks);
+    REQUIRE(_num_allocated_blocks() == (size_t)count);
+}
+
+TEST_CASE("Trim", "[malloc2]")
+{
+    verify_blocks(0, 0, 0, 0);
+    void *base = sbrk(0);
+    char *a = (char *)smalloc(10);
+    char *b = (char *)smalloc(100000);
+    REQUIRE(b != nullptr);
+    sfree(b);
+
+    // The free top block goes back with a negative sbrk.
+    REQUIRE(smalloc_trim(0) == 100000 + _size_meta_data());
+    verify_blocks(1, 10, 0, 0);
+    verify_size(base);
+
+    char *c = (char *)smalloc(100);
+    REQUIRE(c == b);
+    sfree(c);
+
+    // With padding the top block shrinks instead.
+    REQUIRE(smalloc_trim(40) == 60);
+    verify_blocks(2, 50, 1, 40);
+    verify_size(base);
+    REQUIRE(smalloc_trim(40) == 0);
+
+    // Interior free blocks keep their place, only their pages are given back.
+    char *d = (char *)smalloc(100000);
+    char *e = (char *)smalloc(100);
+    REQUIRE(e == d + 100000 + _size_meta_data());
+    sfree(d);
+    size_t released = smalloc_trim(0);
+    REQUIRE(released > 100000 - 2 * 4096);
+    REQUIRE(released <= 100000);
+    verify_blocks(4, 100150, 2, 100040);
+    verify_size(base);
+    // Pages already given back are not counted again.
+    REQUIRE(smalloc_trim(40) == 0);
+
+    // Reusing the block makes its pages count once it is free again.
+    char *f = (char *)smalloc(100000);
+    REQUIRE(f == d);
+    f[50000] = 1;
+    sfree(f);
+    REQUIRE(smalloc_trim(40) == released);
+
+    sfree(a);
+    sfree(e);
+}
+
+TEST_CASE("Trim releases a top block that starts a page", "[malloc2]")
+{
+    verify_blocks(0, 0, 0, 0);
+    void *base = sbrk(0);
+    // Fill the heap up to where the next header starts a page, so releasing
+    // that block unmaps its header.
+    size_t filler = 4096 - ((uintptr_t)base + _size_meta_data()) % 4096;
+    char *a = (char *)smalloc(filler);
+    char *b = (char *)smalloc(100000);
+    REQUIRE((uintptr_t)(b - _size_meta_data()) % 4096 == 0);
+    sfree(b);
+
+    REQUIRE(smalloc_trim(0) == 100000 + _size_meta_data());
+    verify_blocks(1, filler, 0, 0);
+    verify_size(base);
+    sfree(a);
+}
@@ -0,0 +1,193 @@
+#include "my_stdlib.h"
+#include <catch2/catch_test_macros.hpp>
+
+#include <unistd.h>
+
+// malloc_2 built with the optional heap tuning (MALLOC2_COALESCE,
+// MALLOC2_GROW_IN_PLACE). The statistics keep their meaning: every header
+// counts as a block and the heap is still exactly blocks plus metadata.
+
+#define verify_blocks(allocated_blocks, allocated_bytes, free_blocks, free_bytes)                                      \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        REQUIRE(_num_allocated_blocks() == allocated_blocks);                                                          \
+        REQUIRE(_num_allocated_bytes() == allocated_bytes);                                                            \
+        REQUIRE(_num_free_blocks() == free_blocks);                                                                    \
+        REQUIRE(_num_free_bytes() == free_bytes);                                                                      \
+        REQUIRE(_num_meta_data_bytes() == _size_meta_data() * allocated_blocks);                                       \
+    } while (0)
+
+#define verify_size(base)                                                                                              \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        void *after = sbrk(0);                                                                                         \
+        REQUIRE(_num_allocated_bytes() + _size_meta_data() * _num_allocated_blocks() == (size_t)after - (size_t)base); \
+    } while (0)
+
+TEST_CASE("Split on reuse", "[malloc2][tuned]")
+{
+    verify_blocks(0, 0, 0, 0);
+    void *base = sbrk(0);
+    char *a = (char *)smalloc(1000);
+    REQUIRE(a != nullptr);
+    sfree(a);
+    verify_blocks(1, 1000, 1, 1000);
+
+    // The 1000 byte block is carved into 104 bytes plus a free tail.
+    char *b = (char *)smalloc(100);
+    REQUIRE(b == a);
+    size_t tail = 1000 - 104 - _size_meta_data();
+    verify_blocks(2, 1000 - _size_meta_data(), 1, tail);
+    verify_size(base);
+
+    // Leftovers too small for a header and a useful block are not split off.
+    char *c = (char *)smalloc(tail - _size_meta_data());
+    REQUIRE(c == b + 104 + _size_meta_data());
+    verify_blocks(2, 1000 - _size_meta_data(), 0, 0);
+    verify_size(base);
+
+    sfree(b);
+    sfree(c);
+    verify_blocks(1, 1000, 1, 1000);
+    verify_size(base);
+}
+
+TEST_CASE("Coalesce on free", "[malloc2][tuned]")
+{
+    verify_blocks(0, 0, 0, 0);
+    void *base = sbrk(0);
+    char *a = (char *)smalloc(100);
+    char *b = (char *)smalloc(200);
+    char *c = (char *)smalloc(300);
+    char *d = (char *)smalloc(400);
+    REQUIRE(d != nullptr);
+    verify_blocks(4, 1000, 0, 0);
+
+    // Next neighbour in use, previous one missing: nothing to merge.
+    sfree(a);
+    verify_blocks(4, 1000, 1, 100);
+
+    // c merges with nothing, then b joins both neighbours.
+    sfree(c);
+    verify_blocks(4, 1000, 2, 400);
+    sfree(b);
+    size_t merged = 600 + 2 * _size_meta_data();
+    verify_blocks(2, 1000 + 2 * _size_meta_data(), 1, merged);
+    verify_size(base);
+
+    // The merged block serves a request none of its parts could.
+    char *e = (char *)smalloc(merged);
+    REQUIRE(e == a);
+    verify_blocks(2, 1000 + 2 * _size_meta_data(), 0, 0);
+
+    sfree(d);
+    sfree(e);
+    verify_blocks(1, 1000 + 3 * _size_meta_data(), 1, 1000 + 3 * _size_meta_data());
+    verify_size(base);
+}
+
+TEST_CASE("Churn stays in place", "[malloc2][tuned]")
+{
+    void *blocks[64] = {nullptr};
+    unsigned state = 777;
+    void *high = nullptr;
+    for (int round = 0; round < 20; round++)
+    {
+        for (int i = 0; i < 1000; i++)
+        {
+            state = state * 1103515245 + 12345;
+            void *&block = blocks[(state >> 8) % 64];
+            sfree(block);
+            block = smalloc(16 + (state >> 12) % 2000);
+            REQUIRE(block != nullptr);
+        }
+        // Once the working set has been seen, freed memory is recycled
+        // instead of growing the heap.
+        if (round == 10)
+        {
+            high = sbrk(0);
+        }
+        if (round > 10)
+        {
+            REQUIRE((size_t)sbrk(0) - (size_t)high < 64 * 1024);
+        }
+    }
+
+    for (void *block : blocks)
+    {
+        sfree(block);
+    }
+    REQUIRE(_num_free_blocks() == 1);
+    REQUIRE(_num_allocated_blocks() == 1);
+}
+
+TEST_CASE("Wilderness grows in place", "[malloc2][tuned]")
+{
+    verify_blocks(0, 0, 0, 0);
+    void *base = sbrk(0);
+    char *a = (char *)smalloc(100);
+    char *b = (char *)smalloc(1000);
+    REQUIRE(b != nullptr);
+    sfree(b);
+    verify_blocks(2, 1100, 1, 1000);
+
+    // The free top block is extended by the missing 2000 bytes only.
+    char *c = (char *)smalloc(3000);
+    REQUIRE(c == b);
+    verify_blocks(2, 3100, 0, 0);
+    REQUIRE((size_t)sbrk(0) == (size_t)c + 3000);
+    verify_size(base);
+
+    sfree(a);
+    sfree(c);
+}
+
+TEST_CASE("srealloc grows in place", "[malloc2][tuned]")
+{
+    verify_blocks(0, 0, 0, 0);
+    void *base = sbrk(0);
+    char *a = (char *)smalloc(100);
+    char *b = (char *)smalloc(1000);
+    char *c = (char *)smalloc(10);
+    REQUIRE(c != nullptr);
+    for (int i = 0; i < 100; i++)
+    {
+        a[i] = (char)i;
+    }
+    sfree(b);
+
+    // Into the free next neighbour, the rest of which is split off again.
+    char *a2 = (char *)srealloc(a, 600);
+    REQUIRE(a2 == a);
+    size_t rest = 100 + 1000 - 600;
+    verify_blocks(3, 1110, 1, rest);
+    verify_size(base);
+    for (int i = 0; i < 100; i++)
+    {
+        REQUIRE(a2[i] == (char)i);
+    }
+
+    // The top block is extended by sbrk.
+    char *c2 = (char *)srealloc(c, 5000);
+    REQUIRE(c2 == c);
+    verify_blocks(3, 6100, 1, rest);
+    verify_size(base);
+
+    // Append-buffer growth never copies.
+    sfree(a2);
+    char *buffer = (char *)smalloc(16);
+    for (size_t size = 32; size <= 1 << 20; size *= 2)
+    {
+        char *grown = (char *)srealloc(buffer, size);
+        REQUIRE(grown != nullptr);
+        if (size > 2048)
+        {
+            REQUIRE(grown == buffer);
+        }
+        buffer = grown;
+    }
+    verify_size(base);
+
+    sfree(buffer);
+    sfree(c2);
+}
@@ -0,0 +1,113 @@
+#include "my_stdlib.h"
+#include "smalloc_ext.h"
+#include "thread_churn.h"
+#include <catch2/catch_test_macros.hpp>
+
+#include <cstdint>
+#include <cstring>
+#include <sched.h>
+
+// malloc_3 built with MALLOC3_PER_CPU: small blocks go through per-CPU caches
+// that refill from and flush to the heap in batches.
+
+#define MAX_ELEMENT_SIZE (128 * 1024)
+
+static heap_stats get_stats()
+{
+    heap_stats stats;
+    smalloc_stats(&stats);
+    return stats;
+}
+
+// Keeps the test on one CPU so every call sees the same cache.
+static void pin_to_one_cpu()
+{
+    int cpu = sched_getcpu();
+    REQUIRE(cpu >= 0);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    REQUIRE(sched_setaffinity(0, sizeof(set), &set) == 0);
+}
+
+TEST_CASE("Cached blocks are reused", "[malloc3][percpu]")
+{
+    pin_to_one_cpu();
+    char *a = (char *)smalloc(100);
+    REQUIRE(a != nullptr);
+    // The first miss takes a batch of 32 order-1 blocks from the heap.
+    REQUIRE(get_stats().cpu_cache_blocks == 31);
+    REQUIRE(get_stats().cpu_cache_bytes == 31 * 256);
+
+    sfree(a);
+    REQUIRE(get_stats().cpu_cache_blocks == 32);
+    for (int i = 0; i < 1000; i++)
+    {
+        char *b = (char *)smalloc(100);
+        REQUIRE(b == a);
+        sfree(b);
+    }
+    REQUIRE(get_stats().cpu_cache_blocks == 32);
+
+    // Double frees are still ignored.
+    sfree(a);
+    REQUIRE(get_stats().cpu_cache_blocks == 32);
+
+    // Large blocks bypass the caches.
+    void *large = smalloc(10000);
+    REQUIRE(large != nullptr);
+    sfree(large);
+    REQUIRE(get_stats().cpu_cache_blocks == 32);
+}
+
+TEST_CASE("Caches are bounded", "[malloc3][percpu]")
+{
+    pin_to_one_cpu();
+    static void *blocks[1000];
+    for (void *&block : blocks)
+    {
+        block = smalloc(100);
+        REQUIRE(block != nullptr);
+    }
+    for (void *block : blocks)
+    {
+        sfree(block);
+    }
+    // At most 16 KB of order-1 blocks stay cached.
+    REQUIRE(get_stats().cpu_cache_blocks <= 64);
+
+    // Trimming hands the caches back and the heap merges again.
+    smalloc_trim(32 * MAX_ELEMENT_SIZE);
+    heap_stats stats = get_stats();
+    REQUIRE(stats.cpu_cache_blocks == 0);
+    REQUIRE(stats.requested_bytes == 0);
+    REQUIRE(_num_free_blocks() == 32);
+    REQUIRE(_num_allocated_blocks() == 32);
+}
+
+TEST_CASE("scalloc clears cached blocks", "[malloc3][percpu]")
+{
+    pin_to_one_cpu();
+    char *a = (char *)smalloc(100);
+    memset(a, 0xff, 100);
+    sfree(a);
+    char *b = (char *)scalloc(1, 100);
+    REQUIRE(b == a);
+    for (int i = 0; i < 100; i++)
+    {
+        REQUIRE(b[i] == 0);
+    }
+    sfree(b);
+}
+
+TEST_CASE("Threads share the heap", "[malloc3][percpu]")
+{
+    churn_threads(6000);
+
+    smalloc_trim(32 * MAX_ELEMENT_SIZE);
+    heap_stats stats = get_stats();
+    REQUIRE(stats.cpu_cache_blocks == 0);
+    REQUIRE(stats.requested_bytes == 0);
+    REQUIRE(stats.mmap_blocks == 0);
+    REQUIRE(_num_free_blocks() == _num_allocated_blocks());
+}
@@ -0,0 +1,276 @@
+#include "my_stdlib.h"
+#include "smalloc_ext.h"
+#include <catch2/catch_test_macros.hpp>
+
+#include <cstring>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define MAX_ELEMENT_SIZE (128 * 1024)
+#define PAGE 4096
+#define BLOCK_USABLE (MAX_ELEMENT_SIZE - _size_meta_data())
+
+// Resident pages in [p, p + len), p page aligned.
+static size_t resident_pages(void *p, size_t len)
+{
+    unsigned char vec[MAX_ELEMENT_SIZE / PAGE];
+    REQUIRE(mincore(p, len, vec) == 0);
+    size_t count = 0;
+    for (size_t i = 0; i < (len + PAGE - 1) / PAGE; i++)
+    {
+        count += vec[i] & 1;
+    }
+    return count;
+}
+
+static size_t purged_bytes()
+{
+    heap_stats stats;
+    smalloc_stats(&stats);
+    return stats.purged_bytes;
+}
+
+static void set_policy(int min_order, smalloc_purge_advice advice, smalloc_purge_trigger trigger)
+{
+    smalloc_purge_policy policy = {min_order, advice, trigger};
+    smalloc_set_purge_policy(&policy);
+}
+
+TEST_CASE("Purge is off by default", "[malloc3][purge]")
+{
+    smalloc_purge_policy policy;
+    smalloc_get_purge_policy(&policy);
+    REQUIRE(policy.trigger == SMALLOC_PURGE_NEVER);
+    REQUIRE(policy.min_order == 10);
+
+    char *a = (char *)smalloc(BLOCK_USABLE);
+    memset(a, 1, BLOCK_USABLE);
+    sfree(a);
+    heap_stats stats;
+    smalloc_stats(&stats);
+    REQUIRE(stats.madvise_calls == 0);
+    REQUIRE(resident_pages(a - _size_meta_data(), MAX_ELEMENT_SIZE) == MAX_ELEMENT_SIZE / PAGE);
+}
+
+TEST_CASE("Purge on free", "[malloc3][purge]")
+{
+    set_policy(10, SMALLOC_PURGE_DONTNEED, SMALLOC_PURGE_ON_FREE);
+    char *a = (char *)smalloc(BLOCK_USABLE);
+    char *block = a - _size_meta_data();
+    memset(a, 1, BLOCK_USABLE);
+    REQUIRE(resident_pages(block, MAX_ELEMENT_SIZE) == MAX_ELEMENT_SIZE / PAGE);
+
+    sfree(a);
+    REQUIRE(resident_pages(block, MAX_ELEMENT_SIZE) == 1);
+    REQUIRE(purged_bytes() == MAX_ELEMENT_SIZE - PAGE);
+
+    // Reuse sees zeroes and takes the block out of the purged total.
+    char *b = (char *)scalloc(1, BLOCK_USABLE);
+    REQUIRE(b == a);
+    for (size_t i = 0; i < BLOCK_USABLE; i++)
+    {
+        REQUIRE(b[i] == 0);
+    }
+    REQUIRE(purged_bytes() == 0);
+    sfree(b);
+    REQUIRE(purged_bytes() == MAX_ELEMENT_SIZE - PAGE);
+}
+
+TEST_CASE("Purge state survives splits", "[malloc3][purge]")
+{
+    set_policy(10, SMALLOC_PURGE_DONTNEED, SMALLOC_PURGE_NEVER);
+    char *a = (char *)smalloc(100000);
+    memset(a, 1, 100000);
+    sfree(a);
+    REQUIRE(smalloc_purge() == 32 * (MAX_ELEMENT_SIZE - PAGE));
+    REQUIRE(smalloc_purge() == 0);
+
+    // Halves of a purged block stay purged down to one page, and scalloc
+    // still returns zeroed memory when it carves them up.
+    char *b = (char *)scalloc(1, 30000);
+    REQUIRE(b == a);
+    for (int i = 0; i < 30000; i++)
+    {
+        REQUIRE(b[i] == 0);
+    }
+    char *c = (char *)scalloc(1, 5000);
+    for (int i = 0; i < 5000; i++)
+    {
+        REQUIRE(c[i] == 0);
+    }
+    REQUIRE(purged_bytes() ==
+            31 * (MAX_ELEMENT_SIZE - PAGE) + (64 * 1024 - PAGE) + (16 * 1024 - PAGE) + (8 * 1024 - PAGE));
+
+    // Merging drops the state; the merged block is purged again on demand.
+    sfree(b);
+    sfree(c);
+    REQUIRE(purged_bytes() == 31 * (MAX_ELEMENT_SIZE - PAGE));
+    REQUIRE(smalloc_purge() == MAX_ELEMENT_SIZE - PAGE);
+}
+
+TEST_CASE("Lazy purge", "[malloc3][purge]")
+{
+    set_policy(6, SMALLOC_PURGE_FREE, SMALLOC_PURGE_ON_FREE);
+    char *a = (char *)smalloc(10000);
+    char *b = (char *)smalloc(10000);
+    memset(a, 1, 10000);
+    memset(b, 1, 10000);
+
+    // Freeing a leaves a 16 KB block of order 7, which is purged lazily.
+    sfree(a);
+    REQUIRE(purged_bytes() == 16 * 1024 - PAGE);
+
+    // Contents are undefined after MADV_FREE, so scalloc clears everything.
+    char *c = (char *)scalloc(1, 10000);
+    REQUIRE(c == a);
+    for (int i = 0; i < 10000; i++)
+    {
+        REQUIRE(c[i] == 0);
+    }
+    sfree(b);
+    sfree(c);
+}
+
+TEST_CASE("Background purger decays free blocks", "[malloc3][purge]")
+{
+    set_policy(10, SMALLOC_PURGE_DONTNEED, SMALLOC_PURGE_NEVER);
+    smalloc_purger_config config = {100, 5, 64 * MAX_ELEMENT_SIZE};
+    REQUIRE(smalloc_purger_start(&config) == 0);
+    REQUIRE(smalloc_purger_start(&config) == -1);
+
+    // Untouched blocks from before the purger started count as long idle.
+    usleep(50 * 1000);
+    REQUIRE(purged_bytes() == 32 * (MAX_ELEMENT_SIZE - PAGE));
+
+    char *a = (char *)smalloc(BLOCK_USABLE);
+    char *block = a - _size_meta_data();
+    memset(a, 1, BLOCK_USABLE);
+    sfree(a);
+    REQUIRE(resident_pages(block, MAX_ELEMENT_SIZE) == MAX_ELEMENT_SIZE / PAGE);
+
+    for (int i = 0; i < 100 && resident_pages(block, MAX_ELEMENT_SIZE) > 1; i++)
+    {
+        usleep(10 * 1000);
+    }
+    REQUIRE(resident_pages(block, MAX_ELEMENT_SIZE) == 1);
+    REQUIRE(purged_bytes() == 32 * (MAX_ELEMENT_SIZE - PAGE));
+    smalloc_purger_stop();
+}
+
+TEST_CASE("Background purger sweeps long free lists in batches", "[malloc3][purge]")
+{
+    // 200 free 8 KB blocks, each with an allocated buddy, far more than one
+    // hold of the lock looks at.
+    constexpr int count = 400;
+    constexpr size_t block_size = 8192;
+    static char *blocks[count];
+    for (char *&p : blocks)
+    {
+        p = (char *)smalloc(block_size - _size_meta_data());
+        REQUIRE(p != nullptr);
+        memset(p, 1, block_size - _size_meta_data());
+    }
+    for (int i = 0; i < count; i += 2)
+    {
+        sfree(blocks[i]);
+    }
+
+    set_policy(6, SMALLOC_PURGE_DONTNEED, SMALLOC_PURGE_NEVER);
+    smalloc_purger_config config = {0, 1, 64 * MAX_ELEMENT_SIZE};
+    REQUIRE(smalloc_purger_start(&config) == 0);
+    auto resident = [] {
+        size_t pages = 0;
+        for (int i = 0; i < count; i += 2)
+        {
+            pages += resident_pages(blocks[i] - _size_meta_data() + PAGE, PAGE);
+        }
+        return pages;
+    };
+    for (int i = 0; i < 100 && resident() > 0; i++)
+    {
+        usleep(10 * 1000);
+    }
+    smalloc_purger_stop();
+    REQUIRE(resident() == 0);
+
+    for (int i = 1; i < count; i += 2)
+    {
+        sfree(blocks[i]);
+    }
+}
+
+TEST_CASE("Background purger under churn", "[malloc3][purge]")
+{
+    set_policy(6, SMALLOC_PURGE_DONTNEED, SMALLOC_PURGE_NEVER);
+    smalloc_purger_config config = {0, 1, 1 << 20};
+    REQUIRE(smalloc_purger_start(&config) == 0);
+
+    // Every block keeps its contents while the purger races the allocator.
+    char *blocks[32] = {nullptr};
+    size_t sizes[32] = {0};
+    unsigned state = 99;
+    for (int i = 0; i < 20000; i++)
+    {
+        state = state * 1103515245 + 12345;
+        int slot = (state >> 8) % 32;
+        if (blocks[slot])
+        {
+            for (size_t j = 0; j < sizes[slot]; j += 512)
+            {
+                REQUIRE(blocks[slot][j] == (char)slot);
+            }
+            sfree(blocks[slot]);
+            blocks[slot] = nullptr;
+        }
+        else
+        {
+            sizes[slot] = 1 + (state >> 12) % 60000;
+            blocks[slot] = (char *)smalloc(sizes[slot]);
+            REQUIRE(blocks[slot] != nullptr);
+            memset(blocks[slot], slot, sizes[slot]);
+        }
+    }
+    smalloc_purger_stop();
+
+    for (char *block : blocks)
+    {
+        sfree(block);
+    }
+    REQUIRE(_num_free_blocks() == _num_allocated_blocks());
+}
+
+TEST_CASE("Trim", "[malloc3][purge]")
+{
+    set_policy(10, SMALLOC_PURGE_DONTNEED, SMALLOC_PURGE_NEVER);
+    char *a = (char *)smalloc(10);
+    REQUIRE(a != nullptr);
+    char *end = (char *)sbrk(0);
+
+    // Everything above the first max-order block goes back to the OS, and
+    // the free buddies left next to a are purged.
+    size_t purged = (64 + 32 + 16 + 8) * 1024 - 4 * PAGE;
+    REQUIRE(smalloc_trim(0) == 31 * MAX_ELEMENT_SIZE + purged);
+    REQUIRE((char *)sbrk(0) == end - 31 * MAX_ELEMENT_SIZE);
+    REQUIRE(_num_allocated_blocks() == 11);
+    REQUIRE(_num_free_blocks() == 10);
+    REQUIRE(smalloc_trim(0) == 0);
+
+    // The released blocks come back once the remaining ones run out.
+    char *b = (char *)smalloc(BLOCK_USABLE);
+    REQUIRE(b != nullptr);
+    REQUIRE((char *)sbrk(0) == end);
+    REQUIRE(_num_allocated_blocks() == 11 + 31);
+    memset(b, 1, BLOCK_USABLE);
+
+    sfree(a);
+    sfree(b);
+    REQUIRE(_num_free_blocks() == 32);
+
+    // Padding keeps enough max-order blocks to cover it.
+    REQUIRE(smalloc_trim(2 * MAX_ELEMENT_SIZE + 1) >= 29 * MAX_ELEMENT_SIZE);
+    REQUIRE((char *)sbrk(0) == end - 29 * MAX_ELEMENT_SIZE);
+    heap_stats stats;
+    smalloc_stats(&stats);
+    REQUIRE(stats.free_blocks[10] == 3);
+    REQUIRE(stats.heap_growths == 2);
+}
@@ -0,0 +1,108 @@
+#include "my_stdlib.h"
+#include "heap_stats_check.h"
+#include "smalloc_ext.h"
+#include <catch2/catch_test_macros.hpp>
+
+#include <cstring>
+
+// malloc_3 built with MALLOC3_DEFERRED_COALESCE: freed blocks wait unmerged
+// on per-order quick lists.
+
+#define MAX_ELEMENT_SIZE (128 * 1024)
+
+static size_t quick_blocks()
+{
+    heap_stats stats;
+    smalloc_stats(&stats);
+    return stats.quick_blocks;
+}
+
+TEST_CASE("Ping-pong reuses without merging", "[malloc3][quick]")
+{
+    char *a = (char *)smalloc(100);
+    REQUIRE(a != nullptr);
+    // 31 untouched max-order blocks, the free halves of orders 1 to 9, and a.
+    REQUIRE(_num_allocated_blocks() == 31 + 9 + 1);
+    REQUIRE(_num_free_blocks() == 31 + 9);
+
+    sfree(a);
+    REQUIRE(_num_allocated_blocks() == 31 + 9 + 1);
+    REQUIRE(_num_free_blocks() == 31 + 9 + 1);
+    REQUIRE(quick_blocks() == 1);
+    REQUIRE(_num_free_bytes() == 31 * (MAX_ELEMENT_SIZE - _size_meta_data()) +
+                                     (MAX_ELEMENT_SIZE - 256) - 9 * _size_meta_data() + 256 - _size_meta_data());
+    verify_consistent();
+
+    for (int i = 0; i < 1000; i++)
+    {
+        char *b = (char *)smalloc(100);
+        REQUIRE(b == a);
+        sfree(b);
+    }
+    REQUIRE(_num_allocated_blocks() == 31 + 9 + 1);
+    verify_consistent();
+
+    // Double frees are still ignored.
+    sfree(a);
+    REQUIRE(_num_free_blocks() == 31 + 9 + 1);
+}
+
+TEST_CASE("Parked blocks merge under pressure", "[malloc3][quick]")
+{
+    // Use up every max-order block as small blocks, then free them all.
+    constexpr int count = 32 * MAX_ELEMENT_SIZE / 256;
+    static void *blocks[count];
+    for (void *&block : blocks)
+    {
+        block = smalloc(100);
+        REQUIRE(block != nullptr);
+    }
+    REQUIRE(smalloc(100) == nullptr);
+    for (void *block : blocks)
+    {
+        sfree(block);
+    }
+    verify_consistent();
+    REQUIRE(_num_free_blocks() > 32);
+
+    // The parked blocks pin the last max-order block; once the others are
+    // taken, a max-order request only succeeds by merging them.
+    REQUIRE(quick_blocks() == 32);
+    static char *big[32];
+    for (char *&block : big)
+    {
+        block = (char *)smalloc(MAX_ELEMENT_SIZE - _size_meta_data());
+        REQUIRE(block != nullptr);
+        memset(block, 1, MAX_ELEMENT_SIZE - _size_meta_data());
+    }
+    REQUIRE(quick_blocks() == 0);
+    REQUIRE(_num_allocated_blocks() == 32);
+    REQUIRE(_num_free_blocks() == 0);
+    verify_consistent();
+    for (char *block : big)
+    {
+        sfree(block);
+    }
+}
+
+TEST_CASE("Quick lists are bounded", "[malloc3][quick]")
+{
+    static void *blocks[100];
+    for (void *&block : blocks)
+    {
+        block = smalloc(100);
+    }
+    for (void *block : blocks)
+    {
+        sfree(block);
+    }
+    // At most 32 blocks stay parked, the rest are merged back.
+    REQUIRE(quick_blocks() == 32);
+    verify_consistent();
+
+    // Trimming merges the parked blocks too.
+    smalloc_trim(32 * MAX_ELEMENT_SIZE);
+    REQUIRE(quick_blocks() == 0);
+    REQUIRE(_num_free_blocks() == 32);
+    verify_consistent();
+}
@@ -0,0 +1,123 @@
+#include "my_stdlib.h"
+#include "heap_stats_check.h"
+#include "smalloc_ext.h"
+#include <catch2/catch_test_macros.hpp>
+
+#include <cstring>
+
+// malloc_3 built with MALLOC3_BATCH_REFILL: an empty free list is refilled
+// with 32 blocks carved in one pass.
+
+#define MAX_ELEMENT_SIZE (128 * 1024)
+
+TEST_CASE("Refill carves a run", "[malloc3][refill]")
+{
+    char *a = (char *)smalloc(10);
+    REQUIRE(a != nullptr);
+    // An order-5 block split off the first max-order block (leaving halves
+    // at orders 5 to 9) was carved into 32 order-0 blocks.
+    REQUIRE(_num_allocated_blocks() == 31 + 5 + 32);
+    REQUIRE(_num_free_blocks() == 31 + 5 + 31);
+    verify_consistent();
+
+    // The rest of the burst is served from the run, in address order.
+    for (int i = 1; i < 32; i++)
+    {
+        char *b = (char *)smalloc(10);
+        REQUIRE(b == a + i * 128);
+    }
+    REQUIRE(_num_allocated_blocks() == 31 + 5 + 32);
+    verify_consistent();
+
+    // The next one refills again from the free order-5 half.
+    char *c = (char *)smalloc(10);
+    REQUIRE(c == a + 32 * 128);
+    REQUIRE(_num_allocated_blocks() == 31 + 4 + 64);
+    verify_consistent();
+}
+
+TEST_CASE("Carved blocks merge under pressure", "[malloc3][refill]")
+{
+    constexpr int count = 32 * MAX_ELEMENT_SIZE / 128;
+    static void *blocks[count];
+    for (void *&block : blocks)
+    {
+        block = smalloc(10);
+        REQUIRE(block != nullptr);
+    }
+    REQUIRE(smalloc(10) == nullptr);
+    for (void *block : blocks)
+    {
+        sfree(block);
+    }
+    verify_consistent();
+
+    static char *big[32];
+    for (char *&block : big)
+    {
+        block = (char *)smalloc(MAX_ELEMENT_SIZE - _size_meta_data());
+        REQUIRE(block != nullptr);
+        memset(block, 1, MAX_ELEMENT_SIZE - _size_meta_data());
+    }
+    REQUIRE(_num_allocated_blocks() == 32);
+    REQUIRE(_num_free_blocks() == 0);
+    verify_consistent();
+    for (char *block : big)
+    {
+        sfree(block);
+    }
+    REQUIRE(_num_free_blocks() == 32);
+}
+
+TEST_CASE("Refill with mixed sizes", "[malloc3][refill]")
+{
+    void *blocks[256] = {nullptr};
+    unsigned state = 4242;
+    for (int i = 0; i < 20000; i++)
+    {
+        state = state * 1103515245 + 12345;
+        void *&block = blocks[(state >> 8) % 256];
+        if (block)
+        {
+            sfree(block);
+            block = nullptr;
+        }
+        else
+        {
+            block = smalloc(1 + (state >> 12) % 3000);
+            REQUIRE(block != nullptr);
+        }
+        if (i % 1000 == 0)
+        {
+            verify_consistent();
+        }
+    }
+    for (void *block : blocks)
+    {
+        sfree(block);
+    }
+    verify_consistent();
+}
+
+#ifdef MALLOC3_DEFERRED_COALESCE
+TEST_CASE("A parked block is reused before refilling", "[malloc3][refill][quick]")
+{
+    char *run[32];
+    for (char *&block : run)
+    {
+        block = (char *)smalloc(10);
+        REQUIRE(block != nullptr);
+    }
+    size_t allocated = _num_allocated_blocks();
+
+    // The run is used up, but the freed block waits on its quick list.
+    sfree(run[7]);
+    REQUIRE(smalloc(10) == run[7]);
+    REQUIRE(_num_allocated_blocks() == allocated);
+    verify_consistent();
+    for (char *block : run)
+    {
+        sfree(block);
+    }
+}
+#endif
@@ -0,0 +1,133 @@
+#include "my_stdlib.h"
+#include "smalloc_ext.h"
+#include "thread_churn.h"
+#include <catch2/catch_test_macros.hpp>
+
+#include <cstdint>
+#include <cstring>
+#include <pthread.h>
+
+// malloc_3 built with MALLOC3_SHARDS=4: threads are spread over four heaps,
+// each with its own lock and free lists. The first shard keeps the sbrk
+// region, the others map 4 MB superchunks.
+
+#define MAX_ELEMENT_SIZE (128 * 1024)
+#define CHUNK_SIZE (4 * 1024 * 1024)
+
+static heap_stats get_stats()
+{
+    heap_stats stats;
+    smalloc_stats(&stats);
+    return stats;
+}
+
+static void *allocate_pair(void *arg)
+{
+    void **pair = static_cast<void **>(arg);
+    pair[0] = smalloc(100);
+    pair[1] = smalloc(100);
+    return nullptr;
+}
+
+// Allocates two buddies on a new thread, which lands on the next shard.
+static void smalloc_on_new_thread(void *pair[2])
+{
+    pthread_t thread;
+    REQUIRE(pthread_create(&thread, nullptr, allocate_pair, pair) == 0);
+    pthread_join(thread, nullptr);
+}
+
+TEST_CASE("Threads get their own shards", "[malloc3][shards]")
+{
+    char *a = (char *)smalloc(100);
+    REQUIRE(a != nullptr);
+    REQUIRE(get_stats().mmap_calls == 0);
+
+    void *pair[2];
+    smalloc_on_new_thread(pair);
+    char *b = (char *)pair[0];
+    REQUIRE(b != nullptr);
+    REQUIRE(pair[1] == b + 256);
+    // The second shard maps its own superchunk, far from the sbrk heap.
+    heap_stats stats = get_stats();
+    REQUIRE(stats.mmap_calls == 1);
+    REQUIRE(stats.heap_growths == 2);
+    REQUIRE((uintptr_t)b % CHUNK_SIZE == (uintptr_t)a % CHUNK_SIZE);
+    REQUIRE(((uintptr_t)b ^ (uintptr_t)a) >= CHUNK_SIZE);
+
+    // Stats add up over both: two max-order blocks out of 64 split down to
+    // order 1.
+    REQUIRE(_num_allocated_blocks() == 64 - 2 + 2 * 10);
+    REQUIRE(_num_free_blocks() == 64 - 2 + 9 + 8);
+    REQUIRE(stats.requested_bytes == 300);
+    REQUIRE(stats.used_blocks[1] == 3);
+
+    // A free goes back to the shard that owns the block, whichever thread
+    // makes it, and merges there.
+    sfree(b);
+    sfree(pair[1]);
+    sfree(a);
+    REQUIRE(_num_allocated_blocks() == 64);
+    REQUIRE(_num_free_blocks() == 64);
+    REQUIRE(get_stats().requested_bytes == 0);
+}
+
+TEST_CASE("srealloc moves blocks between shards", "[malloc3][shards]")
+{
+    REQUIRE(smalloc(1) != nullptr);
+    void *pair[2];
+    smalloc_on_new_thread(pair);
+    char *b = (char *)pair[0];
+    for (int i = 0; i < 100; i++)
+    {
+        b[i] = (char)i;
+    }
+
+    // With its buddy in use, growing moves the block onto this thread's shard.
+    char *c = (char *)srealloc(b, 5000);
+    REQUIRE(c != nullptr);
+    REQUIRE(((uintptr_t)c ^ (uintptr_t)b) >= CHUNK_SIZE);
+    for (int i = 0; i < 100; i++)
+    {
+        REQUIRE(c[i] == (char)i);
+    }
+    sfree(pair[1]);
+    // The old block merged back in its own shard.
+    REQUIRE(get_stats().free_blocks[10] == 31 + 32);
+
+    // Shrinking stays in place.
+    REQUIRE(srealloc(c, 100) == c);
+    sfree(c);
+}
+
+TEST_CASE("Shards grow by superchunks", "[malloc3][shards]")
+{
+    static void *blocks[33];
+    for (void *&block : blocks)
+    {
+        block = smalloc(MAX_ELEMENT_SIZE - _size_meta_data());
+        REQUIRE(block != nullptr);
+    }
+    // The sbrk region holds 32, the 33rd comes from a superchunk.
+    heap_stats stats = get_stats();
+    REQUIRE(stats.mmap_calls == 1);
+    REQUIRE(stats.mmap_blocks == 0);
+    REQUIRE(_num_allocated_blocks() == 64);
+    REQUIRE(_num_free_blocks() == 31);
+    for (void *block : blocks)
+    {
+        sfree(block);
+    }
+    REQUIRE(_num_free_blocks() == 64);
+}
+
+TEST_CASE("Threads churn across shards", "[malloc3][shards]")
+{
+    churn_threads(6000);
+
+    heap_stats stats = get_stats();
+    REQUIRE(stats.requested_bytes == 0);
+    REQUIRE(stats.heap_growths == 4);
+    REQUIRE(_num_free_blocks() == _num_allocated_blocks());
+    REQUIRE(_num_free_blocks() == 4 * 32);
+}
@@ -0,0 +1,146 @@
+#include "my_stdlib.h"
+#include "heap_stats_check.h"
+#include "smalloc_ext.h"
+#include <catch2/catch_test_macros.hpp>
+
+#include <cstdio>
+#include <cstring>
+
+#define MAX_ELEMENT_SIZE (128 * 1024)
+
+TEST_CASE("Stats per order", "[malloc3][stats]")
+{
+    heap_stats stats;
+    void *a = smalloc(10);
+    REQUIRE(a != nullptr);
+    smalloc_stats(&stats);
+
+    REQUIRE(stats.num_orders == 11);
+    REQUIRE(stats.block_size[0] == 128);
+    REQUIRE(stats.block_size[10] == MAX_ELEMENT_SIZE);
+    for (int order = 0; order < 10; order++)
+    {
+        REQUIRE(stats.free_blocks[order] == 1);
+    }
+    REQUIRE(stats.free_blocks[10] == 31);
+    REQUIRE(stats.used_blocks[0] == 1);
+    REQUIRE(stats.largest_free_block == MAX_ELEMENT_SIZE);
+    REQUIRE(stats.requested_bytes == 10);
+    REQUIRE(stats.granted_bytes == 128 - _size_meta_data());
+    REQUIRE(stats.heap_growths == 1);
+    REQUIRE(stats.heap_bytes >= 32 * MAX_ELEMENT_SIZE);
+    verify_consistent(stats);
+
+    sfree(a);
+    smalloc_stats(&stats);
+    REQUIRE(stats.free_blocks[0] == 0);
+    REQUIRE(stats.free_blocks[10] == 32);
+    REQUIRE(stats.used_blocks[0] == 0);
+    REQUIRE(stats.requested_bytes == 0);
+    REQUIRE(stats.granted_bytes == 0);
+    REQUIRE(stats.external_fragmentation > 0.96);
+    verify_consistent(stats);
+}
+
+TEST_CASE("Stats mmap and srealloc", "[malloc3][stats]")
+{
+    heap_stats stats;
+    void *large = smalloc(MAX_ELEMENT_SIZE + 100);
+    REQUIRE(large != nullptr);
+    smalloc_stats(&stats);
+    REQUIRE(stats.mmap_blocks == 1);
+    REQUIRE(stats.mmap_bytes == MAX_ELEMENT_SIZE + 100 + _size_meta_data());
+    REQUIRE(stats.mmap_calls == 1);
+    verify_consistent(stats);
+
+    void *small = smalloc(100);
+    small = srealloc(small, 60);
+    smalloc_stats(&stats);
+    REQUIRE(stats.requested_bytes == MAX_ELEMENT_SIZE + 100 + 60);
+    verify_consistent(stats);
+
+    small = srealloc(small, 1000);
+    REQUIRE(small != nullptr);
+    smalloc_stats(&stats);
+    REQUIRE(stats.requested_bytes == MAX_ELEMENT_SIZE + 100 + 1000);
+    verify_consistent(stats);
+
+    sfree(large);
+    sfree(small);
+    smalloc_stats(&stats);
+    REQUIRE(stats.mmap_blocks == 0);
+    REQUIRE(stats.munmap_calls == 1);
+    REQUIRE(stats.requested_bytes == 0);
+    REQUIRE(stats.granted_bytes == 0);
+    verify_consistent(stats);
+}
+
+TEST_CASE("Growing into the header space moves the block", "[malloc3][stats]")
+{
+    heap_stats stats;
+    smalloc_stats(&stats);
+    size_t block_size = stats.block_size[0];
+    char *a = (char *)smalloc(10);
+    char *b = (char *)smalloc(10);
+    REQUIRE(b == a + block_size);
+    memset(b, 'b', 10);
+
+    // a's buddy is taken, so a grow past the usable bytes cannot stay put.
+    char *c = (char *)srealloc(a, block_size - _size_meta_data() + 1);
+    REQUIRE(c != nullptr);
+    REQUIRE(c != a);
+    memset(c, 'c', block_size - _size_meta_data() + 1);
+    for (int i = 0; i < 10; i++)
+    {
+        REQUIRE(b[i] == 'b');
+    }
+    verify_consistent();
+
+    sfree(b);
+    sfree(c);
+    verify_consistent();
+}
+
+TEST_CASE("Stats churn", "[malloc3][stats]")
+{
+    void *blocks[64] = {nullptr};
+    heap_stats stats;
+    unsigned state = 12345;
+    for (int i = 0; i < 2000; i++)
+    {
+        state = state * 1103515245 + 12345;
+        void *&block = blocks[(state >> 8) % 64];
+        if (block)
+        {
+            sfree(block);
+            block = nullptr;
+        }
+        else
+        {
+            block = smalloc(1 + (state >> 12) % 20000);
+        }
+        smalloc_stats(&stats);
+        verify_consistent(stats);
+    }
+    for (void *block : blocks)
+    {
+        sfree(block);
+    }
+}
+
+TEST_CASE("Stats dump", "[malloc3][stats]")
+{
+    void *a = smalloc(10);
+    char buffer[4096] = {0};
+    FILE *out = fmemopen(buffer, sizeof(buffer) - 1, "w");
+    smalloc_stats_print(out, SMALLOC_STATS_JSON);
+    fclose(out);
+    REQUIRE(buffer[0] == '{');
+    REQUIRE(strstr(buffer, "\"largest_free_block\":131072") != nullptr);
+
+    out = fmemopen(buffer, sizeof(buffer) - 1, "w");
+    smalloc_stats_print(out, SMALLOC_STATS_TEXT);
+    fclose(out);
+    REQUIRE(strstr(buffer, "external fragmentation") != nullptr);
+    sfree(a);
+}
@@ -0,0 +1,87 @@
+#include "my_stdlib.h"
+#include <catch2/catch_test_macros.hpp>
+
+#include <cstdint>
+#include <cstring>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Built against malloc_1 and malloc_2 with MALLOC_SBRK_CHUNK=65536, see
+// heap_chunk.h.
+
+#define SBRK_CHUNK (64 * 1024)
+#define PAGE 4096
+
+TEST_CASE("Break moves in chunks", "[chunk]")
+{
+    void *base = sbrk(0);
+    char *a = (char *)smalloc(10);
+    REQUIRE(a != nullptr);
+    REQUIRE((size_t)sbrk(0) - (size_t)base == SBRK_CHUNK);
+
+    // The next block is carved from the slack right after the first one.
+    char *b = (char *)smalloc(10);
+    REQUIRE(b > a);
+    REQUIRE((size_t)b - (size_t)a < 128);
+    REQUIRE((size_t)sbrk(0) - (size_t)base == SBRK_CHUNK);
+}
+
+TEST_CASE("Chunks grow geometrically", "[chunk]")
+{
+    void *last = sbrk(0);
+    int moves = 0;
+    for (int i = 0; i < 100000; i++)
+    {
+        REQUIRE(smalloc(16) != nullptr);
+        void *now = sbrk(0);
+        if (now != last)
+        {
+            moves++;
+            last = now;
+        }
+    }
+    // Up to ~7 MB in chunks of 64 KB, 128 KB, ... 8 MB.
+    REQUIRE(moves <= 8);
+}
+
+TEST_CASE("Requests larger than a chunk", "[chunk]")
+{
+    void *base = sbrk(0);
+    char *a = (char *)smalloc(10);
+    char *big = (char *)smalloc(10 * 1024 * 1024);
+    REQUIRE(a != nullptr);
+    REQUIRE(big != nullptr);
+    std::memset(big, 1, 10 * 1024 * 1024);
+    REQUIRE((size_t)sbrk(0) - (size_t)base < 11 * 1024 * 1024);
+    REQUIRE(smalloc(100000001) == nullptr);
+}
+
+TEST_CASE("The break moves by exactly the request when a chunk does not fit", "[chunk]")
+{
+    // Allocate until the break moves, so the slack above the last block is
+    // known.
+    void *before = sbrk(0);
+    char *last;
+    do
+    {
+        last = (char *)smalloc(16);
+        REQUIRE(last != nullptr);
+    } while (sbrk(0) == before);
+    char *brk = (char *)sbrk(0);
+    size_t slack = brk - (last + 16);
+
+    // A mapping just past what the request needs, with room for a header,
+    // leaves room for the request but not for a chunk of SBRK_CHUNK or more.
+    size_t request = slack + 8192;
+    uintptr_t blocker = ((uintptr_t)brk + 8192 + 256 + PAGE - 1) / PAGE * PAGE + PAGE;
+    REQUIRE(blocker + PAGE < (uintptr_t)brk + SBRK_CHUNK);
+    void *mapped = mmap((void *)blocker, PAGE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+    REQUIRE(mapped == (void *)blocker);
+
+    char *block = (char *)smalloc(request);
+    char *after = (char *)sbrk(0);
+    munmap(mapped, PAGE);
+    REQUIRE(block != nullptr);
+    REQUIRE(block + request == after);
+    REQUIRE(after < brk + SBRK_CHUNK);
+}
@@ -0,0 +1,85 @@
+#include "my_stdlib.h"
+#include "malloc_engine.h"
+#include <catch2/catch_test_macros.hpp>
+
+#include <cstdlib>
+#include <cstring>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Every engine linked into one binary through malloc_dispatch.cpp; each test
+// runs in a fresh process and picks its own.
+
+static void exercise_engine()
+{
+    char *a = (char *)smalloc(100);
+    REQUIRE(a != nullptr);
+    memset(a, 1, 100);
+    char *b = (char *)scalloc(10, 10);
+    REQUIRE(b != nullptr);
+    for (int i = 0; i < 100; i++)
+    {
+        REQUIRE(b[i] == 0);
+    }
+    char *c = (char *)srealloc(a, 3000);
+    REQUIRE(c != nullptr);
+    REQUIRE(c[99] == 1);
+    sfree(b);
+    sfree(c);
+    REQUIRE(_num_allocated_blocks() > 0);
+}
+
+TEST_CASE("The first engine is the default", "[dispatch]")
+{
+    unsetenv("SMALLOC_ENGINE");
+    REQUIRE(_size_meta_data() == malloc_engine_buddy.size_meta_data());
+    REQUIRE(strcmp(smalloc_engine_name(), "buddy") == 0);
+    exercise_engine();
+    // The choice is made for good.
+    REQUIRE(smalloc_select_engine("tlsf") == -1);
+    REQUIRE(smalloc_select_engine("buddy") == 0);
+}
+
+TEST_CASE("Engines are chosen by name", "[dispatch]")
+{
+    REQUIRE(smalloc_select_engine("slab") == -1);
+    REQUIRE(smalloc_select_engine("tlsf") == 0);
+    REQUIRE(strcmp(smalloc_engine_name(), "tlsf") == 0);
+    exercise_engine();
+    REQUIRE(_size_meta_data() == 16);
+    // Only the chosen engine holds any memory.
+    REQUIRE(malloc_engine_buddy.num_allocated_blocks() == 0);
+    REQUIRE(malloc_engine_bestfit.num_allocated_blocks() == 0);
+}
+
+TEST_CASE("SMALLOC_ENGINE picks the engine", "[dispatch]")
+{
+    setenv("SMALLOC_ENGINE", "firstfit", 1);
+    exercise_engine();
+    REQUIRE(strcmp(smalloc_engine_name(), "firstfit") == 0);
+    REQUIRE(_num_allocated_blocks() == malloc_engine_firstfit.num_allocated_blocks());
+}
+
+TEST_CASE("Every engine works behind the dispatch", "[dispatch]")
+{
+    const char *names[] = {"buddy", "tlsf", "bestfit", "firstfit", "lockfree"};
+    for (const char *name : names)
+    {
+        // The first allocation settles the engine, so each runs in a child.
+        pid_t pid = fork();
+        REQUIRE(pid >= 0);
+        if (pid == 0)
+        {
+            bool ok = smalloc_select_engine(name) == 0;
+            void *p = smalloc(1000);
+            ok &= p != nullptr && strcmp(smalloc_engine_name(), name) == 0;
+            sfree(p);
+            _exit(ok ? 0 : 1);
+        }
+        int status = 0;
+        waitpid(pid, &status, 0);
+        INFO(name);
+        REQUIRE(WIFEXITED(status));
+        REQUIRE(WEXITSTATUS(status) == 0);
+    }
+}
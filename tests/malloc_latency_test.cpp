@@ -0,0 +1,65 @@
+#include "my_stdlib.h"
+#include "malloc_latency.h"
+#include <catch2/catch_test_macros.hpp>
+
+#include <cstdint>
+
+static uint64_t count_of(int op, int slot)
+{
+    LatencySummary summaries[LAT_NUM_OPS * LAT_NUM_SLOTS];
+    size_t found = smalloc_latency_collect(summaries, LAT_NUM_OPS * LAT_NUM_SLOTS);
+    for (size_t i = 0; i < found; i++)
+    {
+        if (summaries[i].op == op && summaries[i].slot == slot)
+        {
+            return summaries[i].count;
+        }
+    }
+    return 0;
+}
+
+TEST_CASE("Bucket boundaries", "[latency]")
+{
+    for (uint64_t value = 0; value < 100000; value++)
+    {
+        int bucket = latency_bucket(value);
+        REQUIRE(latency_bucket_floor(bucket) <= value);
+        REQUIRE(latency_bucket_floor(bucket + 1) > value);
+    }
+    REQUIRE(latency_bucket(~0ull) == LAT_NUM_BUCKETS - 1);
+}
+
+TEST_CASE("Paths by outcome", "[latency]")
+{
+    smalloc_latency_reset();
+
+    // The first block splits an order-10 block all the way down.
+    void *a = smalloc(10);
+    REQUIRE(count_of(LAT_MALLOC, 10) == 1);
+
+    // Its buddy is left on the order-0 list.
+    void *b = smalloc(10);
+    REQUIRE(count_of(LAT_MALLOC, 0) == 1);
+
+    sfree(b);
+    REQUIRE(count_of(LAT_FREE, 0) == 1);
+    sfree(a);
+    REQUIRE(count_of(LAT_FREE, 10) == 1);
+
+    void *large = smalloc(200000);
+    sfree(large);
+    REQUIRE(count_of(LAT_MALLOC, LAT_SLOT_MMAP) == 1);
+    REQUIRE(count_of(LAT_FREE, LAT_SLOT_MMAP) == 1);
+
+    // Nested smalloc/sfree calls are attributed to the outer operation only.
+    void *c = scalloc(1, 10);
+    void *d = srealloc(c, 1000);
+    REQUIRE(d != nullptr);
+    REQUIRE(count_of(LAT_CALLOC, 10) == 1);
+    REQUIRE(count_of(LAT_MALLOC, 10) == 1);
+    REQUIRE(count_of(LAT_FREE, 0) == 1);
+    sfree(d);
+
+    smalloc_latency_reset();
+    REQUIRE(count_of(LAT_MALLOC, 10) == 0);
+}
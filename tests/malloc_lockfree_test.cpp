@@ -0,0 +1,115 @@
+#include "my_stdlib.h"
+#include "smalloc_ext.h"
+#include "thread_churn.h"
+#include <catch2/catch_test_macros.hpp>
+
+#include <cstdint>
+#include <cstring>
+
+// The lock-free buddy engine (malloc_lockfree.cpp): 4 MB superchunks of
+// 128 KB buddy trees, no block headers.
+
+#define MAX_ELEMENT_SIZE (128 * 1024)
+#define CHUNK_SIZE (4 * 1024 * 1024)
+
+TEST_CASE("Lock-free split and merge", "[lockfree]")
+{
+    REQUIRE(_size_meta_data() == 0);
+    char *a = (char *)smalloc(100);
+    REQUIRE(a != nullptr);
+    REQUIRE((uintptr_t)a % 128 == 0);
+    // 31 untouched trees, the free halves of orders 0 to 9, and a.
+    REQUIRE(_num_allocated_blocks() == 31 + 10 + 1);
+    REQUIRE(_num_free_blocks() == 31 + 10);
+    REQUIRE(_num_free_bytes() == CHUNK_SIZE - 128);
+    REQUIRE(_num_allocated_bytes() == CHUNK_SIZE);
+
+    // The buddy comes next, then the order-1 block after them.
+    char *b = (char *)smalloc(128);
+    char *c = (char *)smalloc(200);
+    REQUIRE(b == a + 128);
+    REQUIRE(c == a + 256);
+
+    sfree(a);
+    sfree(b);
+    sfree(c);
+    REQUIRE(_num_free_blocks() == 32);
+    REQUIRE(_num_free_bytes() == CHUNK_SIZE);
+
+    // Double frees are ignored.
+    sfree(c);
+    REQUIRE(_num_free_blocks() == 32);
+}
+
+TEST_CASE("Lock-free whole trees and growth", "[lockfree]")
+{
+    static void *blocks[33];
+    for (void *&block : blocks)
+    {
+        block = smalloc(MAX_ELEMENT_SIZE);
+        REQUIRE(block != nullptr);
+        memset(block, 1, MAX_ELEMENT_SIZE);
+    }
+    // The 33rd tree comes from a second superchunk.
+    REQUIRE(_num_allocated_bytes() == 2 * CHUNK_SIZE);
+    REQUIRE(_num_allocated_blocks() == 64);
+    REQUIRE(_num_free_blocks() == 31);
+    for (void *block : blocks)
+    {
+        sfree(block);
+    }
+    REQUIRE(_num_free_blocks() == 64);
+}
+
+TEST_CASE("Lock-free scalloc, srealloc and mmap", "[lockfree]")
+{
+    char *a = (char *)smalloc(100);
+    memset(a, 0xff, 100);
+    sfree(a);
+    char *b = (char *)scalloc(10, 10);
+    REQUIRE(b == a);
+    for (int i = 0; i < 100; i++)
+    {
+        REQUIRE(b[i] == 0);
+    }
+    // The product wraps to 16 bytes.
+    REQUIRE(scalloc(SIZE_MAX / 16 + 2, 16) == nullptr);
+
+    // Growing within the block keeps it in place.
+    REQUIRE(srealloc(b, 128) == b);
+    for (int i = 0; i < 100; i++)
+    {
+        b[i] = (char)i;
+    }
+    char *c = (char *)srealloc(b, 1000);
+    REQUIRE(c != b);
+    for (int i = 0; i < 100; i++)
+    {
+        REQUIRE(c[i] == (char)i);
+    }
+
+    char *large = (char *)srealloc(c, MAX_ELEMENT_SIZE + 1);
+    REQUIRE(large != nullptr);
+    REQUIRE(large[99] == 99);
+    heap_stats stats;
+    smalloc_stats(&stats);
+    REQUIRE(stats.mmap_blocks == 1);
+    REQUIRE(stats.mmap_bytes == MAX_ELEMENT_SIZE + 1 + 16);
+    sfree(large);
+    smalloc_stats(&stats);
+    REQUIRE(stats.mmap_blocks == 0);
+    REQUIRE(stats.munmap_calls == 1);
+    REQUIRE(_num_free_blocks() == 32);
+
+    REQUIRE(smalloc(0) == nullptr);
+    REQUIRE(smalloc(100000001) == nullptr);
+}
+
+TEST_CASE("Lock-free threads", "[lockfree]")
+{
+    churn_threads(20000);
+
+    // Everything merged back into whole trees.
+    REQUIRE(_num_free_blocks() == _num_allocated_blocks());
+    REQUIRE(_num_free_blocks() * MAX_ELEMENT_SIZE == _num_allocated_bytes());
+}
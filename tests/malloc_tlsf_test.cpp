@@ -0,0 +1,163 @@
+#include "my_stdlib.h"
+#include <catch2/catch_test_macros.hpp>
+
+#include <cstdint>
+#include <cstring>
+
+// The two-level segregated fit engine (malloc_tlsf.cpp): 16-byte rounding,
+// immediate coalescing, an sbrk pool grown 256 KB at a time.
+
+#define POOL_GROWTH (256 * 1024)
+#define HEADER 16
+#define FIRST_BLOCK (POOL_GROWTH - 2 * HEADER)
+
+TEST_CASE("TLSF rounds to 16 bytes", "[tlsf]")
+{
+    REQUIRE(_size_meta_data() == HEADER);
+    char *a = (char *)smalloc(129);
+    REQUIRE(a != nullptr);
+    REQUIRE((uintptr_t)a % 16 == 0);
+    // a takes 144 bytes, the rest of the first area stays one free block.
+    REQUIRE(_num_allocated_blocks() == 2);
+    REQUIRE(_num_free_blocks() == 1);
+    REQUIRE(_num_free_bytes() == FIRST_BLOCK - 144 - HEADER);
+    REQUIRE(_num_allocated_bytes() == FIRST_BLOCK - HEADER);
+    REQUIRE(_num_meta_data_bytes() == 2 * HEADER);
+
+    char *b = (char *)smalloc(1);
+    REQUIRE(b == a + 144 + HEADER);
+
+    REQUIRE(smalloc(0) == nullptr);
+    REQUIRE(smalloc(100000001) == nullptr);
+    // The product wraps to 16 bytes.
+    REQUIRE(scalloc(SIZE_MAX / 16 + 2, 16) == nullptr);
+}
+
+TEST_CASE("TLSF coalesces immediately", "[tlsf]")
+{
+    char *a = (char *)smalloc(100);
+    char *b = (char *)smalloc(100);
+    char *c = (char *)smalloc(100);
+    REQUIRE(_num_free_blocks() == 1);
+
+    sfree(a);
+    sfree(c);
+    // c merged with the free rest of the area, a has no free neighbour.
+    REQUIRE(_num_free_blocks() == 2);
+    REQUIRE(_num_allocated_blocks() == 3);
+
+    sfree(b);
+    REQUIRE(_num_free_blocks() == 1);
+    REQUIRE(_num_allocated_blocks() == 1);
+    REQUIRE(_num_free_bytes() == FIRST_BLOCK);
+
+    // Double frees are ignored.
+    sfree(b);
+    REQUIRE(_num_free_blocks() == 1);
+    REQUIRE(_num_free_bytes() == FIRST_BLOCK);
+}
+
+TEST_CASE("TLSF reuses the freed class", "[tlsf]")
+{
+    char *a = (char *)smalloc(200);
+    char *guard = (char *)smalloc(16);
+    REQUIRE(guard != nullptr);
+    sfree(a);
+
+    // Any request rounding to the same 208 bytes takes the hole back.
+    REQUIRE(smalloc(193) == a);
+    sfree(a);
+
+    // A smaller one splits it when the rest can stand as a block.
+    REQUIRE(smalloc(64) == a);
+    REQUIRE(_num_free_blocks() == 2);
+    REQUIRE(smalloc(120) == a + 64 + HEADER);
+    REQUIRE(_num_free_blocks() == 1);
+}
+
+TEST_CASE("TLSF srealloc", "[tlsf]")
+{
+    char *a = (char *)smalloc(100);
+    for (int i = 0; i < 100; i++)
+    {
+        a[i] = (char)i;
+    }
+
+    // Grows into the free block above.
+    REQUIRE(srealloc(a, 1000) == a);
+    REQUIRE(_num_allocated_bytes() == FIRST_BLOCK - HEADER);
+
+    // Shrinks in place, giving the tail back.
+    REQUIRE(srealloc(a, 100) == a);
+    char *b = (char *)smalloc(100);
+    REQUIRE(b == a + 112 + HEADER);
+
+    // With b in the way it has to move.
+    char *c = (char *)srealloc(a, 1000);
+    REQUIRE(c != a);
+    for (int i = 0; i < 100; i++)
+    {
+        REQUIRE(c[i] == (char)i);
+    }
+    REQUIRE(srealloc(c, 0) == nullptr);
+    REQUIRE(srealloc(c, 100000001) == nullptr);
+    sfree(c);
+    sfree(b);
+    REQUIRE(_num_free_blocks() == 1);
+}
+
+TEST_CASE("TLSF maps large blocks", "[tlsf]")
+{
+    char *a = (char *)smalloc(128 * 1024);
+    REQUIRE(a != nullptr);
+    memset(a, 1, 128 * 1024);
+    REQUIRE(_num_allocated_blocks() == 1);
+    REQUIRE(_num_allocated_bytes() == 128 * 1024);
+    REQUIRE(_num_free_blocks() == 0);
+
+    char *b = (char *)srealloc(a, 200 * 1024);
+    REQUIRE(b != nullptr);
+    REQUIRE(b[128 * 1024 - 1] == 1);
+    sfree(b);
+    REQUIRE(_num_allocated_blocks() == 0);
+    REQUIRE(_num_allocated_bytes() == 0);
+}
+
+TEST_CASE("TLSF pool growth and churn", "[tlsf]")
+{
+    constexpr int slots = 256;
+    static unsigned char *blocks[slots];
+    static size_t sizes[slots];
+    unsigned state = 1;
+    for (int i = 0; i < 20000; i++)
+    {
+        state = state * 1103515245 + 12345;
+        int slot = (state >> 8) % slots;
+        if (blocks[slot])
+        {
+            for (size_t j = 0; j < sizes[slot]; j++)
+            {
+                REQUIRE(blocks[slot][j] == (unsigned char)slot);
+            }
+            sfree(blocks[slot]);
+            blocks[slot] = nullptr;
+        }
+        else
+        {
+            // Up to 64 KB, so the pool grows more than once.
+            sizes[slot] = 1 + (state >> 12) % (64 * 1024);
+            blocks[slot] = (unsigned char *)smalloc(sizes[slot]);
+            REQUIRE(blocks[slot] != nullptr);
+            memset(blocks[slot], slot, sizes[slot]);
+        }
+    }
+    REQUIRE(_num_allocated_bytes() > POOL_GROWTH);
+    for (unsigned char *block : blocks)
+    {
+        sfree(block);
+    }
+
+    // Every area merged back into a single free block.
+    REQUIRE(_num_free_blocks() == _num_allocated_blocks());
+    REQUIRE(_num_free_bytes() == _num_allocated_bytes());
+}
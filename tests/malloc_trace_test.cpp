@@ -0,0 +1,213 @@
+#include "my_stdlib.h"
+#include "malloc_trace.h"
+#include <catch2/catch_test_macros.hpp>
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// A fresh file per test, so concurrent runs keep to their own.
+static std::string trace_path()
+{
+    char path[] = "/tmp/malloc_trace_test.XXXXXX";
+    int fd = mkstemp(path);
+    REQUIRE(fd >= 0);
+    close(fd);
+    return path;
+}
+
+std::vector<TraceEvent> read_trace(const char *path)
+{
+    std::ifstream file(path, std::ios::binary);
+    REQUIRE(file.is_open());
+    std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    REQUIRE(data.size() >= sizeof(TRACE_MAGIC) + 1);
+    REQUIRE(data[sizeof(TRACE_MAGIC)] == TRACE_VERSION);
+
+    std::vector<TraceEvent> events;
+    const uint8_t *in = data.data() + sizeof(TRACE_MAGIC) + 1;
+    const uint8_t *end = data.data() + data.size();
+    while (in < end)
+    {
+        REQUIRE(*in++ == TRACE_CHUNK);
+        uint64_t thread = 0, base_ns = 0, len = 0;
+        in = trace_get_varint(in, end, &thread);
+        REQUIRE(in != nullptr);
+        in = trace_get_varint(in, end, &base_ns);
+        REQUIRE(in != nullptr);
+        in = trace_get_varint(in, end, &len);
+        REQUIRE(in != nullptr);
+
+        TraceEvent event;
+        event.time_ns = base_ns;
+        const uint8_t *chunk_end = in + len;
+        while (in < chunk_end)
+        {
+            in = trace_decode_event(in, chunk_end, &event);
+            REQUIRE(in != nullptr);
+            event.thread = thread;
+            events.push_back(event);
+        }
+    }
+    return events;
+}
+
+TEST_CASE("Varint round trip", "[trace]")
+{
+    uint8_t buffer[16];
+    uint64_t values[] = {0, 1, 127, 128, 300, 1ull << 35, ~0ull};
+    for (uint64_t value : values)
+    {
+        uint8_t *end = trace_put_varint(buffer, value);
+        uint64_t decoded = 0;
+        REQUIRE(trace_get_varint(buffer, end, &decoded) == end);
+        REQUIRE(decoded == value);
+        REQUIRE(trace_get_varint(buffer, end - 1, &decoded) == nullptr);
+    }
+}
+
+TEST_CASE("Record basic operations", "[trace]")
+{
+    std::string path = trace_path();
+    REQUIRE(smalloc_trace_start(path.c_str()) == 0);
+
+    void *a = smalloc(100);
+    void *b = scalloc(4, 25);
+    void *c = srealloc(a, 1000);
+    sfree(b);
+    sfree(c);
+    void *d = smalloc(10);
+    sfree(d);
+
+    smalloc_trace_stop();
+    std::vector<TraceEvent> events = read_trace(path.c_str());
+    unlink(path.c_str());
+
+    // srealloc and scalloc call into smalloc/sfree; those must not show up.
+    REQUIRE(events.size() == 7);
+    REQUIRE(events[0].op == TRACE_MALLOC);
+    REQUIRE(events[0].size == 100);
+    REQUIRE(events[1].op == TRACE_CALLOC);
+    REQUIRE(events[1].size == 100);
+    REQUIRE(events[2].op == TRACE_REALLOC);
+    REQUIRE(events[2].size == 1000);
+    REQUIRE(events[2].id == events[0].id);
+    REQUIRE(events[3].op == TRACE_FREE);
+    REQUIRE(events[3].id == events[1].id);
+    REQUIRE(events[4].op == TRACE_FREE);
+    REQUIRE(events[4].id == events[2].new_id);
+
+    REQUIRE(events[0].id != 0);
+    REQUIRE(events[0].id != events[1].id);
+    for (size_t i = 1; i < events.size(); i++)
+    {
+        REQUIRE(events[i].time_ns >= events[i - 1].time_ns);
+    }
+
+    // Freed ids are recycled, keeping the replay table dense.
+    REQUIRE(events[5].op == TRACE_MALLOC);
+    REQUIRE(events[5].id <= 2);
+    REQUIRE(events[6].id == events[5].id);
+}
+
+TEST_CASE("Unknown pointers and failures", "[trace]")
+{
+    void *before = smalloc(64);
+    std::string path = trace_path();
+    REQUIRE(smalloc_trace_start(path.c_str()) == 0);
+
+    sfree(before);
+    REQUIRE(smalloc(0) == nullptr);
+    void *a = smalloc(32);
+    REQUIRE(srealloc(a, 0) == nullptr);
+    sfree(a);
+
+    smalloc_trace_stop();
+    std::vector<TraceEvent> events = read_trace(path.c_str());
+    unlink(path.c_str());
+
+    REQUIRE(events.size() == 4);
+    REQUIRE(events[0].op == TRACE_FREE);
+    REQUIRE(events[0].id == 0);
+    REQUIRE(events[1].op == TRACE_MALLOC);
+    REQUIRE(events[2].op == TRACE_REALLOC);
+    REQUIRE(events[2].id == events[1].id);
+    REQUIRE(events[2].new_id == 0);
+    REQUIRE(events[3].op == TRACE_FREE);
+    REQUIRE(events[3].id == events[1].id);
+}
+
+TEST_CASE("Threads record at once", "[trace]")
+{
+    std::string path = trace_path();
+    REQUIRE(smalloc_trace_start(path.c_str()) == 0);
+
+    // Blocks change hands between threads, so one thread frees ids another
+    // handed out.
+    constexpr int count = 4;
+    static void *shared[count][256];
+    std::vector<std::thread> threads;
+    for (int t = 0; t < count; t++)
+    {
+        threads.emplace_back([t] {
+            void *blocks[64] = {nullptr};
+            for (int i = 0; i < 2000; i++)
+            {
+                int slot = (i * 7 + t) % 64;
+                sfree(blocks[slot]);
+                blocks[slot] = smalloc(1 + (i * 13) % 500);
+            }
+            for (int i = 0; i < 256; i++)
+            {
+                shared[t][i] = smalloc(16);
+            }
+            for (void *p : blocks)
+            {
+                sfree(p);
+            }
+        });
+    }
+    for (std::thread &thread : threads)
+    {
+        thread.join();
+    }
+    for (auto &blocks : shared)
+    {
+        for (void *p : blocks)
+        {
+            sfree(p);
+        }
+    }
+    smalloc_trace_stop();
+    std::vector<TraceEvent> events = read_trace(path.c_str());
+    unlink(path.c_str());
+
+    // Replayed in time order, every free names a live id and no id is
+    // handed out while live.
+    std::stable_sort(events.begin(), events.end(),
+                     [](const TraceEvent &a, const TraceEvent &b) { return a.time_ns < b.time_ns; });
+    std::map<uint32_t, bool> live;
+    size_t frees = 0;
+    for (const TraceEvent &event : events)
+    {
+        if (event.op == TRACE_MALLOC)
+        {
+            REQUIRE(event.id != 0);
+            REQUIRE(!live[event.id]);
+            live[event.id] = true;
+        }
+        else if (event.op == TRACE_FREE && event.id != 0)
+        {
+            REQUIRE(live[event.id]);
+            live[event.id] = false;
+            frees++;
+        }
+    }
+    REQUIRE(frees == count * (2000 + 256));
+}
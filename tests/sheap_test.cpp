@@ -0,0 +1,301 @@
+#include "sheap.h"
+#include <catch2/catch_test_macros.hpp>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Independent heap instances (sheap.cpp).
+
+static bool is_mapped(void *p)
+{
+    unsigned char resident;
+    void *page = (void *)((uintptr_t)p & ~(uintptr_t)4095);
+    return mincore(page, 4096, &resident) == 0;
+}
+
+TEST_CASE("Heaps keep their own blocks and counters", "[sheap]")
+{
+    heap_t *a = sheap_create(nullptr);
+    heap_t *b = sheap_create(nullptr);
+    REQUIRE(a != nullptr);
+    REQUIRE(b != nullptr);
+
+    char *x = (char *)sheap_malloc(a, 100);
+    REQUIRE(x != nullptr);
+    memset(x, 1, 100);
+    sheap_stats stats;
+    sheap_get_stats(b, &stats);
+    REQUIRE(stats.chunks == 0);
+    REQUIRE(stats.allocated_blocks == 0);
+
+    char *y = (char *)sheap_malloc(b, 100);
+    REQUIRE(y != nullptr);
+    sheap_get_stats(a, &stats);
+    REQUIRE(stats.chunks == 1);
+    size_t blocks = stats.allocated_blocks;
+    REQUIRE(stats.free_blocks == blocks - 1);
+    REQUIRE(stats.meta_data_bytes > 0);
+
+    sheap_free(a, x);
+    sheap_get_stats(a, &stats);
+    REQUIRE(stats.free_blocks == blocks);
+
+    char *z = (char *)sheap_calloc(b, 10, 10);
+    REQUIRE(z[99] == 0);
+    z = (char *)sheap_realloc(b, z, 1000);
+    REQUIRE(z[99] == 0);
+    REQUIRE(sheap_malloc(b, 0) == nullptr);
+
+    sheap_destroy(a);
+    sheap_destroy(b);
+    sheap_destroy(nullptr);
+}
+
+TEST_CASE("Destroy releases every chunk at once", "[sheap]")
+{
+    heap_t *heap = sheap_create(nullptr);
+    std::vector<void *> blocks;
+    for (int i = 0; i < 1000; i++)
+    {
+        blocks.push_back(sheap_malloc(heap, 10000));
+    }
+    void *mapped = sheap_malloc(heap, 1 << 20);
+    sheap_stats stats;
+    sheap_get_stats(heap, &stats);
+    REQUIRE(stats.chunks == 4);
+    REQUIRE(stats.mapped_blocks == 1);
+    for (void *p : blocks)
+    {
+        REQUIRE(is_mapped(p));
+    }
+
+    sheap_destroy(heap);
+    for (void *p : blocks)
+    {
+        REQUIRE(!is_mapped(p));
+    }
+    REQUIRE(!is_mapped(mapped));
+    REQUIRE(errno == ENOMEM);
+}
+
+TEST_CASE("Heaps are created with a layout", "[sheap]")
+{
+    sheap_config small = {SHEAP_LAYOUT_SMALL, 0};
+    sheap_config large = {SHEAP_LAYOUT_LARGE, 0};
+    heap_t *s = sheap_create(&small);
+    heap_t *l = sheap_create(&large);
+
+    // 8 KB blocks are the largest a small heap has, 4 MB a large one.
+    sheap_malloc(s, 10000);
+    sheap_malloc(l, 10000);
+    sheap_stats stats;
+    sheap_get_stats(s, &stats);
+    REQUIRE(stats.mapped_blocks == 1);
+    REQUIRE(stats.chunks == 0);
+    sheap_get_stats(l, &stats);
+    REQUIRE(stats.mapped_blocks == 0);
+    REQUIRE(stats.chunks == 1);
+    sheap_destroy(s);
+    sheap_destroy(l);
+}
+
+TEST_CASE("A heap runs over the caller's region", "[sheap]")
+{
+    alignas(4096) static char region[1 << 20];
+    sheap_config small = {SHEAP_LAYOUT_SMALL, 0};
+    char *begin = region + 3;
+    char *end = begin + 500000;
+    heap_t *heap = sheap_create_in(begin, end - begin, &small);
+    REQUIRE(heap != nullptr);
+    REQUIRE((char *)heap >= begin);
+
+    sheap_stats stats;
+    sheap_get_stats(heap, &stats);
+    REQUIRE(stats.chunks == 0);
+    size_t blocks = stats.allocated_blocks;
+    REQUIRE(stats.free_blocks == blocks);
+    REQUIRE(stats.free_bytes > 490000);
+
+    // Every block comes from the region, until it runs out.
+    std::vector<char *> taken;
+    while (char *p = (char *)sheap_malloc(heap, 1000))
+    {
+        REQUIRE(p > (char *)heap);
+        REQUIRE(p + 1000 <= end);
+        taken.push_back(p);
+    }
+    REQUIRE(taken.size() > 400);
+    REQUIRE(sheap_malloc(heap, 100000) == nullptr);
+    for (char *p : taken)
+    {
+        sheap_free(heap, p);
+    }
+    sheap_get_stats(heap, &stats);
+    REQUIRE(stats.allocated_blocks == blocks);
+    REQUIRE(stats.free_blocks == blocks);
+    REQUIRE(stats.mapped_blocks == 0);
+
+    // The region stays the caller's.
+    sheap_destroy(heap);
+    memset(region, 0, sizeof(region));
+
+    REQUIRE(sheap_create_in(region, 8) == nullptr);
+    REQUIRE(sheap_create_in(nullptr, 4096) == nullptr);
+    heap = sheap_create_in(region, sizeof(region));
+    REQUIRE(sheap_malloc(heap, 100) != nullptr);
+    sheap_destroy(heap);
+}
+
+TEST_CASE("A thread-safe heap is shared by threads", "[sheap]")
+{
+    sheap_config config = {SHEAP_LAYOUT_SMALL, 1};
+    heap_t *heap = sheap_create(&config);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++)
+    {
+        threads.emplace_back([heap, t] {
+            void *blocks[64] = {nullptr};
+            for (int i = 0; i < 4000; i++)
+            {
+                int slot = (i * 5 + t) % 64;
+                sheap_free(heap, blocks[slot]);
+                blocks[slot] = sheap_malloc(heap, 1 + (i * 31) % 3000);
+                memset(blocks[slot], t, 1);
+            }
+            for (void *p : blocks)
+            {
+                sheap_free(heap, p);
+            }
+        });
+    }
+    for (std::thread &thread : threads)
+    {
+        thread.join();
+    }
+    sheap_stats stats;
+    sheap_get_stats(heap, &stats);
+    REQUIRE(stats.free_blocks == stats.allocated_blocks);
+    sheap_destroy(heap);
+}
+
+// Runs body in a child process and returns whether it exited with 0.
+template <class Body>
+static bool in_child(Body body)
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        _exit(body() ? 0 : 1);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+TEST_CASE("Processes share a heap wherever they map it", "[sheap]")
+{
+    int fd = memfd_create("sheap_test", 0);
+    REQUIRE(fd >= 0);
+    heap_t *heap = sheap_create_shared(fd, 8 << 20);
+    REQUIRE(heap != nullptr);
+
+    char *hello = (char *)sheap_malloc(heap, 100);
+    strcpy(hello, "hello");
+    size_t hello_at = sheap_offset(heap, hello);
+    REQUIRE(sheap_pointer(heap, hello_at) == hello);
+
+    // The child maps the heap a second time, at another address, and works
+    // through that mapping only.
+    char *reply = (char *)sheap_malloc(heap, 8);
+    size_t reply_at = sheap_offset(heap, reply);
+    REQUIRE(in_child([&] {
+        heap_t *mine = sheap_attach_shared(fd);
+        if (mine == nullptr || mine == heap)
+        {
+            return false;
+        }
+        bool ok = strcmp((char *)sheap_pointer(mine, hello_at), "hello") == 0;
+        sheap_free(mine, sheap_pointer(mine, hello_at));
+        char *text = (char *)sheap_malloc(mine, 3000);
+        strcpy(text, "from the child");
+        size_t text_at = sheap_offset(mine, text);
+        memcpy(sheap_pointer(mine, reply_at), &text_at, sizeof(text_at));
+        sheap_detach_shared(mine);
+        return ok;
+    }));
+
+    size_t text_at;
+    memcpy(&text_at, reply, sizeof(text_at));
+    REQUIRE(strcmp((char *)sheap_pointer(heap, text_at), "from the child") == 0);
+    sheap_stats stats;
+    sheap_get_stats(heap, &stats);
+    REQUIRE(stats.free_blocks == stats.allocated_blocks - 2);
+    sheap_free(heap, reply);
+    sheap_free(heap, sheap_pointer(heap, text_at));
+    sheap_get_stats(heap, &stats);
+    REQUIRE(stats.free_blocks == stats.allocated_blocks);
+
+    sheap_destroy(heap);
+    REQUIRE(sheap_attach_shared(fd) == nullptr);
+    close(fd);
+}
+
+TEST_CASE("Processes allocate from a shared heap at once", "[sheap]")
+{
+    int fd = memfd_create("sheap_test", 0);
+    sheap_config small = {SHEAP_LAYOUT_SMALL, 0};
+    heap_t *heap = sheap_create_shared(fd, 4 << 20, &small);
+    REQUIRE(heap != nullptr);
+
+    pid_t children[3];
+    for (int c = 0; c < 3; c++)
+    {
+        children[c] = fork();
+        if (children[c] == 0)
+        {
+            heap_t *mine = sheap_attach_shared(fd);
+            void *blocks[64] = {nullptr};
+            for (int i = 0; i < 5000; i++)
+            {
+                int slot = (i * 5 + c) % 64;
+                sheap_free(mine, blocks[slot]);
+                blocks[slot] = sheap_malloc(mine, 1 + (i * 31) % 3000);
+                if (blocks[slot] == nullptr)
+                {
+                    _exit(1);
+                }
+                memset(blocks[slot], c, 1);
+            }
+            for (void *p : blocks)
+            {
+                sheap_free(mine, p);
+            }
+            _exit(0);
+        }
+    }
+    for (pid_t child : children)
+    {
+        int status = 0;
+        waitpid(child, &status, 0);
+        REQUIRE(WIFEXITED(status));
+        REQUIRE(WEXITSTATUS(status) == 0);
+    }
+    sheap_stats stats;
+    sheap_get_stats(heap, &stats);
+    REQUIRE(stats.free_blocks == stats.allocated_blocks);
+    REQUIRE(stats.chunks == 0);
+    sheap_destroy(heap);
+
+    // Nothing to attach to in a file without a heap.
+    int empty = memfd_create("sheap_test", 0);
+    REQUIRE(ftruncate(empty, 4096) == 0);
+    REQUIRE(sheap_attach_shared(empty) == nullptr);
+    close(empty);
+    close(fd);
+}
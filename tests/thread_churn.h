@@ -0,0 +1,79 @@
+#ifndef THREAD_CHURN_H
+#define THREAD_CHURN_H
+
+#include "my_stdlib.h"
+#include <catch2/catch_test_macros.hpp>
+
+#include <cstdint>
+#include <cstring>
+#include <pthread.h>
+
+// Many threads allocating and freeing at once, each filling its blocks with
+// its own tag and checking them before it frees them. The engine-specific
+// checks of what is left afterwards stay with each test.
+
+struct ChurnThread {
+    pthread_t thread;
+    unsigned char tag;
+    size_t max_size;
+    bool ok;
+};
+
+static void *churn(void *arg)
+{
+    ChurnThread &self = *static_cast<ChurnThread *>(arg);
+    unsigned state = 1 + self.tag;
+    unsigned char *blocks[16] = {nullptr};
+    size_t sizes[16] = {0};
+    bool ok = true;
+    for (int i = 0; i < 4000; i++)
+    {
+        state = state * 1103515245 + 12345;
+        int slot = (state >> 8) % 16;
+        if (blocks[slot])
+        {
+            for (size_t j = 0; j < sizes[slot]; j++)
+            {
+                ok &= blocks[slot][j] == self.tag;
+            }
+            sfree(blocks[slot]);
+            blocks[slot] = nullptr;
+        }
+        else
+        {
+            sizes[slot] = 1 + (state >> 12) % self.max_size;
+            blocks[slot] = (unsigned char *)smalloc(sizes[slot]);
+            if (!blocks[slot])
+            {
+                return nullptr;
+            }
+            memset(blocks[slot], self.tag, sizes[slot]);
+        }
+    }
+    for (unsigned char *block : blocks)
+    {
+        sfree(block);
+    }
+    self.ok = ok;
+    return nullptr;
+}
+
+// Runs 64 churning threads with blocks of 1 to max_size bytes and waits for
+// all of them.
+static void churn_threads(size_t max_size)
+{
+    constexpr int count = 64;
+    static ChurnThread threads[count];
+    for (int i = 0; i < count; i++)
+    {
+        threads[i] = {pthread_t(), static_cast<unsigned char>(i + 1), max_size, false};
+        REQUIRE(pthread_create(&threads[i].thread, nullptr, churn, &threads[i]) == 0);
+    }
+    for (ChurnThread &thread : threads)
+    {
+        pthread_join(thread.thread, nullptr);
+        REQUIRE(thread.ok);
+    }
+}
+
+#endif /* THREAD_CHURN_H */
@@ -0,0 +1,202 @@
+#ifndef BUDDY_MODEL_H
+#define BUDDY_MODEL_H
+
+#include "trace_reader.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <set>
+#include <vector>
+
+// Offline model of the malloc_3 buddy engine. It replays a recorded trace
+// against the engine's metadata only -- block offsets, orders and free lists --
+// so configurations can be compared without touching any user memory.
+//
+// Deviations from malloc_3 worth knowing when reading the numbers:
+//  * the heap grows by another chunk when every free list is empty instead of
+//    failing, so peak footprint is comparable across configurations;
+//  * srealloc keeps the block when the new size fits, otherwise it is modeled
+//    as allocate + free (no in-place buddy absorption).
+
+struct SimConfig {
+    int min_block_log2;
+    int max_order;
+    size_t chunk_size;
+};
+
+struct SimResult {
+    SimConfig config;
+    size_t peak_footprint = 0;
+    size_t peak_requested = 0;
+    size_t internal_waste = 0;  // granted - requested, summed over all allocations
+    size_t granted = 0;
+    size_t splits = 0;
+    size_t merges = 0;
+    size_t list_ops = 0;
+    size_t list_steps = 0;  // list_ops weighted by the length of the list walked
+    size_t syscalls = 0;
+    double cost = 0;
+};
+
+// Relative cost of the modeled operations. A free-list insert/remove in
+// malloc_3 walks an address-ordered list, so one step of that walk is the
+// unit; a syscall costs roughly a few thousand list steps.
+constexpr double LIST_STEP_COST = 1.0;
+constexpr double SPLIT_MERGE_COST = 2.0;
+constexpr double SYSCALL_COST = 2000.0;
+constexpr size_t PAGE_SIZE = 4096;
+
+struct LiveBlock {
+    uint64_t offset = 0;
+    size_t requested = 0;
+    size_t mapped = 0;  // non-zero for blocks served by mmap
+    int order = -1;
+};
+
+class BuddyModel {
+public:
+    BuddyModel(const SimConfig &config, size_t metadata_size)
+        : config_(config), metadata_size_(metadata_size), free_lists_(config.max_order + 1) {}
+
+    size_t block_size(int order) const { return (size_t(1) << config_.min_block_log2) << order; }
+
+    void run(const std::vector<TraceRecord> &ops, uint32_t max_id, SimResult &result) {
+        std::vector<LiveBlock> live(max_id + 1);
+        for (const TraceRecord &op : ops) {
+            switch (op.op) {
+                case TRACE_MALLOC:
+                case TRACE_CALLOC:
+                    if (op.id) {
+                        release(live[op.id], result);
+                        live[op.id] = acquire(op.size, result);
+                    }
+                    break;
+                case TRACE_FREE:
+                    if (op.id) release(live[op.id], result);
+                    break;
+                case TRACE_REALLOC: {
+                    if (!op.new_id) break;  // failed srealloc, the old block stays
+                    LiveBlock &old = live[op.id];
+                    LiveBlock moved = old;
+                    bool fits = old.order >= 0 ? op.size + metadata_size_ <= block_size(old.order) :
+                                old.mapped && op.size == old.requested;
+                    if (op.id && fits) {
+                        account_requested(moved, op.size);
+                    } else {
+                        moved = acquire(op.size, result);
+                        if (op.id) release(old, result);
+                    }
+                    old = LiveBlock();
+                    live[op.new_id] = moved;
+                    break;
+                }
+            }
+
+            result.peak_footprint = std::max(result.peak_footprint, heap_size_ + mapped_bytes_);
+            result.peak_requested = std::max(result.peak_requested, live_requested_);
+        }
+        result.cost = LIST_STEP_COST * result.list_steps +
+                      SPLIT_MERGE_COST * (result.splits + result.merges) + SYSCALL_COST * result.syscalls;
+    }
+
+private:
+    void account_requested(LiveBlock &block, size_t size) {
+        live_requested_ += size - block.requested;
+        block.requested = size;
+    }
+
+    LiveBlock acquire(size_t size, SimResult &result) {
+        LiveBlock block;
+        if (size == 0) return block;
+
+        if (size + metadata_size_ > block_size(config_.max_order)) {
+            block.mapped = (size + metadata_size_ + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+            mapped_bytes_ += block.mapped;
+            result.syscalls++;
+            result.granted += block.mapped;
+            result.internal_waste += block.mapped - size;
+            account_requested(block, size);
+            return block;
+        }
+
+        int order = 0;
+        while (block_size(order) < size + metadata_size_) order++;
+
+        int from = order;
+        while (from <= config_.max_order && free_lists_[from].empty()) from++;
+        if (from > config_.max_order) {
+            grow(result);
+            from = config_.max_order;
+        }
+
+        uint64_t offset = *free_lists_[from].begin();
+        list_erase(from, free_lists_[from].begin(), result);
+        while (from > order) {
+            from--;
+            list_insert(from, offset + block_size(from), result);
+            result.splits++;
+        }
+
+        block.offset = offset;
+        block.order = order;
+        result.granted += block_size(order);
+        result.internal_waste += block_size(order) - size;
+        account_requested(block, size);
+        return block;
+    }
+
+    void release(LiveBlock &block, SimResult &result) {
+        if (block.mapped) {
+            mapped_bytes_ -= block.mapped;
+            result.syscalls++;
+        } else if (block.order >= 0) {
+            uint64_t offset = block.offset;
+            int order = block.order;
+            while (order < config_.max_order) {
+                auto buddy = free_lists_[order].find(offset ^ block_size(order));
+                if (buddy == free_lists_[order].end()) break;
+                list_erase(order, buddy, result);
+                result.merges++;
+                offset &= ~static_cast<uint64_t>(block_size(order));
+                order++;
+            }
+            list_insert(order, offset, result);
+        } else {
+            return;
+        }
+        live_requested_ -= block.requested;
+        block = LiveBlock();
+    }
+
+    // malloc_3 walks the address-ordered list for both; charge the whole list,
+    // counting the block itself.
+    void list_insert(int order, uint64_t offset, SimResult &result) {
+        free_lists_[order].insert(offset);
+        result.list_ops++;
+        result.list_steps += free_lists_[order].size();
+    }
+
+    void list_erase(int order, std::set<uint64_t>::iterator block, SimResult &result) {
+        result.list_ops++;
+        result.list_steps += free_lists_[order].size();
+        free_lists_[order].erase(block);
+    }
+
+    void grow(SimResult &result) {
+        size_t top = block_size(config_.max_order);
+        for (size_t offset = 0; offset < config_.chunk_size; offset += top) {
+            free_lists_[config_.max_order].insert(heap_size_ + offset);
+        }
+        heap_size_ += config_.chunk_size;
+        result.syscalls++;
+    }
+
+    SimConfig config_;
+    size_t metadata_size_;
+    std::vector<std::set<uint64_t>> free_lists_;
+    size_t heap_size_ = 0;
+    size_t mapped_bytes_ = 0;
+    size_t live_requested_ = 0;
+};
+
+#endif /* BUDDY_MODEL_H */
@@ -0,0 +1,84 @@
+#include "buddy_model.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <string>
+#include <thread>
+
+std::vector<SimConfig> sweep_configs() {
+    std::vector<SimConfig> configs;
+    for (int min_log2 = 5; min_log2 <= 9; min_log2++) {
+        for (int max_order = 6; max_order <= 14; max_order++) {
+            size_t top = (size_t(1) << min_log2) << max_order;
+            if (top < 4096 || top > (size_t(64) << 20)) continue;
+            for (size_t blocks : {1, 8, 32}) {
+                configs.push_back({min_log2, max_order, top * blocks});
+            }
+        }
+    }
+    return configs;
+}
+
+double ratio(size_t part, size_t whole) { return whole ? 100.0 * part / whole : 0.0; }
+
+int main(int argc, char **argv) {
+    const char *path = nullptr;
+    size_t metadata_size = 64;
+    size_t top = 20;
+    unsigned threads = std::thread::hardware_concurrency();
+    std::string sort_key = "footprint";
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--meta" && i + 1 < argc) metadata_size = std::strtoul(argv[++i], nullptr, 10);
+        else if (arg == "--top" && i + 1 < argc) top = std::strtoul(argv[++i], nullptr, 10);
+        else if (arg == "--threads" && i + 1 < argc) threads = std::strtoul(argv[++i], nullptr, 10);
+        else if (arg == "--sort" && i + 1 < argc) sort_key = argv[++i];
+        else if (!path && arg[0] != '-') path = argv[i];
+        else path = nullptr, i = argc;
+    }
+    if (!path || (sort_key != "footprint" && sort_key != "frag" && sort_key != "cost")) {
+        std::fprintf(stderr, "usage: %s <trace> [--meta bytes] [--top n] [--threads n] [--sort footprint|frag|cost]\n",
+                     argv[0]);
+        return 2;
+    }
+
+    std::vector<TraceRecord> ops;
+    uint32_t max_id = 0;
+    if (!load_trace(path, ops, max_id)) return 1;
+
+    std::vector<SimConfig> configs = sweep_configs();
+    std::vector<SimResult> results(configs.size());
+    std::atomic<size_t> next{0};
+    auto worker = [&]() {
+        for (size_t i = next++; i < configs.size(); i = next++) {
+            results[i].config = configs[i];
+            BuddyModel(configs[i], metadata_size).run(ops, max_id, results[i]);
+        }
+    };
+    std::vector<std::thread> pool;
+    for (unsigned i = 1; i < std::max(threads, 1u); i++) pool.emplace_back(worker);
+    worker();
+    for (std::thread &thread : pool) thread.join();
+
+    auto frag = [](const SimResult &r) { return r.granted ? double(r.internal_waste) / r.granted : 0.0; };
+    std::sort(results.begin(), results.end(), [&](const SimResult &a, const SimResult &b) {
+        if (sort_key == "frag" && frag(a) != frag(b)) return frag(a) < frag(b);
+        if (sort_key == "cost" && a.cost != b.cost) return a.cost < b.cost;
+        if (a.peak_footprint != b.peak_footprint) return a.peak_footprint < b.peak_footprint;
+        if (frag(a) != frag(b)) return frag(a) < frag(b);
+        return a.cost < b.cost;
+    });
+
+    std::printf("%zu ops, %zu configurations, sorted by %s\n\n", ops.size(), results.size(), sort_key.c_str());
+    std::printf("%6s %9s %11s %14s %9s %9s %10s %10s %14s\n", "block", "max_order", "chunk", "peak", "overhead",
+                "int_frag", "splits", "merges", "cost");
+    for (size_t i = 0; i < results.size() && i < top; i++) {
+        const SimResult &r = results[i];
+        std::printf("%6zu %9d %11zu %14zu %8.2f%% %8.2f%% %10zu %10zu %14.0f\n", size_t(1) << r.config.min_block_log2,
+                    r.config.max_order, r.config.chunk_size, r.peak_footprint,
+                    ratio(r.peak_footprint - r.peak_requested, r.peak_footprint), 100.0 * frag(r), r.splits, r.merges,
+                    r.cost);
+    }
+    return 0;
+}
@@ -0,0 +1,210 @@
+#include "my_stdlib.h"
+#include "perf_counters.h"
+
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <sys/wait.h>
+#include <vector>
+
+// Synthetic allocator benchmark. Every phase runs in its own forked child so
+// it starts on a fresh heap, and is measured with wall-clock time plus the
+// hardware counters perf_event_open lets us read. Results are per operation,
+// where an operation is one smalloc/scalloc/srealloc/sfree call. The footprint
+// column is the heap the engine holds (blocks plus metadata) when the phase
+// ends.
+//
+// Phases are sized to fit in malloc_3's fixed 4 MB buddy region.
+
+struct PhaseResult {
+    uint64_t ops = 0;
+    double seconds = 0;
+    size_t footprint = 0;
+    PerfSample counters;
+};
+
+struct Phase {
+    const char *name;
+    uint64_t (*run)();
+};
+
+uint64_t next_random(uint64_t &state) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+uint64_t phase_fixed() {
+    constexpr int count = 8192;
+    static void *blocks[count];
+    for (int round = 0; round < 4; round++) {
+        for (void *&block : blocks) block = smalloc(64);
+        for (void *block : blocks) sfree(block);
+    }
+    return 4 * 2 * count;
+}
+
+uint64_t phase_mixed() {
+    constexpr int slots = 2048;
+    constexpr int iterations = 200000;
+    static void *blocks[slots];
+    uint64_t state = 0x9E3779B97F4A7C15ull;
+    for (int i = 0; i < iterations; i++) {
+        uint64_t r = next_random(state);
+        void *&block = blocks[r % slots];
+        if (block) {
+            sfree(block);
+            block = nullptr;
+        } else {
+            // Log-uniform between 16 bytes and 2 KB.
+            size_t size = size_t(16) << ((r >> 16) % 8);
+            block = smalloc(size + (r >> 32) % size);
+        }
+    }
+    for (void *block : blocks) sfree(block);
+    return iterations + slots;
+}
+
+uint64_t phase_realloc() {
+    constexpr int count = 64;
+    static void *blocks[count];
+    uint64_t ops = 0;
+    for (size_t size = 16; size <= 16000; size *= 2) {
+        for (void *&block : blocks) {
+            void *grown = srealloc(block, size);
+            if (grown) block = grown;
+            ops++;
+        }
+    }
+    for (void *block : blocks) sfree(block);
+    return ops + count;
+}
+
+uint64_t phase_calloc() {
+    constexpr int count = 4096;
+    static void *blocks[count];
+    for (void *&block : blocks) block = scalloc(16, 16);
+    for (void *block : blocks) sfree(block);
+    return 2 * count;
+}
+
+uint64_t phase_pingpong() {
+    constexpr int iterations = 200000;
+    for (int i = 0; i < iterations; i++) sfree(smalloc(200));
+    return 2 * iterations;
+}
+
+// Random replacement over a wide size range, the workload where the fit
+// policy decides how much of the heap ends up as unusable holes.
+uint64_t phase_fragment() {
+    constexpr int slots = 512;
+    constexpr int iterations = 100000;
+    static void *blocks[slots];
+    uint64_t state = 0xD1B54A32D192ED03ull;
+    for (int i = 0; i < iterations; i++) {
+        uint64_t r = next_random(state);
+        void *&block = blocks[r % slots];
+        sfree(block);
+        // Log-uniform between 8 bytes and 4 KB.
+        size_t size = size_t(8) << ((r >> 16) % 10);
+        block = smalloc(size + (r >> 32) % size);
+    }
+    for (void *block : blocks) sfree(block);
+    return 2 * iterations + slots;
+}
+
+// Bursts of same-size allocations that are then all freed.
+uint64_t phase_burst() {
+    constexpr int count = 4096;
+    static void *blocks[count];
+    for (int round = 0; round < 8; round++) {
+        for (void *&block : blocks) block = smalloc(48);
+        for (void *block : blocks) sfree(block);
+    }
+    return 8 * 2 * count;
+}
+
+const Phase PHASES[] = {
+    {"fixed", phase_fixed},
+    {"mixed", phase_mixed},
+    {"realloc", phase_realloc},
+    {"calloc", phase_calloc},
+    {"pingpong", phase_pingpong},
+    {"fragment", phase_fragment},
+    {"burst", phase_burst},
+};
+
+double now_seconds() {
+    timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+bool run_phase(const Phase &phase, PhaseResult &result, bool &have_counters) {
+    int fds[2];
+    if (pipe(fds) != 0) return false;
+
+    pid_t pid = fork();
+    if (pid < 0) return false;
+    if (pid == 0) {
+        close(fds[0]);
+        PhaseResult child;
+        PerfCounters counters;
+        counters.start();
+        double start = now_seconds();
+        child.ops = phase.run();
+        child.seconds = now_seconds() - start;
+        child.footprint = _num_allocated_bytes() + _num_meta_data_bytes();
+        child.counters = counters.stop();
+        ssize_t written = write(fds[1], &child, sizeof(child));
+        _exit(written == sizeof(child) ? 0 : 1);
+    }
+
+    close(fds[1]);
+    ssize_t got = read(fds[0], &result, sizeof(result));
+    close(fds[0]);
+    int status = 0;
+    waitpid(pid, &status, 0);
+    for (bool valid : result.counters.valid) have_counters |= valid;
+    return got == sizeof(result) && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int main(int argc, char **argv) {
+    std::vector<const Phase *> selected;
+    for (int i = 1; i < argc; i++) {
+        const Phase *found = nullptr;
+        for (const Phase &phase : PHASES) {
+            if (std::strcmp(argv[i], phase.name) == 0) found = &phase;
+        }
+        if (!found) {
+            std::fprintf(stderr, "usage: %s [phase...]\nphases:", argv[0]);
+            for (const Phase &phase : PHASES) std::fprintf(stderr, " %s", phase.name);
+            std::fprintf(stderr, "\n");
+            return 2;
+        }
+        selected.push_back(found);
+    }
+    if (selected.empty()) {
+        for (const Phase &phase : PHASES) selected.push_back(&phase);
+    }
+
+    std::printf("%-10s %10s %10s %12s", "phase", "ops", "ns/op", "footprint");
+    PerfCounters::print_header(stdout);
+    std::printf("\n");
+
+    bool have_counters = false;
+    for (const Phase *phase : selected) {
+        PhaseResult result;
+        if (!run_phase(*phase, result, have_counters)) {
+            std::printf("%-10s crashed\n", phase->name);
+            continue;
+        }
+        std::printf("%-10s %10lu %10.1f %12lu", phase->name, static_cast<unsigned long>(result.ops),
+                    result.ops ? result.seconds * 1e9 / result.ops : 0.0, static_cast<unsigned long>(result.footprint));
+        PerfCounters::print_per_op(stdout, result.counters, result.ops);
+        std::printf("\n");
+    }
+    if (!have_counters) std::printf("\nperf events unavailable, only wall-clock time was measured\n");
+    return 0;
+}
@@ -0,0 +1,159 @@
+#include "my_stdlib.h"
+#include "perf_counters.h"
+#include "trace_reader.h"
+
+#include <cstdio>
+#include <ctime>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+// Replays a trace recorded with MALLOC_TRACE against whichever engine this
+// binary was linked with. Each measurement runs in a forked child so that it
+// starts from a fresh heap: one pass is timed with nothing but the allocator
+// calls in the loop, the other polls the engine statistics after every call.
+
+struct ReplayResult {
+    double seconds = 0;
+    size_t ops = 0;
+    size_t failed = 0;
+    size_t anomalies = 0;
+    size_t peak_footprint = 0;
+    size_t peak_requested = 0;
+    size_t final_footprint = 0;
+    size_t final_free_bytes = 0;
+    size_t final_requested = 0;
+    PerfSample counters;
+};
+
+double now_seconds() {
+    timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+size_t footprint() { return _num_allocated_bytes() + _num_meta_data_bytes(); }
+
+ReplayResult replay(const std::vector<TraceRecord> &ops, uint32_t max_id, bool sample) {
+    ReplayResult result;
+    // Dense id -> pointer table; ids are recycled by the recorder so this
+    // stays as small as the peak number of live blocks.
+    std::vector<void *> live(max_id + 1, nullptr);
+    std::vector<size_t> requested(sample ? max_id + 1 : 0, 0);
+    size_t live_requested = 0;
+
+    PerfCounters counters;
+    if (!sample) counters.start();
+    double start = now_seconds();
+    for (const TraceRecord &op : ops) {
+        void *ptr = nullptr;
+        switch (op.op) {
+            case TRACE_MALLOC:
+            case TRACE_CALLOC:
+                ptr = op.op == TRACE_MALLOC ? smalloc(op.size) : scalloc(1, op.size);
+                if (!ptr) result.failed++;
+                if (op.id == 0) break;
+                if (live[op.id]) result.anomalies++;
+                live[op.id] = ptr;
+                if (sample) {
+                    live_requested += op.size - requested[op.id];
+                    requested[op.id] = op.size;
+                }
+                break;
+            case TRACE_FREE:
+                if (op.id == 0) break;
+                if (!live[op.id]) {
+                    result.anomalies++;
+                    break;
+                }
+                sfree(live[op.id]);
+                live[op.id] = nullptr;
+                if (sample) {
+                    live_requested -= requested[op.id];
+                    requested[op.id] = 0;
+                }
+                break;
+            case TRACE_REALLOC:
+                ptr = srealloc(live[op.id], op.size);
+                if (!ptr) {
+                    result.failed++;
+                    break;
+                }
+                live[op.id] = nullptr;
+                if (op.new_id) live[op.new_id] = ptr;
+                if (sample) {
+                    live_requested += op.size - requested[op.id];
+                    requested[op.id] = 0;
+                    requested[op.new_id] = op.size;
+                }
+                break;
+        }
+
+        if (sample) {
+            result.peak_footprint = std::max(result.peak_footprint, footprint());
+            result.peak_requested = std::max(result.peak_requested, live_requested);
+        }
+    }
+    result.seconds = now_seconds() - start;
+    if (!sample) result.counters = counters.stop();
+    result.ops = ops.size();
+    result.final_footprint = footprint();
+    result.final_free_bytes = _num_free_bytes();
+    result.final_requested = live_requested;
+    return result;
+}
+
+bool replay_in_child(const std::vector<TraceRecord> &ops, uint32_t max_id, bool sample, ReplayResult &result) {
+    int fds[2];
+    if (pipe(fds) != 0) return false;
+
+    pid_t pid = fork();
+    if (pid < 0) return false;
+    if (pid == 0) {
+        close(fds[0]);
+        ReplayResult child = replay(ops, max_id, sample);
+        ssize_t written = write(fds[1], &child, sizeof(child));
+        _exit(written == sizeof(child) ? 0 : 1);
+    }
+
+    close(fds[1]);
+    ssize_t got = read(fds[0], &result, sizeof(result));
+    close(fds[0]);
+    int status = 0;
+    waitpid(pid, &status, 0);
+    return got == sizeof(result) && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+double percent(size_t part, size_t whole) { return whole ? 100.0 * part / whole : 0.0; }
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        std::fprintf(stderr, "usage: %s <trace>\n", argv[0]);
+        return 2;
+    }
+
+    std::vector<TraceRecord> ops;
+    uint32_t max_id = 0;
+    if (!load_trace(argv[1], ops, max_id)) return 1;
+
+    ReplayResult timed, sampled;
+    if (!replay_in_child(ops, max_id, false, timed) || !replay_in_child(ops, max_id, true, sampled)) {
+        std::fprintf(stderr, "replay crashed\n");
+        return 1;
+    }
+
+    std::printf("ops:               %zu (%zu failed, %zu unmatched)\n", timed.ops, timed.failed, timed.anomalies);
+    std::printf("time:              %.6f s (%.1f ns/op)\n", timed.seconds,
+                timed.ops ? timed.seconds * 1e9 / timed.ops : 0.0);
+    std::printf("per op:           ");
+    PerfCounters::print_header(stdout);
+    std::printf("\n                   ");
+    PerfCounters::print_per_op(stdout, timed.counters, timed.ops);
+    std::printf("\n");
+    std::printf("peak footprint:    %zu bytes (peak live %zu requested, %.2f%% overhead)\n", sampled.peak_footprint,
+                sampled.peak_requested, percent(sampled.peak_footprint - sampled.peak_requested, sampled.peak_footprint));
+    std::printf("final footprint:   %zu bytes (%zu requested)\n", sampled.final_footprint, sampled.final_requested);
+    std::printf("fragmentation:     %.2f%% of the footprint is free\n",
+                percent(sampled.final_free_bytes, sampled.final_footprint));
+    return 0;
+}
@@ -0,0 +1,203 @@
+#include "malloc_latency.h"
+#include "my_stdlib.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <sys/wait.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Tail-latency benchmark: times every smalloc and sfree from the outside, so
+// it works with any engine, and reports percentiles and the worst case per
+// operation in cycles (nanoseconds where there is no rdtsc). Each phase runs
+// in its own forked child on a fresh heap, warms up, and is then measured in
+// a steady state where the live set stays the same size.
+//
+// The overhead column is what the live blocks cost, metadata included, per
+// requested byte, taken when the live set is full. Requests the engine
+// refuses are counted as failed and leave their slot empty.
+//
+// usage: malloc_tail [phase...]
+
+struct Histogram {
+    uint64_t counts[LAT_NUM_BUCKETS] = {0};
+    uint64_t count = 0;
+    uint64_t max = 0;
+
+    void add(uint64_t value) {
+        counts[latency_bucket(value)]++;
+        count++;
+        if (value > max) max = value;
+    }
+
+    uint64_t percentile(double fraction) const {
+        uint64_t rank = static_cast<uint64_t>(fraction * count);
+        if (rank >= count) rank = count - 1;
+        uint64_t seen = 0;
+        for (int i = 0; i < LAT_NUM_BUCKETS; i++) {
+            seen += counts[i];
+            if (seen > rank) return latency_bucket_floor(i);
+        }
+        return latency_bucket_floor(LAT_NUM_BUCKETS - 1);
+    }
+};
+
+struct PhaseResult {
+    Histogram malloc_times;
+    Histogram free_times;
+    double overhead = 0;
+    uint64_t failed = 0;
+};
+
+struct Phase {
+    const char *name;
+    size_t min_size;
+    int size_steps;   // sizes are log-uniform over min_size << [0, size_steps)
+    int slots;
+};
+
+// Live sets sized to fit in malloc_3's 4 MB buddy region.
+const Phase PHASES[] = {
+    {"small", 16, 5, 4096},      // 16 B to 512 B
+    {"mixed", 16, 8, 2048},      // 16 B to 4 KB
+    {"large", 1024, 5, 256},     // 1 KB to 32 KB
+};
+
+constexpr int WARMUP_ROUNDS = 4;
+constexpr int MEASURED_ROUNDS = 32;
+
+uint64_t now() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+uint64_t next_random(uint64_t &state) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+size_t pick_size(const Phase &phase, uint64_t r) {
+    size_t size = phase.min_size << ((r >> 16) % phase.size_steps);
+    return size + (r >> 32) % size;
+}
+
+void run_phase(const Phase &phase, PhaseResult &result) {
+    static void *blocks[4096];
+    static size_t sizes[4096];
+    uint64_t state = 0x9E3779B97F4A7C15ull;
+
+    size_t requested = 0;
+    for (int i = 0; i < phase.slots; i++) {
+        sizes[i] = pick_size(phase, next_random(state));
+        blocks[i] = smalloc(sizes[i]);
+        if (blocks[i] == nullptr) {
+            result.failed++;
+            continue;
+        }
+        requested += sizes[i];
+    }
+    size_t used = _num_allocated_bytes() - _num_free_bytes() + _num_meta_data_bytes();
+    result.overhead = requested > 0 ? double(used) / requested : 0;
+
+    // Random replacement: free one slot, refill it with a new size.
+    for (int round = 0; round < WARMUP_ROUNDS + MEASURED_ROUNDS; round++) {
+        bool measured = round >= WARMUP_ROUNDS;
+        for (int i = 0; i < phase.slots; i++) {
+            uint64_t r = next_random(state);
+            int slot = r % phase.slots;
+            size_t size = pick_size(phase, r);
+
+            uint64_t start = now();
+            sfree(blocks[slot]);
+            uint64_t middle = now();
+            blocks[slot] = smalloc(size);
+            uint64_t end = now();
+            if (blocks[slot] == nullptr) result.failed++;
+            if (measured) {
+                result.free_times.add(middle - start);
+                result.malloc_times.add(end - middle);
+            }
+        }
+    }
+    for (int i = 0; i < phase.slots; i++) sfree(blocks[i]);
+}
+
+bool run_child(const Phase &phase, PhaseResult &result) {
+    int fds[2];
+    if (pipe(fds) != 0) return false;
+
+    pid_t pid = fork();
+    if (pid < 0) return false;
+    if (pid == 0) {
+        close(fds[0]);
+        static PhaseResult child;
+        run_phase(phase, child);
+        ssize_t written = write(fds[1], &child, sizeof(child));
+        _exit(written == sizeof(child) ? 0 : 1);
+    }
+
+    close(fds[1]);
+    size_t got = 0;
+    while (got < sizeof(result)) {
+        ssize_t n = read(fds[0], reinterpret_cast<char *>(&result) + got, sizeof(result) - got);
+        if (n <= 0) break;
+        got += n;
+    }
+    close(fds[0]);
+    int status = 0;
+    waitpid(pid, &status, 0);
+    return got == sizeof(result) && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+void print_row(const char *phase, const char *op, const Histogram &times, double overhead, uint64_t failed) {
+    std::printf("%-8s %-6s %10lu %8lu %8lu %8lu %10lu %9.2f %8lu\n", phase, op,
+                static_cast<unsigned long>(times.count), static_cast<unsigned long>(times.percentile(0.5)),
+                static_cast<unsigned long>(times.percentile(0.99)), static_cast<unsigned long>(times.percentile(0.999)),
+                static_cast<unsigned long>(times.max), overhead, static_cast<unsigned long>(failed));
+}
+
+int main(int argc, char **argv) {
+    const Phase *selected[sizeof(PHASES) / sizeof(PHASES[0])];
+    size_t count = 0;
+    for (int i = 1; i < argc; i++) {
+        const Phase *found = nullptr;
+        for (const Phase &phase : PHASES) {
+            if (std::strcmp(argv[i], phase.name) == 0) found = &phase;
+        }
+        if (!found || count == sizeof(selected) / sizeof(selected[0])) {
+            std::fprintf(stderr, "usage: %s [phase...]\nphases:", argv[0]);
+            for (const Phase &phase : PHASES) std::fprintf(stderr, " %s", phase.name);
+            std::fprintf(stderr, "\n");
+            return 2;
+        }
+        selected[count++] = found;
+    }
+    if (count == 0) {
+        for (const Phase &phase : PHASES) selected[count++] = &phase;
+    }
+
+    std::printf("%-8s %-6s %10s %8s %8s %8s %10s %9s %8s\n", "phase", "op", "count", "p50", "p99", "p99.9", "max",
+                "overhead", "failed");
+    for (size_t i = 0; i < count; i++) {
+        static PhaseResult result;
+        result = PhaseResult{};
+        if (!run_child(*selected[i], result)) {
+            std::printf("%-8s crashed\n", selected[i]->name);
+            continue;
+        }
+        print_row(selected[i]->name, "malloc", result.malloc_times, result.overhead, result.failed);
+        print_row(selected[i]->name, "free", result.free_times, result.overhead, 0);
+    }
+    return 0;
+}
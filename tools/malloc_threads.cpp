@@ -0,0 +1,187 @@
+#include "my_stdlib.h"
+#include "smalloc_ext.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+// Multithreaded allocator benchmark: many more threads than CPUs, each
+// running a small-block alloc/free loop over its own live set. The process
+// is pinned to the first few CPUs it may run on, so the engine's per-CPU
+// caches (MALLOC3_PER_CPU) hold memory in proportion to those CPUs while a
+// per-thread design would hold it in proportion to the threads.
+//
+// With "scale" it instead runs one thread per CPU for 1, 2, 4, ... CPUs; for
+// an engine without shared hot spots Mops/s doubles with the count. ns/op is
+// wall-clock time over all operations of all threads.
+//
+// usage: malloc_threads [threads] [cpus] [ops per thread]
+//        malloc_threads scale [ops per thread]
+
+constexpr int LIVE_SLOTS = 32;
+
+struct Config {
+    int threads = 1000;
+    int cpus = 4;
+    int ops = 20000;
+};
+
+Config config;
+pthread_barrier_t start_line;
+
+uint64_t next_random(uint64_t &state) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+void *worker(void *arg) {
+    uint64_t state = 0x9E3779B97F4A7C15ull + reinterpret_cast<uintptr_t>(arg);
+    void *blocks[LIVE_SLOTS] = {nullptr};
+    pthread_barrier_wait(&start_line);
+    for (int i = 0; i < config.ops; i++) {
+        uint64_t r = next_random(state);
+        void *&block = blocks[r % LIVE_SLOTS];
+        if (block) {
+            sfree(block);
+            block = nullptr;
+        } else {
+            // Log-uniform between 16 bytes and 2 KB.
+            size_t size = size_t(16) << ((r >> 16) % 7);
+            block = smalloc(size + (r >> 32) % size);
+        }
+    }
+    for (void *block : blocks) sfree(block);
+    return nullptr;
+}
+
+double now_seconds() {
+    timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Restricts the process to the first count CPUs it is allowed on. Returns
+// how many it got.
+int pin_cpus(int count) {
+    cpu_set_t allowed, wanted;
+    CPU_ZERO(&wanted);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return 0;
+    int pinned = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE && pinned < count; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed)) continue;
+        CPU_SET(cpu, &wanted);
+        pinned++;
+    }
+    return sched_setaffinity(0, sizeof(wanted), &wanted) == 0 ? pinned : 0;
+}
+
+struct RunResult {
+    int cpus = 0;
+    double seconds = 0;
+    size_t heap_bytes = 0;
+    size_t cached_bytes = 0;
+};
+
+// One measurement in a forked child, so every run starts on a fresh heap.
+bool run(RunResult &result) {
+    int fds[2];
+    if (pipe(fds) != 0) return false;
+
+    pid_t pid = fork();
+    if (pid < 0) return false;
+    if (pid == 0) {
+        close(fds[0]);
+        RunResult child;
+        child.cpus = pin_cpus(config.cpus);
+        if (child.cpus == 0) _exit(1);
+
+        std::vector<pthread_t> threads(config.threads);
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setstacksize(&attr, 64 * 1024);
+        pthread_barrier_init(&start_line, nullptr, config.threads + 1);
+        for (int i = 0; i < config.threads; i++) {
+            if (pthread_create(&threads[i], &attr, worker, reinterpret_cast<void *>(uintptr_t(i))) != 0) _exit(1);
+        }
+        pthread_attr_destroy(&attr);
+
+        double start = now_seconds();
+        pthread_barrier_wait(&start_line);
+        for (pthread_t thread : threads) pthread_join(thread, nullptr);
+        child.seconds = now_seconds() - start;
+
+        heap_stats stats;
+        smalloc_stats(&stats);
+        child.heap_bytes = stats.heap_bytes;
+        child.cached_bytes = stats.cpu_cache_bytes;
+        ssize_t written = write(fds[1], &child, sizeof(child));
+        _exit(written == sizeof(child) ? 0 : 1);
+    }
+
+    close(fds[1]);
+    ssize_t got = read(fds[0], &result, sizeof(result));
+    close(fds[0]);
+    int status = 0;
+    waitpid(pid, &status, 0);
+    return got == sizeof(result) && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+void print_result(const RunResult &result) {
+    uint64_t ops = uint64_t(config.threads) * config.ops;
+    std::printf("%8d %5d %12lu %10.1f %10.2f %14zu %14zu %14.1f\n", config.threads, result.cpus,
+                static_cast<unsigned long>(ops), result.seconds * 1e9 / ops, ops / result.seconds * 1e-6,
+                result.heap_bytes, result.cached_bytes, double(result.cached_bytes) / config.threads);
+}
+
+int usage(const char *name) {
+    std::fprintf(stderr, "usage: %s [threads] [cpus] [ops per thread]\n       %s scale [ops per thread]\n", name, name);
+    return 2;
+}
+
+int main(int argc, char **argv) {
+    // scale: one thread per CPU, doubling up to every CPU we may run on.
+    bool scale = argc > 1 && std::strcmp(argv[1], "scale") == 0;
+    if (scale) {
+        if (argc > 3) return usage(argv[0]);
+        if (argc > 2) config.ops = std::atoi(argv[2]);
+    } else {
+        if (argc > 4) return usage(argv[0]);
+        if (argc > 1) config.threads = std::atoi(argv[1]);
+        if (argc > 2) config.cpus = std::atoi(argv[2]);
+        if (argc > 3) config.ops = std::atoi(argv[3]);
+    }
+    if (config.threads <= 0 || config.cpus <= 0 || config.ops <= 0) return usage(argv[0]);
+
+    std::printf("%8s %5s %12s %10s %10s %14s %14s %14s\n", "threads", "cpus", "ops", "ns/op", "Mops/s", "heap_bytes",
+                "cached_bytes", "cached/thread");
+    std::vector<int> counts;
+    if (scale) {
+        cpu_set_t allowed;
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return 1;
+        int available = CPU_COUNT(&allowed);
+        for (int count = 1; count < available; count *= 2) counts.push_back(count);
+        counts.push_back(available);
+    } else {
+        counts.push_back(config.threads);
+    }
+
+    for (int count : counts) {
+        if (scale) config.threads = config.cpus = count;
+        RunResult result;
+        if (!run(result)) {
+            std::printf("%8d failed\n", config.threads);
+            continue;
+        }
+        print_result(result);
+    }
+    return 0;
+}
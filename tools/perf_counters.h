@@ -0,0 +1,126 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Thin wrapper over perf_event_open for the benchmark tools. Each counter is
+// opened on its own so that a kernel or sandbox refusing one event (no PMU in
+// a VM, perf_event_paranoid, seccomp) only loses that column; when nothing can
+// be opened the harness still reports wall-clock time.
+
+enum PerfCounter {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_L1D_MISSES,
+    PERF_LLC_MISSES,
+    PERF_DTLB_MISSES,
+    PERF_PAGE_FAULTS,
+    PERF_NUM_COUNTERS,
+};
+
+constexpr const char *PERF_COUNTER_NAMES[PERF_NUM_COUNTERS] = {
+    "cycles", "instructions", "L1D-miss", "LLC-miss", "dTLB-miss", "page-faults",
+};
+
+struct PerfSample {
+    bool valid[PERF_NUM_COUNTERS] = {};
+    uint64_t value[PERF_NUM_COUNTERS] = {};
+};
+
+class PerfCounters {
+public:
+    PerfCounters() {
+        open_counter(PERF_CYCLES, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+        open_counter(PERF_INSTRUCTIONS, PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+        open_counter(PERF_L1D_MISSES, PERF_TYPE_HW_CACHE, cache_event(PERF_COUNT_HW_CACHE_L1D));
+        open_counter(PERF_LLC_MISSES, PERF_TYPE_HW_CACHE, cache_event(PERF_COUNT_HW_CACHE_LL));
+        open_counter(PERF_DTLB_MISSES, PERF_TYPE_HW_CACHE, cache_event(PERF_COUNT_HW_CACHE_DTLB));
+        open_counter(PERF_PAGE_FAULTS, PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS);
+    }
+
+    ~PerfCounters() {
+        for (int fd : fds_) {
+            if (fd >= 0) close(fd);
+        }
+    }
+
+    PerfCounters(const PerfCounters &) = delete;
+    PerfCounters &operator=(const PerfCounters &) = delete;
+
+    bool any() const {
+        for (int fd : fds_) {
+            if (fd >= 0) return true;
+        }
+        return false;
+    }
+
+    void start() {
+        for (int fd : fds_) {
+            if (fd < 0) continue;
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+
+    PerfSample stop() {
+        PerfSample sample;
+        for (int i = 0; i < PERF_NUM_COUNTERS; i++) {
+            if (fds_[i] < 0) continue;
+            ioctl(fds_[i], PERF_EVENT_IOC_DISABLE, 0);
+
+            // value, time_enabled, time_running; scale up if the PMU multiplexed.
+            uint64_t data[3] = {};
+            if (read(fds_[i], data, sizeof(data)) != sizeof(data) || data[2] == 0) continue;
+            sample.value[i] = data[2] < data[1] ? static_cast<uint64_t>(double(data[0]) * data[1] / data[2]) : data[0];
+            sample.valid[i] = true;
+        }
+        return sample;
+    }
+
+    static void print_header(FILE *out) {
+        for (const char *name : PERF_COUNTER_NAMES) fprintf(out, " %12s", name);
+    }
+
+    // Prints every counter divided by ops, or n/a for counters that could not be opened.
+    static void print_per_op(FILE *out, const PerfSample &sample, uint64_t ops) {
+        for (int i = 0; i < PERF_NUM_COUNTERS; i++) {
+            if (sample.valid[i] && ops) fprintf(out, " %12.3f", double(sample.value[i]) / ops);
+            else fprintf(out, " %12s", "n/a");
+        }
+    }
+
+private:
+    static uint64_t cache_event(uint64_t cache) {
+        return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    }
+
+    void open_counter(PerfCounter counter, uint32_t type, uint64_t config) {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.exclude_hv = 1;
+        attr.inherit = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        // Count the allocator's kernel side too (sbrk, mmap, faults) when allowed.
+        int fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+        if (fd < 0) {
+            attr.exclude_kernel = 1;
+            fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+        }
+        fds_[counter] = fd;
+    }
+
+    int fds_[PERF_NUM_COUNTERS] = {-1, -1, -1, -1, -1, -1};
+};
+
+#endif /* PERF_COUNTERS_H */
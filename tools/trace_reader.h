@@ -0,0 +1,69 @@
+#ifndef TRACE_READER_H
+#define TRACE_READER_H
+
+#include "malloc_trace.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <vector>
+
+// Flattened trace event as consumed by the offline tools.
+struct TraceRecord {
+    uint64_t time_ns;
+    uint64_t size;
+    uint32_t id;
+    uint32_t new_id;
+    uint8_t op;
+};
+
+inline bool load_trace(const char *path, std::vector<TraceRecord> &ops, uint32_t &max_id) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        std::fprintf(stderr, "cannot open %s\n", path);
+        return false;
+    }
+    std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+    const uint8_t *in = data.data();
+    const uint8_t *end = in + data.size();
+    if (data.size() < sizeof(TRACE_MAGIC) + 1 || memcmp(in, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0 ||
+        in[sizeof(TRACE_MAGIC)] != TRACE_VERSION) {
+        std::fprintf(stderr, "%s is not a version %d trace\n", path, TRACE_VERSION);
+        return false;
+    }
+    in += sizeof(TRACE_MAGIC) + 1;
+
+    max_id = 0;
+    while (in < end) {
+        uint64_t thread = 0, base_ns = 0, len = 0;
+        if (*in++ != TRACE_CHUNK || !(in = trace_get_varint(in, end, &thread)) ||
+            !(in = trace_get_varint(in, end, &base_ns)) || !(in = trace_get_varint(in, end, &len)) ||
+            len > static_cast<uint64_t>(end - in)) {
+            std::fprintf(stderr, "%s: truncated or corrupt chunk, using what was read\n", path);
+            break;
+        }
+
+        const uint8_t *chunk_end = in + len;
+        TraceEvent event;
+        event.time_ns = base_ns;
+        while (in < chunk_end) {
+            if (!(in = trace_decode_event(in, chunk_end, &event))) {
+                std::fprintf(stderr, "%s: corrupt event in thread %lu\n", path, static_cast<unsigned long>(thread));
+                return false;
+            }
+            ops.push_back({event.time_ns, event.size, event.id, event.new_id, event.op});
+            max_id = std::max(max_id, std::max(event.id, event.new_id));
+        }
+    }
+
+    // Chunks are written per thread as buffers fill up; put the events back in
+    // the order they happened.
+    std::stable_sort(ops.begin(), ops.end(),
+                     [](const TraceRecord &a, const TraceRecord &b) { return a.time_ns < b.time_ns; });
+    return true;
+}
+
+#endif /* TRACE_READER_H */